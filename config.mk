@@ -110,7 +110,7 @@ UPDATE_METHOD = afs
 # A list of the test programs you want compiled in from the user/progs
 # directory.
 #
-STUDENTTESTS =
+STUDENTTESTS = frame_alloc_bench thread_fork_storm
 
 ###########################################################################
 # Data files provided by course staff to build into the RAM disk
@@ -152,7 +152,9 @@ SYSCALL_OBJS = fork_stub.o exec_stub.o set_status_stub.o sleep_stub.o\
 			   getchar_stub.o readline_stub.o print_stub.o \
 			   set_term_color_stub.o set_cursor_pos_stub.o \
 			   get_cursor_pos_stub.o halt_stub.o readfile_stub.o \
-			   misbehave_stub.o swexn_stub.o thread_fork_stub.o
+			   misbehave_stub.o swexn_stub.o thread_fork_stub.o \
+			   futex_wait_stub.o futex_wake_stub.o \
+			   set_fault_around_stub.o get_kernel_stats_stub.o
 
 ###########################################################################
 # Object files for your automatic stack handling
@@ -174,7 +176,10 @@ KERNEL_OBJS = console.o kernel.o loader.o malloc_wrappers.o interrupt.o \
 			  xchange_stub.o timer.o system_call.o fault_handler.o \
 			  keyboard.o context.o context_switcher.o scheduler.o \
 			  stop_stub.o mem_allocation.o segmentation.o \
-			  virtual_interrupt.o
+			  virtual_interrupt.o invlpg_stub.o page_cache.o vma.o \
+			  user_copy.o user_copy_stub.o swap.o merge.o slab.o \
+			  kernel_stack.o \
+			  paging_pool.o timer_wheel.o wait_queue.o cond.o futex.o
 
 ###########################################################################
 # WARNING: Do not put **test** programs into the REQPROGS variables.  Your
@@ -0,0 +1,114 @@
+/**
+ * @file cond.c
+ * @brief implementation of condition variables on top of
+ *        wait queues
+ * 
+ * Waiting releases the mutex and blocks with interrupts disabled, so a
+ * signal sent once the mutex is released cannot be missed.
+ * 
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @bug No known bugs.
+ */
+
+#include <cond.h>
+#include <mutex.h>
+#include <wait_queue.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <ctrl_blk.h>
+#include <asm.h>
+#include <eflags.h>
+
+/**
+ * @brief This function should initialize the condition variable
+ *        pointed to by cv.
+ * 
+ * It is illegal for an application to use a condition variable
+ * before it has been initialized or to initialize one when it is
+ * already initialized and in use.
+ *
+ * @param cv A pointer to the condition variable.
+ * @return 0 on success, a negative number on failure.
+ */
+int cond_init(cond_t *cv) {
+    affirm(cv != NULL);
+    init_wait_queue(&(cv->waiters));
+    return 0;
+}
+
+/**
+ * @brief This function should deactivate the condition variable
+ *        pointed to by cv.
+ * 
+ * It is illegal for an application to destroy a condition variable
+ * while threads are waiting on it.
+ *
+ * @param cv A pointer to the condition variable.
+ */
+void cond_destroy(cond_t *cv) {
+    affirm(cv != NULL);
+    affirm(Q_GET_FRONT(&(cv->waiters)) == NULL);
+}
+
+/**
+ * @brief Atomically release the mutex and wait for the condition
+ *        variable to be signaled, then lock the mutex again.
+ * 
+ * The caller must hold the mutex. It may wake up without a signal if
+ * there was no other thread to run, so the condition should be checked
+ * again in a loop.
+ *
+ * @param cv A pointer to the condition variable.
+ * @param mp A pointer to the mutex.
+ */
+void cond_wait(cond_t *cv, mutex_t *mp) {
+    affirm(cv != NULL && mp != NULL);
+
+    bool interrupt_enable_flag = ((get_eflags() & EFL_IF) != 0);
+    disable_interrupts();
+    mutex_unlock(mp);
+    if (wait_on_queue(&(cv->waiters), COND_WAIT, NULL) < 0) {
+        // Nothing else can run, so let an interrupt change that.
+        enable_interrupts();
+        disable_interrupts();
+    }
+    mutex_lock(mp);
+    if (interrupt_enable_flag) {
+        enable_interrupts();
+    }
+}
+
+/**
+ * @brief Wake up the thread that has waited on the condition variable
+ *        the longest, if any.
+ *
+ * @param cv A pointer to the condition variable.
+ */
+void cond_signal(cond_t *cv) {
+    affirm(cv != NULL);
+
+    bool interrupt_enable_flag = ((get_eflags() & EFL_IF) != 0);
+    disable_interrupts();
+    wake_one(&(cv->waiters));
+    if (interrupt_enable_flag) {
+        enable_interrupts();
+    }
+}
+
+/**
+ * @brief Wake up every thread waiting on the condition variable.
+ *
+ * @param cv A pointer to the condition variable.
+ */
+void cond_broadcast(cond_t *cv) {
+    affirm(cv != NULL);
+
+    bool interrupt_enable_flag = ((get_eflags() & EFL_IF) != 0);
+    disable_interrupts();
+    wake_all(&(cv->waiters));
+    if (interrupt_enable_flag) {
+        enable_interrupts();
+    }
+}
@@ -41,40 +41,28 @@ int switch_context(tcb_t *target_tcb_ptr, int state, blocking_detail_t *blocking
 
     // lprintf("--- before alter_state ---");
     // lprintf("threads in RUNNING_STATE:");
-    // if (thread_lists[RUNNING_STATE] != NULL) {
-    //     tcb_ptr_node_t *node_ptr = thread_lists[RUNNING_STATE];
-    //     do {
-    //         lprintf("thread %d", node_ptr->data->tid);
-    //         node_ptr = node_ptr->next;
-    //     } while (node_ptr != thread_lists[RUNNING_STATE]);
+    // tcb_t *running_tcb_ptr;
+    // Q_FOREACH(running_tcb_ptr, &(thread_lists[RUNNING_STATE]), state_link) {
+    //     lprintf("thread %d", running_tcb_ptr->tid);
     // }
     // lprintf("threads in READY_STATE:");
-    // if (thread_lists[READY_STATE] != NULL) {
-    //     tcb_ptr_node_t *node_ptr = thread_lists[READY_STATE];
-    //     do {
-    //         lprintf("thread %d", node_ptr->data->tid);
-    //         node_ptr = node_ptr->next;
-    //     } while (node_ptr != thread_lists[READY_STATE]);
+    // tcb_t *ready_tcb_ptr;
+    // Q_FOREACH(ready_tcb_ptr, &(thread_lists[READY_STATE]), state_link) {
+    //     lprintf("thread %d", ready_tcb_ptr->tid);
     // }
-    tcb_t *original_tcb_ptr = thread_lists[RUNNING_STATE]->data;
+    tcb_t *original_tcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]));
     alter_state(original_tcb_ptr, state, blocking_detail_ptr);
     alter_state(target_tcb_ptr, RUNNING_STATE, NULL);
     // lprintf("--- after alter_state ---");
     // lprintf("threads in RUNNING_STATE:");
-    // if (thread_lists[RUNNING_STATE] != NULL) {
-    //     tcb_ptr_node_t *node_ptr = thread_lists[RUNNING_STATE];
-    //     do {
-    //         lprintf("thread %d", node_ptr->data->tid);
-    //         node_ptr = node_ptr->next;
-    //     } while (node_ptr != thread_lists[RUNNING_STATE]);
+    // tcb_t *running_tcb_ptr;
+    // Q_FOREACH(running_tcb_ptr, &(thread_lists[RUNNING_STATE]), state_link) {
+    //     lprintf("thread %d", running_tcb_ptr->tid);
     // }
     // lprintf("threads in READY_STATE:");
-    // if (thread_lists[READY_STATE] != NULL) {
-    //     tcb_ptr_node_t *node_ptr = thread_lists[READY_STATE];
-    //     do {
-    //         lprintf("thread %d", node_ptr->data->tid);
-    //         node_ptr = node_ptr->next;
-    //     } while (node_ptr != thread_lists[READY_STATE]);
+    // tcb_t *ready_tcb_ptr;
+    // Q_FOREACH(ready_tcb_ptr, &(thread_lists[READY_STATE]), state_link) {
+    //     lprintf("thread %d", ready_tcb_ptr->tid);
     // }
 
     set_esp0((uint32_t)(target_tcb_ptr->kernel_stack + KERNEL_STACK_LEN));
@@ -14,9 +14,13 @@
 #include <mutex.h>
 #include <context.h>
 #include <vm.h>
+#include <swap.h>
+#include <slab.h>
+#include <kernel_stack.h>
 #include <asm.h>
 #include <eflags.h>
 #include <stdbool.h>
+#include <timer_wheel.h>
 
 // Although root_pcb_node_ptr is a global variable,
 // it may not change once fixed. In the sense that
@@ -31,8 +35,47 @@ mutex_t thread_manager_lock;
 // observed with interrupts enabled. Please note that
 // every list in thread_lists keeps elements in its
 // own order. alter_state is the official way of
-// modifying thread_lists.
-tcb_ptr_node_t *thread_lists[THREAD_LIST_COUNT] = {NULL};
+// modifying thread_lists. The lists link TCBs through
+// their state_link, so moving a thread between them
+// allocates nothing.
+tcb_queue_t thread_lists[THREAD_LIST_COUNT];
+// the caches nodes of the lists of threads and processes come from
+slab_cache_t tcb_node_cache;
+slab_cache_t pcb_node_cache;
+// Every thread until it is reaped, hashed by TID. TIDs are handed out
+// in order, so the buckets fill up evenly. Like thread_lists, it is
+// modified only when interrupts are disabled.
+tcb_queue_t tid_table[TID_TABLE_LEN];
+
+/**
+ * @brief Put a thread into the list of ready state, right after the
+ *        last ready thread of the same process if there is one, and
+ *        at the tail otherwise.
+ * 
+ * This function should be called only when interrupts are disabled.
+ * 
+ * @param tcb_ptr pointer to the TCB of the thread, which is in no list
+ */
+void insert_ready_thread(tcb_t *tcb_ptr);
+
+/**
+ * @brief Take a thread out of the list of ready state, keeping the
+ *        ready threads of its process together.
+ * 
+ * This function should be called only when interrupts are disabled.
+ * 
+ * @param tcb_ptr pointer to the TCB of the thread, which is ready
+ */
+void remove_ready_thread(tcb_t *tcb_ptr);
+
+/**
+ * @brief Put a thread into the TID table, so that find_tcb finds it.
+ * 
+ * This function should be called only when interrupts are disabled.
+ * 
+ * @param tcb_ptr pointer to the TCB of the thread, which has its TID
+ */
+void register_tid(tcb_t *tcb_ptr);
 
 /**
  * @brief initialize the internal bookkeeping for TCBs and PCBs
@@ -40,44 +83,77 @@ tcb_ptr_node_t *thread_lists[THREAD_LIST_COUNT] = {NULL};
  * @return a negative value on failure, 0 otherwise
  */
 int init_ctrl_blk(void) {
+    if (
+        slab_cache_init(
+            &tcb_node_cache,
+            "tcb_node_t",
+            sizeof(tcb_node_t),
+            NULL,
+            NULL
+        ) < 0 ||
+        slab_cache_init(
+            &pcb_node_cache,
+            "pcb_node_t",
+            sizeof(pcb_node_t),
+            NULL,
+            NULL
+        ) < 0
+    ) {
+        return -1;
+    }
+    int list_idx;
+    for (list_idx = 0; list_idx < THREAD_LIST_COUNT; list_idx++) {
+        Q_INIT_HEAD(&(thread_lists[list_idx]));
+    }
+    int bucket_idx;
+    for (bucket_idx = 0; bucket_idx < TID_TABLE_LEN; bucket_idx++) {
+        Q_INIT_HEAD(&(tid_table[bucket_idx]));
+    }
+
     bool success;
-    PUSH_FRONT(
+    PUSH_FRONT_CACHED(
         pcb_node_t,
+        &pcb_node_cache,
         root_pcb_node_ptr,
         ((pcb_t){
-            .page_directory = construct_page_dir()
+            .page_directory = construct_page_dir(),
+            .fault_around = {.pages_max = FAULT_AROUND_PAGES_DEFAULT}
         }),
         success
     );
     if (!success) {
         return -1;
     }
-    PUSH_FRONT(
+    uint32_t *kernel_stack = alloc_kernel_stack();
+    if (kernel_stack == NULL) {
+        POP_BACK_CACHED(pcb_node_t, &pcb_node_cache, root_pcb_node_ptr);
+        return -1;
+    }
+    PUSH_FRONT_CACHED(
         tcb_node_t,
+        &tcb_node_cache,
         root_pcb_node_ptr->data.tcb_list,
         ((tcb_t){
             .tid = thread_count++,
             .pcb_ptr = &(root_pcb_node_ptr->data),
-            .state = RUNNING_STATE
+            .state = RUNNING_STATE,
+            .kernel_stack = kernel_stack
         }),
         success
     );
     if (!success) {
-        POP_BACK(pcb_node_t, root_pcb_node_ptr);
+        free_kernel_stack(kernel_stack);
+        POP_BACK_CACHED(pcb_node_t, &pcb_node_cache, root_pcb_node_ptr);
         return -1;
     }
     mutex_init(&(root_pcb_node_ptr->data.lock));
-    PUSH_FRONT(
-        tcb_ptr_node_t,
-        thread_lists[RUNNING_STATE],
+    cond_init(&(root_pcb_node_ptr->data.child_exit_cond));
+    Q_INSERT_FRONT(
+        &(thread_lists[RUNNING_STATE]),
         &(root_pcb_node_ptr->data.tcb_list->data),
-        success
+        state_link
     );
-    if (!success) {
-        POP_BACK(tcb_node_t, root_pcb_node_ptr->data.tcb_list);
-        POP_BACK(pcb_node_t, root_pcb_node_ptr);
-        return -1;
-    }
+    register_tid(&(root_pcb_node_ptr->data.tcb_list->data));
 
     mutex_init(&thread_manager_lock);
 
@@ -91,11 +167,12 @@ int thread_fork_ctrl_blk(ureg_t *ureg_ptr) {
         return -1;
     }
 
-    tcb_t *old_tcb_ptr = thread_lists[RUNNING_STATE]->data;
+    tcb_t *old_tcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]));
     pcb_t *pcb_ptr = old_tcb_ptr->pcb_ptr;
     bool success;
-    PUSH_BACK(
+    PUSH_BACK_CACHED(
         tcb_node_t,
+        &tcb_node_cache,
         pcb_ptr->tcb_list,
         *old_tcb_ptr,
         success
@@ -105,6 +182,14 @@ int thread_fork_ctrl_blk(ureg_t *ureg_ptr) {
     }
     tcb_t *new_tcb_ptr = &(pcb_ptr->tcb_list->previous->data);
 
+    // The copy is in no list yet, whatever the links of the old TCB say,
+    // and has a stack of its own.
+    Q_INIT_ELEM(new_tcb_ptr, state_link);
+    new_tcb_ptr->kernel_stack = alloc_kernel_stack();
+    if (new_tcb_ptr->kernel_stack == NULL) {
+        POP_BACK_CACHED(tcb_node_t, &tcb_node_cache, pcb_ptr->tcb_list);
+        return -1;
+    }
     new_tcb_ptr->exception_stack = NULL;
     new_tcb_ptr->state = READY_STATE;
     mutex_lock(&thread_manager_lock);
@@ -114,42 +199,9 @@ int thread_fork_ctrl_blk(ureg_t *ureg_ptr) {
 
     save_ureg(new_tcb_ptr, ureg_ptr);
 
-    tcb_ptr_node_t *new_node_ptr = (tcb_ptr_node_t *)malloc(
-        sizeof(tcb_ptr_node_t)
-    );
-    if (new_node_ptr == NULL) {
-        POP_BACK(tcb_node_t, pcb_ptr->tcb_list);
-        return -1;
-    }
     disable_interrupts();
-    new_node_ptr->data = new_tcb_ptr;
-    bool process_found = false;
-    if (thread_lists[READY_STATE] != NULL) {
-        tcb_ptr_node_t *node_ptr = thread_lists[READY_STATE]->previous;
-        do {
-            if (node_ptr->data->pcb_ptr == pcb_ptr) {
-                new_node_ptr->next = node_ptr->next;
-                new_node_ptr->previous = node_ptr;
-                new_node_ptr->next->previous = new_node_ptr;
-                new_node_ptr->previous->next = new_node_ptr;
-                process_found = true;
-                break;
-            }
-            node_ptr = node_ptr->previous;
-        } while (node_ptr != thread_lists[READY_STATE]->previous);
-    }
-    if (!process_found) {
-        if (thread_lists[READY_STATE] == NULL) {
-            new_node_ptr->next = new_node_ptr;
-            new_node_ptr->previous = new_node_ptr;
-            thread_lists[READY_STATE] = new_node_ptr;
-        } else {
-            new_node_ptr->next = thread_lists[READY_STATE];
-            new_node_ptr->previous = thread_lists[READY_STATE]->previous;
-            new_node_ptr->next->previous = new_node_ptr;
-            new_node_ptr->previous->next = new_node_ptr;
-        }
-    }
+    register_tid(new_tcb_ptr);
+    insert_ready_thread(new_tcb_ptr);
     enable_interrupts();
 
     return new_tid;
@@ -177,186 +229,165 @@ int fork_ctrl_blk(ureg_t *ureg_ptr) {
         lprintf("page_dir malloc failed");
         return -1;
     }
-    
-    // prepare buffer for coping user pages
-    char *buf = (char*)malloc(PAGE_SIZE);
-    if(buf == NULL) {
-        destruct_page_dir(child_process_pd);
-        lprintf("buf malloc failed");
-        return -1;
-    }
 
-    tcb_t *old_tcb_ptr = thread_lists[RUNNING_STATE]->data;
+    tcb_t *old_tcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]));
     pcb_t *parent_pcb_ptr = old_tcb_ptr->pcb_ptr;
     bool success;
-    PUSH_BACK(
+    PUSH_BACK_CACHED(
         pcb_node_t,
+        &pcb_node_cache,
         parent_pcb_ptr->child_pcb_list,
         ((pcb_t){
             .parent_pcb_ptr = parent_pcb_ptr,
-            .page_directory = child_process_pd
+            .page_directory = child_process_pd,
+            .swappable = true,
+            // the child starts counting from scratch
+            .fault_around = {
+                .pages_max = parent_pcb_ptr->fault_around.pages_max
+            }
         }),
         success
     );
     if (!success) {
-        free(buf);
         destruct_page_dir(child_process_pd);
         lprintf("child pcb malloc failed");
         return -1;
     }
     pcb_t *child_pcb_ptr = &(parent_pcb_ptr->child_pcb_list->previous->data);
     mutex_init(&(child_pcb_ptr->lock));
+    cond_init(&(child_pcb_ptr->child_exit_cond));
 
     // copy user pages
     uint32_t parent_cr3 = get_cr3();
     pde_t *parent_process_pd = (pde_t *)((parent_cr3 >> PAGE_SHIFT) << PAGE_SHIFT);
     uint32_t child_cr3 = (parent_cr3 & ~((~0 >> PAGE_SHIFT) << PAGE_SHIFT)) |
         (uint32_t)child_process_pd;
-    uint64_t current_page = USER_PAGE_START;
-    while (current_page < VIRTUAL_ADDR_END) {
-        mapping_info_t mapping_info;
-        check_user_page(parent_process_pd, current_page, &mapping_info);
-        switch (mapping_info) {
-            case PDE_NOT_PRESENT: {
-                uint64_t pde_idx = (current_page >> PAGE_SHIFT) / PTE_COUNT;
-                uint64_t next_page = ((pde_idx + 1) * PTE_COUNT) << PAGE_SHIFT;
-
-                uint32_t availability;
-                get_availability(parent_process_pd, current_page, &availability);
-                if (availability != PAGE_UNAVAILABLE) {
-                    for (uint64_t i = current_page; i < next_page; i += PAGE_SIZE) {
-                        if ((set_availability(child_process_pd, i, availability)) < 0) {
-                            POP_BACK(pcb_node_t, parent_pcb_ptr->child_pcb_list);
-                            free(buf);
-                            destruct_page_dir(child_process_pd);
-                            return -1;
-                        }
-                    }
-                }
-                
-                current_page = next_page;
+    // parent pages turning copy-on-write are invalidated together
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, parent_process_pd);
+    // Only the page tables the parent has are walked. Pages not mapped
+    // are described by the areas copied below. The lock keeps the
+    // parent's pages from moving to the compressed store meanwhile.
+    mutex_lock(&(parent_pcb_ptr->lock));
+    bool copied = true;
+    page_iter_t iter;
+    page_iter_init(
+        &iter,
+        parent_process_pd,
+        USER_PAGE_START,
+        USER_MEM_END - USER_PAGE_START
+    );
+    while (copied && page_iter_next(&iter)) {
+        switch (iter.mapping_info) {
+            case PDE_NOT_PRESENT:
+            case PTE_NOT_PRESENT: {
                 break;
             }
-            case PTE_NOT_PRESENT: {
-                uint32_t availability;
-                get_availability(parent_process_pd, current_page, &availability);
-                if (set_availability(
-                    child_process_pd,
-                    current_page,
-                    availability
-                ) < 0) {
-                    POP_BACK(pcb_node_t, parent_pcb_ptr->child_pcb_list);
-                    free(buf);
-                    destruct_page_dir(child_process_pd);
-                    return -1;
+            case ZERO_FRAME_MAPPED: {
+                if (map_zero_frame(child_process_pd, iter.page) < 0) {
+                    copied = false;
                 }
-                current_page += PAGE_SIZE;
                 break;
             }
-            case ZERO_FRAME_MAPPED: {
-                if (
-                    set_availability(
-                        child_process_pd,
-                        current_page,
-                        PAGE_AVAILABLE
-                    ) < 0 ||
-                    map_zero_frame(
-                        child_process_pd,
-                        current_page
-                    ) < 0
-                ) {
-                    POP_BACK(pcb_node_t, parent_pcb_ptr->child_pcb_list);
-                    free(buf);
-                    destruct_page_dir(child_process_pd);
-                    return -1;
+            case SWAPPED_OUT: {
+                if (share_swap_slot(
+                    parent_process_pd,
+                    child_process_pd,
+                    iter.page
+                ) < 0) {
+                    copied = false;
                 }
-                current_page += PAGE_SIZE;
                 break;
             }
             case NEW_FRAME_MAPPED: {
+                // Share the frame copy-on-write. Only if too many page
+                // directories share it already will it be copied now.
                 if (
-                    set_availability(
+                    share_frame(
+                        parent_process_pd,
                         child_process_pd,
-                        current_page,
-                        PAGE_AVAILABLE
-                    ) < 0 ||
-                    map_new_frame(
+                        iter.page,
+                        &batch
+                    ) < 0 &&
+                    copy_frame(
                         child_process_pd,
-                        current_page
+                        iter.page
                     ) < 0
                 ) {
-                    POP_BACK(pcb_node_t, parent_pcb_ptr->child_pcb_list);
-                    free(buf);
-                    destruct_page_dir(child_process_pd);
-                    return -1;
+                    copied = false;
                 }
-
-                memmove(buf, (void *)(uint32_t)current_page, PAGE_SIZE);
-                parent_pcb_ptr->page_directory = child_process_pd;
-                set_cr3(child_cr3);
-                memmove((void *)(uint32_t)current_page, buf, PAGE_SIZE);
-                parent_pcb_ptr->page_directory = parent_process_pd;
-                set_cr3(parent_cr3);
-                
-                uint32_t access;
-                get_access(parent_process_pd, current_page, &access);
-                set_access(child_process_pd, current_page, access);
-
-                current_page += PAGE_SIZE;
                 break;
             }
             default: {
-                POP_BACK(pcb_node_t, parent_pcb_ptr->child_pcb_list);
-                free(buf);
-                destruct_page_dir(child_process_pd);
-                return -1;
+                copied = false;
+                break;
             }
         }
     }
 
-    free(buf);
+    // The parent may still have writable TLB entries of pages that are
+    // copy-on-write now, even if the copy has failed halfway.
+    tlb_batch_flush(&batch);
+    if (!copied) {
+        mutex_unlock(&(parent_pcb_ptr->lock));
+        POP_BACK_CACHED(
+            pcb_node_t,
+            &pcb_node_cache,
+            parent_pcb_ptr->child_pcb_list
+        );
+        destruct_page_dir(child_process_pd);
+        return -1;
+    }
 
-    if (parent_pcb_ptr->page_allocation_list != NULL) {
-        page_allocation_node_t *node_ptr =
-            parent_pcb_ptr->page_allocation_list;
-        do {
-            PUSH_BACK(
-                page_allocation_node_t,
-                child_pcb_ptr->page_allocation_list,
-                node_ptr->data,
-                success
-            );
-            if (!success) {
-                while (child_pcb_ptr->page_allocation_list != NULL) {
-                    POP_FRONT(
-                        page_allocation_node_t,
-                        child_pcb_ptr->page_allocation_list
-                    );
-                }
-                POP_BACK(pcb_node_t, parent_pcb_ptr->child_pcb_list);
-                destruct_page_dir(child_process_pd);
-                return -1;
-            }
-            node_ptr = node_ptr->next;
-        } while (node_ptr != parent_pcb_ptr->page_allocation_list);
+    if (copy_vma_tree(
+        parent_pcb_ptr->vma_tree,
+        &(child_pcb_ptr->vma_tree)
+    ) < 0) {
+        mutex_unlock(&(parent_pcb_ptr->lock));
+        POP_BACK_CACHED(
+            pcb_node_t,
+            &pcb_node_cache,
+            parent_pcb_ptr->child_pcb_list
+        );
+        destruct_page_dir(child_process_pd);
+        return -1;
     }
+    mutex_unlock(&(parent_pcb_ptr->lock));
 
     // --- Copying PCB ends. ---
     // --- Copying TCB starts. ---
 
-    PUSH_FRONT(tcb_node_t, child_pcb_ptr->tcb_list, *old_tcb_ptr, success);
+    PUSH_FRONT_CACHED(
+        tcb_node_t,
+        &tcb_node_cache,
+        child_pcb_ptr->tcb_list,
+        *old_tcb_ptr,
+        success
+    );
     if (!success) {
-        while (child_pcb_ptr->page_allocation_list != NULL) {
-            POP_FRONT(
-                page_allocation_node_t,
-                child_pcb_ptr->page_allocation_list
-            );
-        }
-        POP_BACK(pcb_node_t, parent_pcb_ptr->child_pcb_list);
+        destroy_vma_tree(&(child_pcb_ptr->vma_tree));
+        POP_BACK_CACHED(
+            pcb_node_t,
+            &pcb_node_cache,
+            parent_pcb_ptr->child_pcb_list
+        );
         destruct_page_dir(child_process_pd);
         return -1;
     }
     tcb_t *new_tcb_ptr = &(child_pcb_ptr->tcb_list->data);
+    Q_INIT_ELEM(new_tcb_ptr, state_link);
+    new_tcb_ptr->kernel_stack = alloc_kernel_stack();
+    if (new_tcb_ptr->kernel_stack == NULL) {
+        POP_BACK_CACHED(tcb_node_t, &tcb_node_cache, child_pcb_ptr->tcb_list);
+        destroy_vma_tree(&(child_pcb_ptr->vma_tree));
+        POP_BACK_CACHED(
+            pcb_node_t,
+            &pcb_node_cache,
+            parent_pcb_ptr->child_pcb_list
+        );
+        destruct_page_dir(child_process_pd);
+        return -1;
+    }
     new_tcb_ptr->state = READY_STATE;
     new_tcb_ptr->pcb_ptr = child_pcb_ptr;
     mutex_lock(&thread_manager_lock);
@@ -367,36 +398,24 @@ int fork_ctrl_blk(ureg_t *ureg_ptr) {
     // make kernel stack for the new TCB
     save_ureg(new_tcb_ptr, ureg_ptr);
 
-    // Set the new thread as runnable. From now on, the new thread
-    // is ready for context switch.
-    tcb_ptr_node_t *new_node_ptr = (tcb_ptr_node_t *)malloc(
-        sizeof(tcb_ptr_node_t)
-    );
-    if (new_node_ptr == NULL) {
-        POP_BACK(tcb_node_t, child_pcb_ptr->tcb_list);
-        while (child_pcb_ptr->page_allocation_list != NULL) {
-            POP_FRONT(
-                page_allocation_node_t,
-                child_pcb_ptr->page_allocation_list
-            );
-        }
-        POP_BACK(pcb_node_t, parent_pcb_ptr->child_pcb_list);
+    if (register_swappable(child_pcb_ptr) < 0) {
+        free_kernel_stack(new_tcb_ptr->kernel_stack);
+        POP_BACK_CACHED(tcb_node_t, &tcb_node_cache, child_pcb_ptr->tcb_list);
+        destroy_vma_tree(&(child_pcb_ptr->vma_tree));
+        POP_BACK_CACHED(
+            pcb_node_t,
+            &pcb_node_cache,
+            parent_pcb_ptr->child_pcb_list
+        );
         destruct_page_dir(child_process_pd);
         return -1;
     }
+    // Set the new thread as runnable. From now on, the new thread
+    // is ready for context switch.
     bool interrupt_enable_flag = ((get_eflags() & EFL_IF) != 0);
     disable_interrupts();
-    new_node_ptr->data = new_tcb_ptr;
-    if (thread_lists[READY_STATE] == NULL) {
-        new_node_ptr->previous = new_node_ptr;
-        new_node_ptr->next = new_node_ptr;
-        thread_lists[READY_STATE] = new_node_ptr;
-    } else {
-        new_node_ptr->previous = thread_lists[READY_STATE]->previous;
-        new_node_ptr->next = thread_lists[READY_STATE];
-        new_node_ptr->previous->next = new_node_ptr;
-        new_node_ptr->next->previous = new_node_ptr;
-    }
+    register_tid(new_tcb_ptr);
+    insert_ready_thread(new_tcb_ptr);
     if (interrupt_enable_flag) {
         enable_interrupts();
     }
@@ -431,179 +450,81 @@ int alter_state(
         return -1;
     }
 
-    // decide where the TCB pointer is in the original list
-    tcb_ptr_node_t *source_node_ptr = NULL;
-    int original_list_idx;
-    if (tcb_ptr->state >= READY_STATE && tcb_ptr->state <= TERMINATED_STATE) {
-        if (
-            tcb_ptr->state != WAITING_STATE || (
-                tcb_ptr->blocking_detail.reason > TERMINATED_STATE &&
-                tcb_ptr->blocking_detail.reason < THREAD_LIST_COUNT
-            )
-        ) {
-            original_list_idx = (tcb_ptr->state == WAITING_STATE) ?
-                tcb_ptr->blocking_detail.reason :
-                tcb_ptr->state;
-            if (thread_lists[original_list_idx] != NULL) {
-                tcb_ptr_node_t *node_ptr = thread_lists[original_list_idx];
-                do {
-                    if (node_ptr->data == tcb_ptr) {
-                        source_node_ptr = node_ptr;
-                        break;
-                    }
-                    node_ptr = node_ptr->next;
-                } while (node_ptr != thread_lists[original_list_idx]);
-            }
-        }
-    }
-    if (source_node_ptr == NULL) {
+    // decide which list the thread is in now
+    if (!(tcb_ptr->state >= READY_STATE && tcb_ptr->state <= TERMINATED_STATE)) {
         return -1;
     }
-        
-    // decide where the TCB pointer will be in the target list
-    tcb_ptr_node_t *destination_node_ptr;
-    bool front_pushed;
-    int target_list_idx;
-    switch (state) {
-        case WAITING_STATE: {
-            // For the thread list of waiting state, we actually use
-            // thread lists of different blocking reasons instead.
-            int reason = blocking_detail_ptr->reason;
-            switch (reason) {
-                case SLEEP: {
-                    // For the thread list of SLEEP blocking reason,
-                    // we sort it by wake up time.
-                    unsigned int wakeup_time =
-                        blocking_detail_ptr->wakeup_time;
-                    if (
-                        thread_lists[reason] == NULL
-                        ||
-                        thread_lists[reason]->data->blocking_detail.
-                            wakeup_time >= wakeup_time
-                    ) {
-                        destination_node_ptr = thread_lists[reason];
-                        front_pushed = true;
-                        target_list_idx = reason;
-                    } else {
-                        tcb_ptr_node_t *node_ptr =
-                            thread_lists[reason]->next;
-                        while (
-                            node_ptr != thread_lists[reason] &&
-                            node_ptr->data->blocking_detail.wakeup_time <
-                                wakeup_time
-                        ) {
-                            node_ptr = node_ptr->next;
-                        }
-                        destination_node_ptr = node_ptr;
-                        front_pushed = false;
-                        target_list_idx = reason;
-                    }
-                    break;
-                }
-                case DESCHEDULE: {
-                    destination_node_ptr = thread_lists[reason];
-                    front_pushed = false;
-                    target_list_idx = reason;
-                    break;
-                }
-                case VANISH_WAIT: {
-                    destination_node_ptr = thread_lists[reason];
-                    front_pushed = false;
-                    target_list_idx = reason;
-                    break;
-                }
-                case READLINE: {
-                    // For the thread list of READLINE blocking reason,
-                    // we prepend the TCB pointer to the list if first_reader
-                    // is true and append the TCB pointer otherwise.
-                    bool first_reader = blocking_detail_ptr->first_reader;
-                    if (first_reader) {
-                        destination_node_ptr = thread_lists[reason];
-                        front_pushed = true;
-                        target_list_idx = reason;
-                    } else {
-                        destination_node_ptr = thread_lists[reason];
-                        front_pushed = false;
-                        target_list_idx = reason;
-                    }
-                    break;
-                }
-                default: {
-                    return -1;
-                }
-            }
-            break;
-        }
-        case READY_STATE: {
-            // For the thread list of ready state, put threads of the same
-            // process together.
-            bool process_found = false;
-            if (thread_lists[state] != NULL) {
-                tcb_ptr_node_t *node_ptr = thread_lists[state]->previous;
-                do {
-                    if (node_ptr->data->pcb_ptr == tcb_ptr->pcb_ptr) {
-                        destination_node_ptr = node_ptr->next;
-                        front_pushed = false;
-                        target_list_idx = state;
-                        process_found = true;
-                        break;
-                    }
-                    node_ptr = node_ptr->previous;
-                } while (node_ptr != thread_lists[state]->previous);
-            }
-            if (!process_found) {
-                destination_node_ptr = thread_lists[state];
-                front_pushed = false;
-                target_list_idx = state;
-            }
-            break;
-        }
-        case RUNNING_STATE: {
-            // For the thread list of running state, prepend the TCB
-            // pointer to the list.
-            destination_node_ptr = thread_lists[state];
-            front_pushed = true;
-            target_list_idx = state;
-            break;
-        }
-        case TERMINATED_STATE: {
-            // For the thread list of terminated state, append the TCB
-            // pointer to the list.
-            destination_node_ptr = thread_lists[state];
-            front_pushed = false;
-            target_list_idx = state;
-            break;
-        }
-        case NEW_STATE:
-        default: {
+    int original_list_idx = tcb_ptr->state;
+    if (tcb_ptr->state == WAITING_STATE) {
+        // For the thread list of waiting state, we actually use
+        // thread lists of different blocking reasons instead.
+        original_list_idx = tcb_ptr->blocking_detail.reason;
+        if (!(
+            original_list_idx > TERMINATED_STATE &&
+            original_list_idx < THREAD_LIST_COUNT
+        )) {
             return -1;
         }
     }
 
-    if (source_node_ptr == thread_lists[original_list_idx]) {
-        if (
-            thread_lists[original_list_idx] ==
-            thread_lists[original_list_idx]->next
-        ) {
-            thread_lists[original_list_idx] = NULL;
-        } else {
-            thread_lists[original_list_idx] =
-            thread_lists[original_list_idx]->next;
+    // decide which list the thread will be in
+    int target_list_idx = state;
+    if (state == WAITING_STATE) {
+        target_list_idx = blocking_detail_ptr->reason;
+        if (!(
+            target_list_idx > TERMINATED_STATE &&
+            target_list_idx < THREAD_LIST_COUNT
+        )) {
+            return -1;
         }
     }
-    source_node_ptr->next->previous = source_node_ptr->previous;
-    source_node_ptr->previous->next = source_node_ptr->next;
-    if (destination_node_ptr == NULL) {
-        source_node_ptr->next = source_node_ptr;
-        source_node_ptr->previous = source_node_ptr;
-        thread_lists[target_list_idx] = source_node_ptr;
+
+    if (
+        tcb_ptr->state == WAITING_STATE &&
+        tcb_ptr->blocking_detail.timer_ptr != NULL
+    ) {
+        // a timer that has fired is not armed any more
+        cancel_kernel_timer(tcb_ptr->blocking_detail.timer_ptr);
+    }
+
+    if (original_list_idx == READY_STATE) {
+        remove_ready_thread(tcb_ptr);
+    } else if (
+        tcb_ptr->state == WAITING_STATE &&
+        tcb_ptr->blocking_detail.wait_queue_ptr != NULL
+    ) {
+        Q_REMOVE(tcb_ptr->blocking_detail.wait_queue_ptr, tcb_ptr, state_link);
     } else {
-        source_node_ptr->next = destination_node_ptr;
-        source_node_ptr->previous = destination_node_ptr->previous;
-        source_node_ptr->next->previous = source_node_ptr;
-        source_node_ptr->previous->next = source_node_ptr;
-        if (front_pushed) {
-            thread_lists[target_list_idx] = source_node_ptr;
+        Q_REMOVE(&(thread_lists[original_list_idx]), tcb_ptr, state_link);
+    }
+
+    if (state == WAITING_STATE && blocking_detail_ptr->wait_queue_ptr != NULL) {
+        // Threads waiting on an object queue up in the object instead.
+        Q_INSERT_TAIL(blocking_detail_ptr->wait_queue_ptr, tcb_ptr, state_link);
+    } else {
+        tcb_queue_t *target_list_ptr = &(thread_lists[target_list_idx]);
+        switch (target_list_idx) {
+            case READY_STATE: {
+                insert_ready_thread(tcb_ptr);
+                break;
+            }
+            case RUNNING_STATE: {
+                // For the thread list of running state, prepend the TCB
+                // to the list.
+                Q_INSERT_FRONT(target_list_ptr, tcb_ptr, state_link);
+                break;
+            }
+            case SLEEP:
+            case READLINE:
+            case DESCHEDULE:
+            case MUTEX_WAIT:
+            case COND_WAIT:
+            case FUTEX_WAIT:
+            case TERMINATED_STATE:
+            default: {
+                Q_INSERT_TAIL(target_list_ptr, tcb_ptr, state_link);
+                break;
+            }
         }
     }
 
@@ -615,6 +536,38 @@ int alter_state(
     return 0;
 }
 
+void insert_ready_thread(tcb_t *tcb_ptr) {
+    // For the thread list of ready state, put threads of the same
+    // process together.
+    tcb_queue_t *ready_list_ptr = &(thread_lists[READY_STATE]);
+    pcb_t *pcb_ptr = tcb_ptr->pcb_ptr;
+    if (pcb_ptr->ready_tail_ptr == NULL) {
+        Q_INSERT_TAIL(ready_list_ptr, tcb_ptr, state_link);
+        pcb_ptr->ready_front_ptr = tcb_ptr;
+    } else {
+        Q_INSERT_AFTER(
+            ready_list_ptr,
+            pcb_ptr->ready_tail_ptr,
+            tcb_ptr,
+            state_link
+        );
+    }
+    pcb_ptr->ready_tail_ptr = tcb_ptr;
+}
+
+void remove_ready_thread(tcb_t *tcb_ptr) {
+    pcb_t *pcb_ptr = tcb_ptr->pcb_ptr;
+    if (pcb_ptr->ready_front_ptr == pcb_ptr->ready_tail_ptr) {
+        pcb_ptr->ready_front_ptr = NULL;
+        pcb_ptr->ready_tail_ptr = NULL;
+    } else if (pcb_ptr->ready_front_ptr == tcb_ptr) {
+        pcb_ptr->ready_front_ptr = Q_GET_NEXT(tcb_ptr, state_link);
+    } else if (pcb_ptr->ready_tail_ptr == tcb_ptr) {
+        pcb_ptr->ready_tail_ptr = Q_GET_PREV(tcb_ptr, state_link);
+    }
+    Q_REMOVE(&(thread_lists[READY_STATE]), tcb_ptr, state_link);
+}
+
 /**
  * @brief Count how many threads of the process are not in TERMINATED_STATE.
  * 
@@ -642,34 +595,49 @@ int get_thread_alive_count(pcb_t *pcb_ptr, int *thread_alive_count_ptr) {
     return 0;
 }
 
-tcb_t *find_tcb_in_list(void *value, int state){
-    tcb_ptr_node_t *current = thread_lists[state];
-    if (current == NULL)
-    {
-        return NULL;
-    }
-    
-    do
-    {
-        tcb_t *tcb_ptr = current->data;
-        pcb_t *current_pcb = tcb_ptr->pcb_ptr;
-        if (state == VANISH_WAIT)
-        {
-            pcb_t *parent_pcb = (pcb_t*) value;
-            if (current_pcb == parent_pcb)
-            {
-                return tcb_ptr;
-            }
-        }else{
-            int tid = (int) value;
-            if (tcb_ptr->tid == tid)
-            {
-                return tcb_ptr;
-            }
+void register_tid(tcb_t *tcb_ptr) {
+    Q_INSERT_TAIL(
+        &(tid_table[(unsigned int)tcb_ptr->tid % TID_TABLE_LEN]),
+        tcb_ptr,
+        tid_link
+    );
+}
+
+/**
+ * @brief Take a thread out of the TID table before its TCB is freed.
+ * 
+ * This function should be called only when interrupts are disabled.
+ * 
+ * @param tcb_ptr pointer to the TCB of the thread
+ */
+void unregister_tid(tcb_t *tcb_ptr) {
+    Q_REMOVE(
+        &(tid_table[(unsigned int)tcb_ptr->tid % TID_TABLE_LEN]),
+        tcb_ptr,
+        tid_link
+    );
+}
+
+/**
+ * @brief Find a thread by its TID. Only one bucket of the TID table is
+ *        searched, which holds a thread or so on average.
+ * 
+ * This function should be called only when interrupts are disabled.
+ * 
+ * @param tid the TID
+ * @return the TCB of the thread, NULL if there is no such thread
+ */
+tcb_t *find_tcb(int tid) {
+    tcb_t *tcb_ptr;
+    Q_FOREACH(
+        tcb_ptr,
+        &(tid_table[(unsigned int)tid % TID_TABLE_LEN]),
+        tid_link
+    ) {
+        if (tcb_ptr->tid == tid) {
+            return tcb_ptr;
         }
-        current = current->next;
-    } while (current != thread_lists[state]);
-    
+    }
     return NULL;
 }
 
@@ -12,18 +12,19 @@
 #include <simics.h> // lprintf
 #include <cr.h> // get_cr3
 #include <stdbool.h> // bool
-#include <string.h> // memset
 #include <page.h> // PAGE_SHIFT
 #include <system_call.h> // handle_task_vanish
 #include <ctrl_blk.h> // tcb_t
 #include <mutex.h> // mutex_lock
+#include <vma.h> // find_vma
+#include <swap.h> // swap_in_page
 
 /**
  * @brief Kernel decides to kill the thread. If the thread is the
  *        last one of its process, set status to -2.
  */
 void fault_kill_thread(void) {
-    pcb_t *pcb_ptr = thread_lists[RUNNING_STATE]->data->pcb_ptr;
+    pcb_t *pcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
     mutex_lock(&(pcb_ptr->lock));
     int thread_alive_count;
     get_thread_alive_count(pcb_ptr, &thread_alive_count);
@@ -37,67 +38,231 @@ void fault_kill_thread(void) {
 }
 
 /**
- * @brief handle page fault
+ * @brief Map a page of an area to a new frame, which is one of those
+ *        reserved for the area if there are any left.
  * 
- * @param ureg_ptr pointer to the register values snapshotted before
- *                 the interrupt happens
+ * @param page_dir The page directory.
+ * @param vma_ptr The area.
+ * @param v_addr The virtual address within the range of the page.
+ * @return A negative value on failure, 0 otherwise.
  */
-void handle_page_fault(ureg_t *ureg_ptr) {
-    pcb_t *current_pcb_ptr = thread_lists[RUNNING_STATE]->data->pcb_ptr;
+int map_vma_frame(pde_t *page_dir, vma_t *vma_ptr, uint32_t v_addr);
+
+int map_vma_frame(pde_t *page_dir, vma_t *vma_ptr, uint32_t v_addr) {
+    if (vma_ptr->reserved_count == 0) {
+        return map_new_frame(page_dir, v_addr);
+    }
+    if (map_reserved_frame(page_dir, v_addr) < 0) {
+        return -1;
+    }
+    vma_ptr->reserved_count--;
+    return 0;
+}
+
+/**
+ * @brief Size the window of pages to map ahead by how a demand fault
+ *        follows the previous one in its area.
+ * 
+ * @param vma_ptr The area.
+ * @param page The page that faults.
+ * @param wr Whether the fault is a write.
+ * @param pages_max The largest window the process allows.
+ * @return Whether the page and those ahead should get frames of their
+ *         own right away.
+ */
+bool track_demand_fault(
+    vma_t *vma_ptr,
+    uint32_t page,
+    bool wr,
+    uint32_t pages_max
+);
+
+/**
+ * @brief Map the pages after a demand fault that are still missing, as
+ *        many as the window of the area allows.
+ * 
+ * It stops at the end of the area or at the first page that is mapped
+ * or cannot be mapped, since no one has asked for these pages yet.
+ * 
+ * @param page_dir The page directory.
+ * @param vma_ptr The area.
+ * @param page The page that faults, which is mapped already.
+ * @param write_intent Whether to map frames of their own rather than
+ *                     the zero frame.
+ * @param fault_around_ptr The policy and counters of the process.
+ */
+void fault_around(
+    pde_t *page_dir,
+    vma_t *vma_ptr,
+    uint32_t page,
+    bool write_intent,
+    fault_around_t *fault_around_ptr
+);
+
+bool track_demand_fault(
+    vma_t *vma_ptr,
+    uint32_t page,
+    bool wr,
+    uint32_t pages_max
+) {
+    if (page == vma_ptr->next_fault_page) {
+        // sequential, so look further ahead
+        vma_ptr->fault_around_pages = vma_ptr->fault_around_pages == 0 ?
+            1 : vma_ptr->fault_around_pages * 2;
+        if (vma_ptr->fault_around_pages > pages_max) {
+            vma_ptr->fault_around_pages = pages_max;
+        }
+    } else {
+        vma_ptr->fault_around_pages = 0;
+        vma_ptr->write_intent = false;
+    }
+    if (wr) {
+        vma_ptr->write_intent = true;
+    }
+    return vma_ptr->write_intent && vma_ptr->access == READ_WRITE;
+}
+
+void fault_around(
+    pde_t *page_dir,
+    vma_t *vma_ptr,
+    uint32_t page,
+    bool write_intent,
+    fault_around_t *fault_around_ptr
+) {
+    uint64_t next_page = (uint64_t)page + PAGE_SIZE;
+    for (
+        uint32_t i = 0;
+        i < vma_ptr->fault_around_pages && next_page < vma_ptr->end;
+        i++
+    ) {
+        mapping_info_t mapping_info;
+        if (
+            check_user_page(page_dir, next_page, &mapping_info) < 0 ||
+            (
+                mapping_info != PDE_NOT_PRESENT &&
+                mapping_info != PTE_NOT_PRESENT
+            )
+        ) {
+            break;
+        }
+        if (write_intent ?
+            map_vma_frame(page_dir, vma_ptr, next_page) < 0 :
+            map_zero_frame(page_dir, next_page) < 0
+        ) {
+            break;
+        }
+        fault_around_ptr->mapped_ahead_count++;
+        next_page += PAGE_SIZE;
+    }
+    vma_ptr->next_fault_page = next_page;
+    fault_around_ptr->fault_count++;
+}
+
+int resolve_page_fault(ureg_t *ureg_ptr) {
+    tcb_t *current_tcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]));
+    pcb_t *current_pcb_ptr = current_tcb_ptr->pcb_ptr;
+    // The kernel faulted while holding the lock, where waiting for it
+    // would never end. A user copy there just fails.
+    if (current_pcb_ptr->lock.owner_ptr == current_tcb_ptr) {
+        return -1;
+    }
     mutex_lock(&(current_pcb_ptr->lock));
 
     int p = ureg_ptr->error_code & 1;
     int wr = (ureg_ptr->error_code >> 1) & 1;
     uint32_t v_addr = ureg_ptr->cr2;
 
-    uint32_t page = (v_addr >> PAGE_SHIFT) << PAGE_SHIFT;
     pde_t * page_dir = (pde_t*) ((get_cr3() >> PAGE_SHIFT) << PAGE_SHIFT);
 
-    if (p == 0) {
-        // Either the PDE or the PTE is not present, in which case the page
-        // must be in user address space.
-        uint32_t availability;
-        if (
-            !(get_availability(page_dir, v_addr, &availability) < 0) &&
-            availability == PAGE_AVAILABLE
-        ) {
-            // The available bits are PAGE_AVAILABLE, which means we can
-            // map the page to a physical frame.
-            if (wr == 0) {
-                // map the zero frame on read operation
-                if (!(map_zero_frame(page_dir, v_addr) < 0)) {
-                    mutex_unlock(&(current_pcb_ptr->lock));
-                    return;
-                }
-            } else {
-                // map a newly allocated frame on write operation
-                if (!(map_new_frame(page_dir, v_addr) < 0)) {
-                    memset((void *)page, 0, PAGE_SIZE);
-                    mutex_unlock(&(current_pcb_ptr->lock));
-                    return;
-                }
+    // the area decides what may be done to the page
+    vma_t *vma_ptr = find_vma(current_pcb_ptr->vma_tree, v_addr);
+    if (vma_ptr == NULL || (wr == 1 && vma_ptr->access != READ_WRITE)) {
+        mutex_unlock(&(current_pcb_ptr->lock));
+        return -1;
+    }
+
+    uint32_t slot;
+    if (p == 0 && !(get_swap_slot(page_dir, v_addr, &slot) < 0)) {
+        // The page has moved to the compressed store. Whatever the
+        // area, its contents are brought back as they were.
+        if (!(swap_in_page(page_dir, v_addr, vma_ptr->access) < 0)) {
+            mutex_unlock(&(current_pcb_ptr->lock));
+            return 0;
+        }
+    } else if (p == 0) {
+        // Either the PDE or the PTE is not present. Only pages of
+        // anonymous areas are missing on purpose, and we can map them to
+        // a physical frame.
+        if (vma_ptr->backing == VMA_ANONYMOUS) {
+            uint32_t page = (v_addr >> PAGE_SHIFT) << PAGE_SHIFT;
+            fault_around_t *fault_around_ptr =
+                &(current_pcb_ptr->fault_around);
+            bool write_intent = track_demand_fault(
+                vma_ptr,
+                page,
+                wr == 1,
+                fault_around_ptr->pages_max
+            );
+            // Map a newly allocated frame on write operation, or when
+            // the area is being filled in order. Map the zero frame
+            // otherwise.
+            if (!((write_intent ?
+                map_vma_frame(page_dir, vma_ptr, page) :
+                map_zero_frame(page_dir, page)) < 0)
+            ) {
+                fault_around(
+                    page_dir,
+                    vma_ptr,
+                    page,
+                    write_intent,
+                    fault_around_ptr
+                );
+                mutex_unlock(&(current_pcb_ptr->lock));
+                return 0;
             }
         }
-    } else {
+    } else if (wr == 1) {
         // The page has been mapped to a physical frame, which means
         // the fault is due to privilege (U/S bits) mismatch or
         // access (R/W bit) mismatch.
         mapping_info_t mapping_info;
         if (
             !(check_user_page(page_dir, v_addr, &mapping_info) < 0) &&
-            mapping_info == ZERO_FRAME_MAPPED &&
-            !(unmap_frame(page_dir, v_addr) < 0) &&
-            !(map_new_frame(page_dir, v_addr) < 0)
+            mapping_info == ZERO_FRAME_MAPPED
         ) {
-            // The first time the user progam writes to a page mapped
-            // to the zero frame, we allocate a new frame and remap.
-            memset((void *)page, 0, PAGE_SIZE);
+            // pages mapped ahead of this one should be written too
+            vma_ptr->write_intent = true;
+            if (
+                !(unmap_frame(page_dir, v_addr, NULL) < 0) &&
+                !(map_vma_frame(page_dir, vma_ptr, v_addr) < 0)
+            ) {
+                // The first time the user progam writes to a page mapped
+                // to the zero frame, we allocate a new frame and remap.
+                mutex_unlock(&(current_pcb_ptr->lock));
+                return 0;
+            }
+        } else if (!(copy_on_write(page_dir, v_addr) < 0)) {
+            // The page shares its frame since fork, and only now gets
+            // a private copy.
             mutex_unlock(&(current_pcb_ptr->lock));
-            return;
+            return 0;
         }
     }
 
     mutex_unlock(&(current_pcb_ptr->lock));
+    return -1;
+}
+
+/**
+ * @brief handle page fault
+ * 
+ * Page faults that resolve_page_fault can fix never get here, nor do
+ * those of user copies, which fix_up_user_copy turns into failures.
+ * 
+ * @param ureg_ptr pointer to the register values snapshotted before
+ *                 the interrupt happens
+ */
+void handle_page_fault(ureg_t *ureg_ptr) {
     lprintf("Failed due to page fault.");
     fault_kill_thread();
 }
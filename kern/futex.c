@@ -0,0 +1,79 @@
+/**
+ * @file futex.c
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief threads waiting on user words
+ * 
+ * Waiters are hashed by their address space and the virtual address of
+ * the word into a fixed table of wait queues. The address space is part
+ * of the key because every process has its own, and the virtual address
+ * is used rather than the frame behind it, since copy-on-write, merging
+ * and swapping may move a word to another frame while threads wait on it.
+ * Waking up compares the whole key, so threads waiting on other words of
+ * the same bucket stay asleep.
+ */
+
+#include <futex.h> // FUTEX_TABLE_LEN
+#include <wait_queue.h> // wait_queue_t
+#include <ctrl_blk.h> // tcb_t
+#include <scheduler.h> // find_next_thread
+#include <context_switcher.h> // switch_context
+#include <variable_queue.h> // Q_GET_FRONT
+#include <stddef.h> // NULL
+
+wait_queue_t futex_table[FUTEX_TABLE_LEN];
+
+/**
+ * @brief Find the bucket of a user word.
+ * 
+ * @param pcb_ptr pointer to the PCB of the process
+ * @param addr the user address of the word
+ * @return pointer to the wait queue of the bucket
+ */
+wait_queue_t *find_futex_queue(pcb_t *pcb_ptr, uint32_t addr);
+
+void init_futex_table(void) {
+    int bucket_idx;
+    for (bucket_idx = 0; bucket_idx < FUTEX_TABLE_LEN; bucket_idx++) {
+        init_wait_queue(&(futex_table[bucket_idx]));
+    }
+}
+
+int wait_on_futex(pcb_t *pcb_ptr, uint32_t addr) {
+    tcb_t *next_tcb_ptr = find_next_thread();
+    if (next_tcb_ptr == NULL) {
+        return -1;
+    }
+    blocking_detail_t blocking_detail = {
+        .reason = FUTEX_WAIT,
+        .wait_queue_ptr = find_futex_queue(pcb_ptr, addr),
+        .futex_addr = addr
+    };
+    return switch_context(next_tcb_ptr, WAITING_STATE, &blocking_detail);
+}
+
+int wake_futex(pcb_t *pcb_ptr, uint32_t addr, int count) {
+    wait_queue_t *queue_ptr = find_futex_queue(pcb_ptr, addr);
+    int woken_count = 0;
+    tcb_t *tcb_ptr = Q_GET_FRONT(queue_ptr);
+    while (tcb_ptr != NULL && woken_count < count) {
+        // alter_state unlinks the thread, so step past it first
+        tcb_t *next_tcb_ptr = Q_GET_NEXT(tcb_ptr, state_link);
+        if (
+            tcb_ptr->pcb_ptr == pcb_ptr &&
+            tcb_ptr->blocking_detail.futex_addr == addr
+        ) {
+            alter_state(tcb_ptr, READY_STATE, NULL);
+            woken_count++;
+        }
+        tcb_ptr = next_tcb_ptr;
+    }
+    return woken_count;
+}
+
+wait_queue_t *find_futex_queue(pcb_t *pcb_ptr, uint32_t addr) {
+    // words and PCBs are aligned, so their low bits carry little
+    uint32_t key = (addr >> 2) ^ ((uint32_t)pcb_ptr >> 4);
+    key ^= key >> 8;
+    return &(futex_table[key % FUTEX_TABLE_LEN]);
+}
@@ -0,0 +1,28 @@
+/**
+ * @file cond.h
+ *
+ * @brief Defines functions for condition variables.
+ *
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @bug No known bugs.
+ **/
+
+#ifndef _COND_H
+#define _COND_H
+
+#include <mutex.h> // mutex_t
+#include <wait_queue.h> // wait_queue_t
+
+typedef struct cond {
+    // threads waiting for the condition
+    wait_queue_t waiters;
+} cond_t;
+
+int cond_init(cond_t *cv);
+void cond_destroy(cond_t *cv);
+void cond_wait(cond_t *cv, mutex_t *mp);
+void cond_signal(cond_t *cv);
+void cond_broadcast(cond_t *cv);
+
+#endif /* _COND_H */
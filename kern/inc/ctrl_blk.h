@@ -10,20 +10,24 @@
 
 #include <stdint.h>
 #include <list.h>
+#include <slab.h>
 #include <vm.h>
+#include <vma.h>
+#include <fault_handler.h>
 #include <ureg.h>
 #include <mutex.h>
+#include <cond.h>
+#include <wait_queue.h>
+#include <timer_wheel.h>
 #include <cr.h>
 #include <stdbool.h>
 #include <hvcall.h>
+#include <variable_queue.h>
+#include <kernel_stack.h>
 
 // number of entries in a virtual IDT
 #define VIRTUAL_IDT_LEN (HV_KEYBOARD + 1)
 
-// Do not change KERNEL_STACK_LEN. The offset
-// is hard coded into context.S
-#define KERNEL_STACK_LEN (0x1000)
-
 // states of threads
 #define NEW_STATE (0)
 #define READY_STATE (NEW_STATE + 1)
@@ -34,24 +38,30 @@
 #define SLEEP (TERMINATED_STATE + 1)
 #define READLINE (SLEEP + 1)
 #define DESCHEDULE (READLINE + 1)
-#define VANISH_WAIT (DESCHEDULE + 1)
+#define MUTEX_WAIT (DESCHEDULE + 1)
+#define COND_WAIT (MUTEX_WAIT + 1)
+#define FUTEX_WAIT (COND_WAIT + 1)
+
+#define THREAD_LIST_COUNT (FUTEX_WAIT + 1)
 
-#define THREAD_LIST_COUNT (VANISH_WAIT + 1)
+// number of buckets in the table that finds threads by TID
+#define TID_TABLE_LEN (1024)
 
 struct pcb_t;
 typedef struct blocking_detail_t {
     int reason;
-    union {
-        unsigned int wakeup_time;
-        bool first_reader;
-    };
+    // The queue of the object the thread waits on. If it is NULL, the
+    // thread waits in the thread list of the blocking reason instead.
+    wait_queue_t *wait_queue_ptr;
+    // The user address a FUTEX_WAIT thread waits on. Threads waiting on
+    // different addresses may share a queue.
+    uint32_t futex_addr;
+    // The timer that ends the wait, if any. It lives on the kernel stack
+    // of the thread, so it is cancelled whenever the thread stops waiting
+    // for another reason.
+    kernel_timer_t *timer_ptr;
 } blocking_detail_t;
 
-typedef struct page_allocation_t {
-    void *base;
-    int len;
-} page_allocation_t;
-
 // Used only if the pcb is a guest
 typedef struct guest_resource_t {
     bool interrupt_enable_flag;
@@ -60,6 +70,8 @@ typedef struct guest_resource_t {
 } guest_resource_t;
 
 struct pcb_t;
+// The fields the scheduler touches come first, so that they share a
+// cache line. The kernel stack lives apart, in a pool of its own.
 typedef struct tcb_t {
     // the process owning this thread
     struct pcb_t *pcb_ptr;
@@ -69,7 +81,12 @@ typedef struct tcb_t {
     // Do not move esp and kernel_stack. The offsets of them are
     // hard coded into context.S.
     uint32_t esp;
-    uint32_t kernel_stack[KERNEL_STACK_LEN];
+    // the lowest address of the KERNEL_STACK_LEN words of the stack
+    uint32_t *kernel_stack;
+
+    // links the thread into its list in thread_lists
+    Q_NEW_LINK(tcb_t) state_link;
+    blocking_detail_t blocking_detail;
 
     // (exception != NULL) means swexn has registered a handler,
     // only in which case the three fields below are ready for use.
@@ -77,11 +94,12 @@ typedef struct tcb_t {
     void (*handler)(void *arg, ureg_t *ureg_ptr);
     void *arg;
 
-    blocking_detail_t blocking_detail;
+    // links the thread into its bucket of the TID table
+    Q_NEW_LINK(tcb_t) tid_link;
 } tcb_t;
+Q_NEW_HEAD(tcb_queue_t, tcb_t);
 
 DEFINE_NODE_T(tcb_node_t, tcb_t);
-DEFINE_NODE_T(page_allocation_node_t, page_allocation_t);
 struct pcb_node_t;
 typedef struct pcb_t {
     // parent process, NULL for root process
@@ -90,14 +108,27 @@ typedef struct pcb_t {
     struct pcb_node_t *child_pcb_list;
     // all the threads of this process
     tcb_node_t *tcb_list;
+    // The first and the last of the threads of this process in
+    // thread_lists[READY_STATE], where they sit next to each other.
+    // Both are NULL if none of them is ready.
+    tcb_t *ready_front_ptr;
+    tcb_t *ready_tail_ptr;
     int status;
 
     // Do not move page_directory. The offset of it is
     // hard coded into context.S.
     pde_t *page_directory;
-    page_allocation_node_t *page_allocation_list;
+    // the areas of the address space that may be mapped
+    vma_t *vma_tree;
+    // how demand faults map pages ahead
+    fault_around_t fault_around;
 
     mutex_t lock;
+    // signaled whenever a child process exits, with lock held by waiters
+    cond_t child_exit_cond;
+    // whether pages may move to the compressed store, which they may not
+    // while exec replaces the address space
+    bool swappable;
 
     // boolean indecates if the current process is a guest
     bool guest;
@@ -105,9 +136,14 @@ typedef struct pcb_t {
 } pcb_t;
 DEFINE_NODE_T(pcb_node_t, pcb_t);
 
-DEFINE_NODE_T(tcb_ptr_node_t, tcb_t *);
+DEFINE_NODE_T(pcb_ptr_node_t, pcb_t *);
+
+// Nodes of the lists of threads and processes come from these caches,
+// and must go back to them.
+slab_cache_t tcb_node_cache;
+slab_cache_t pcb_node_cache;
 
-tcb_ptr_node_t *thread_lists[THREAD_LIST_COUNT];
+tcb_queue_t thread_lists[THREAD_LIST_COUNT];
 pcb_node_t *root_pcb_node_ptr;
 
 int init_ctrl_blk(void);
@@ -119,7 +155,8 @@ int alter_state(
     blocking_detail_t *blocking_detail_ptr
 );
 int get_thread_alive_count(pcb_t *pcb_ptr, int *thread_alive_count_ptr);
-tcb_t *find_tcb_in_list(void *value, int state);
+tcb_t *find_tcb(int tid);
+void unregister_tid(tcb_t *tcb_ptr);
 pcb_node_t *find_exited_child(pcb_t *parent_pcb);
 int unlock_children(pcb_t *pcb, pcb_node_t *node);
 
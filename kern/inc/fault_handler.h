@@ -9,7 +9,47 @@
 #define FAULT_HANDLER_H_SEEN
 
 #include <ureg.h> // ureg_t
+#include <stdint.h> // uint32_t
+#include <stdbool.h> // bool
 
+// how many pages a demand fault may map ahead unless the process says
+// otherwise
+#define FAULT_AROUND_PAGES_DEFAULT (16)
+// how many pages a process may ask a demand fault to map ahead
+#define FAULT_AROUND_PAGES_MAX (64)
+
+/**
+ * @brief How a process maps pages ahead on demand faults, and how well
+ *        it pays off.
+ * 
+ * When a demand fault in an anonymous area hits the page right after
+ * the last one mapped there, the access looks sequential, and the
+ * window of pages mapped ahead doubles, up to pages_max. Any other
+ * fault in the area closes the window. Pages mapped ahead get frames of
+ * their own if the area has just been written this way, and the zero
+ * frame otherwise.
+ * 
+ * A process sets pages_max with set_fault_around(n), 0 <= n <=
+ * FAULT_AROUND_PAGES_MAX, and reads the counters with get_kernel_stats.
+ */
+typedef struct fault_around_t {
+    uint32_t pages_max;
+    // demand faults resolved
+    uint32_t fault_count;
+    // pages mapped ahead of demand faults
+    uint32_t mapped_ahead_count;
+} fault_around_t;
+
+/**
+ * @brief Try to fix a page fault by giving the page a frame, i.e.,
+ *        demand paging, zero fill on demand and copy-on-write.
+ * 
+ * @param ureg_ptr pointer to the register values snapshotted before
+ *                 the page fault happens
+ * @return a negative value if the fault is not something the kernel
+ *         can fix, 0 if the faulting instruction can be retried
+ */
+int resolve_page_fault(ureg_t *ureg_ptr);
 void handle_page_fault(ureg_t *ureg_ptr);
 void handle_seg_fault(ureg_t *ureg_ptr);
 void handle_div_zero_fault(ureg_t *ureg_ptr);
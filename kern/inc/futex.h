@@ -0,0 +1,47 @@
+/**
+ * @file futex.h
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief threads waiting on user words
+ */
+
+#ifndef FUTEX_H_SEEN
+#define FUTEX_H_SEEN
+
+#include <stdint.h> // uint32_t
+
+// number of buckets in the table of futex waiters
+#define FUTEX_TABLE_LEN (256)
+
+struct pcb_t;
+
+void init_futex_table(void);
+
+/**
+ * @brief Block the running thread on a user word until it is woken up.
+ * 
+ * This function should be called only when interrupts are disabled, with
+ * the word already checked under them.
+ * 
+ * @param pcb_ptr pointer to the PCB of the running thread
+ * @param addr the user address of the word
+ * @return A negative value if there is no other thread to run, in which
+ *         case the running thread does not block. 0 after it has been
+ *         woken up otherwise.
+ */
+int wait_on_futex(struct pcb_t *pcb_ptr, uint32_t addr);
+
+/**
+ * @brief Make threads of a process waiting on a user word runnable, in
+ *        the order they started waiting.
+ * 
+ * This function should be called only when interrupts are disabled.
+ * 
+ * @param pcb_ptr pointer to the PCB of the process
+ * @param addr the user address of the word
+ * @param count the most threads to wake up
+ * @return how many threads have been woken up
+ */
+int wake_futex(struct pcb_t *pcb_ptr, uint32_t addr, int count);
+
+#endif // FUTEX_H_SEEN
@@ -0,0 +1,20 @@
+/**
+ * @file invlpg_stub.h
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief stub for the invlpg assembly instruction
+ */
+
+#ifndef INVLPG_STUB_H_SEEN
+#define INVLPG_STUB_H_SEEN
+
+/**
+ * @brief Invalidate the TLB entry of the page containing v_addr
+ * 
+ * Unlike reloading CR3, this also drops global entries.
+ * 
+ * @param v_addr A virtual address within the page.
+ */
+void invlpg(void *v_addr);
+
+#endif // INVLPG_STUB_H_SEEN
@@ -0,0 +1,28 @@
+/**
+ * @file kernel_stack.h
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief the pool kernel stacks of threads come from
+ */
+
+#ifndef KERNEL_STACK_H_SEEN
+#define KERNEL_STACK_H_SEEN
+
+// number of words in a kernel stack
+#define KERNEL_STACK_LEN (0x1000)
+// number of bytes in a kernel stack, which is a whole number of pages
+#define KERNEL_STACK_SIZE (KERNEL_STACK_LEN * 4)
+// how many free stacks the pool keeps before giving them back to the heap
+#define KERNEL_STACK_POOL_MAX (64)
+
+#ifndef ASSEMBLER
+
+#include <stdint.h> // uint32_t
+
+int init_kernel_stack_pool(void);
+uint32_t *alloc_kernel_stack(void);
+void free_kernel_stack(uint32_t *kernel_stack);
+
+#endif // ASSEMBLER
+
+#endif // KERNEL_STACK_H_SEEN
@@ -8,6 +8,8 @@
 #ifndef KEYBOARD_H_SEEN
 #define KEYBOARD_H_SEEN
 
+#include <wait_queue.h> // wait_queue_t
+
 // Buffer length of type buf_t, which for now is used as the type
 // of both the scancode buffer and the extracted character buffer.
 #define BUF_LEN (1024)
@@ -23,6 +25,8 @@ typedef struct buf_t {
 } buf_t;
 
 buf_t scancode_buf;
+// the reader holding the input, while it waits for the next keystroke
+wait_queue_t keystroke_queue;
 
 void install_keyboard(void);
 int extract_ch(buf_t *scancode_buf_ptr, char *ch_ptr);
@@ -11,6 +11,7 @@
 #include <stddef.h> // NULL
 #include <malloc.h> // malloc
 #include <assert.h> // affirm
+#include <slab.h> // slab_alloc
 
 #define DEFINE_NODE_T(node_t, data_t) \
     typedef struct node_t { \
@@ -18,9 +19,22 @@
         struct node_t *next; \
         data_t data; \
     } node_t
-#define PUSH_FRONT(node_t, front, new_data, success) \
+// Nodes come from a slab cache, or from malloc if the cache is NULL.
+#define ALLOC_NODE(node_t, cache_ptr) \
+    ((cache_ptr) == NULL ? \
+        (node_t *)malloc(sizeof(node_t)) : \
+        (node_t *)slab_alloc(cache_ptr))
+#define FREE_NODE(cache_ptr, node_ptr) \
     { \
-        node_t *new_front = malloc(sizeof(node_t)); \
+        if ((cache_ptr) == NULL) { \
+            free(node_ptr); \
+        } else { \
+            slab_free((cache_ptr), (node_ptr)); \
+        } \
+    }
+#define PUSH_FRONT_CACHED(node_t, cache_ptr, front, new_data, success) \
+    { \
+        node_t *new_front = ALLOC_NODE(node_t, cache_ptr); \
         success = (new_front != NULL); \
         if (success) { \
             new_front->data = (new_data); \
@@ -38,9 +52,9 @@
             (front) = new_front; \
         } \
     }
-#define PUSH_BACK(node_t, front, new_data, success) \
+#define PUSH_BACK_CACHED(node_t, cache_ptr, front, new_data, success) \
     { \
-        node_t *new_back = malloc(sizeof(node_t)); \
+        node_t *new_back = ALLOC_NODE(node_t, cache_ptr); \
         success = (new_back != NULL); \
         if (success) { \
             new_back->data = (new_data); \
@@ -57,7 +71,7 @@
             } \
         } \
     }
-#define POP_FRONT(node_t, front) \
+#define POP_FRONT_CACHED(node_t, cache_ptr, front) \
     { \
         affirm((front) != NULL); \
         node_t *old_front = (front); \
@@ -70,9 +84,9 @@
         old_front->previous->next = old_front->next; \
         old_front->next->previous = old_front->previous; \
          \
-        free(old_front); \
+        FREE_NODE(cache_ptr, old_front); \
     }
-#define POP_BACK(node_t, front) \
+#define POP_BACK_CACHED(node_t, cache_ptr, front) \
     { \
         affirm((front) != NULL); \
         node_t *old_back = (front)->previous; \
@@ -83,7 +97,16 @@
         old_back->previous->next = old_back->next; \
         old_back->next->previous = old_back->previous; \
          \
-        free(old_back); \
+        FREE_NODE(cache_ptr, old_back); \
     }
 
+#define PUSH_FRONT(node_t, front, new_data, success) \
+    PUSH_FRONT_CACHED(node_t, (slab_cache_t *)NULL, front, new_data, success)
+#define PUSH_BACK(node_t, front, new_data, success) \
+    PUSH_BACK_CACHED(node_t, (slab_cache_t *)NULL, front, new_data, success)
+#define POP_FRONT(node_t, front) \
+    POP_FRONT_CACHED(node_t, (slab_cache_t *)NULL, front)
+#define POP_BACK(node_t, front) \
+    POP_BACK_CACHED(node_t, (slab_cache_t *)NULL, front)
+
 #endif // LIST_H_SEEN
@@ -9,9 +9,26 @@
 #define MEM_ALLOCATION_H_SEEN
 
 #include <mutex.h> // mutex_t
+#include <stddef.h> // size_t
+
+// how many pages the heap grows by at least
+#define KERNEL_HEAP_GROWTH_PAGES (256)
+// how many pages of the direct map are set aside for page directories and
+// page tables, in case the rest of it runs out
+#define DIRECT_PAGE_RESERVE_LEN (256)
 
 mutex_t mem_allocation_lock;
 
 int initialize_mem_allocation(void);
 
+int grow_kernel_heap(size_t size);
+
+// Similar to smemalign, except that the memory is in the direct map, so
+// that its virtual address is also its physical one. Page directories
+// and page tables must come from here.
+void *direct_smemalign(size_t alignment, size_t size);
+
+// give back memory from direct_smemalign
+void direct_sfree(void *buf, size_t size);
+
 #endif // MEM_ALLOCATION_H_SEEN
@@ -0,0 +1,39 @@
+/**
+ * @file merge.h
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief merging of identical user pages across processes and guests
+ */
+
+#ifndef MERGE_H_SEEN
+#define MERGE_H_SEEN
+
+#include <stdint.h> // uint32_t
+
+// how much merging has paid off
+typedef struct merge_stats_t {
+    // pages hashed so far
+    uint32_t scanned_count;
+    // pages merged into another frame so far, and those mapped to the
+    // zero frame in particular
+    uint32_t merged_count;
+    uint32_t zero_merged_count;
+    // As of the last full pass, how many frames others are merged into,
+    // and how many frames their sharers would take without merging.
+    uint32_t stable_frame_count;
+    uint32_t saved_frame_count;
+} merge_stats_t;
+
+/**
+ * @brief Look at a few more pages of the registered processes, merging
+ *        those that have the same contents.
+ * 
+ * This function runs in interrupt context, on ticks that would be
+ * spent idle, and gives up whenever something it needs is busy.
+ */
+void merge_pages(void);
+
+// get a snapshot of the statistics
+void get_merge_stats(merge_stats_t *stats_ptr);
+
+#endif /* MERGE_H_SEEN */
@@ -11,9 +11,15 @@
 #ifndef _MUTEX_H
 #define _MUTEX_H
 
+#include <wait_queue.h> // wait_queue_t
+
+struct tcb_t;
 typedef struct mutex {
     int lock_state;
-    int tid;
+    // the thread holding the mutex, NULL if it is free
+    struct tcb_t *owner_ptr;
+    // threads blocked on the mutex, which is handed to them in turn
+    wait_queue_t waiters;
 } mutex_t;
 
 int mutex_init(mutex_t *mp);
@@ -0,0 +1,67 @@
+/**
+ * @file page_cache.h
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief a cache of the read only pages of each executable
+ */
+
+#ifndef PAGE_CACHE_H_SEEN
+#define PAGE_CACHE_H_SEEN
+
+#include <stdint.h> // uint32_t
+#include <stdbool.h> // bool
+#include <elf_410.h> // simple_elf_t
+#include <vm.h> // pde_t
+
+int init_page_cache(void);
+
+// test if a page overlaps a section of the given range
+bool overlaps_section(uint32_t page, uint32_t start, uint32_t len);
+
+/**
+ * @brief Test if a page of an executable can be shared by every process
+ *        running it, i.e., it holds some of .text and .rodata but none
+ *        of .data and .bss.
+ * 
+ * @param elf_ptr The executable.
+ * @param v_addr The virtual address within the range of the page.
+ * @return Whether the page can be shared.
+ */
+bool is_shareable_page(simple_elf_t *elf_ptr, uint32_t v_addr);
+
+/**
+ * @brief Map every shareable page of an executable to the frame cached
+ *        for it.
+ * 
+ * Either all shareable pages are mapped read only, or none is.
+ * 
+ * @param page_dir The page directory being loaded.
+ * @param execname The name of the executable.
+ * @param elf_ptr The executable.
+ * @return A negative value if the executable has not been cached or
+ *         the frames cannot be shared any more, 0 otherwise.
+ */
+int map_cached_pages(
+    pde_t *page_dir,
+    const char *execname,
+    simple_elf_t *elf_ptr
+);
+
+/**
+ * @brief Cache the frames of the shareable pages of an executable that
+ *        has just been loaded, if no one has done so.
+ * 
+ * The pages must have been filled in and made read only. Caching is
+ * best effort, so nothing changes on failure.
+ * 
+ * @param page_dir The page directory that has been loaded.
+ * @param execname The name of the executable.
+ * @param elf_ptr The executable.
+ */
+void cache_pages(
+    pde_t *page_dir,
+    const char *execname,
+    simple_elf_t *elf_ptr
+);
+
+#endif /* PAGE_CACHE_H_SEEN */
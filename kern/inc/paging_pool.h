@@ -0,0 +1,49 @@
+/**
+ * @file paging_pool.h
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief the pool page directories and page tables come from
+ */
+
+#ifndef PAGING_POOL_H_SEEN
+#define PAGING_POOL_H_SEEN
+
+#include <stdint.h> // uint32_t
+
+// how many free pages the pool keeps before giving them back to the heap
+#define PAGING_POOL_MAX (128)
+// how many pages an empty pool takes from the heap at once
+#define PAGING_POOL_REFILL_LEN (16)
+
+int init_paging_pool(void);
+
+/**
+ * @brief Take a zeroed, page aligned page for a page directory or a
+ *        page table.
+ * 
+ * The page is direct mapped, so its virtual address is its physical
+ * address.
+ * 
+ * @return NULL on failure, the page otherwise.
+ */
+void *alloc_paging_page(void);
+
+/**
+ * @brief Give back a page taken by alloc_paging_page. The page is
+ *        cleared on the way, so it needs no clearing when taken again.
+ * 
+ * @param page The page, which may not be referred to by any page
+ *        directory in use.
+ */
+void free_paging_page(void *page);
+
+/**
+ * @brief Get how many pages have been served by the pool, and how many
+ *        times the pool was empty and had to be refilled.
+ * 
+ * @param hit_count_ptr Where the hit count will be stored if not NULL.
+ * @param miss_count_ptr Where the miss count will be stored if not NULL.
+ */
+void get_paging_pool_stats(uint32_t *hit_count_ptr, uint32_t *miss_count_ptr);
+
+#endif // PAGING_POOL_H_SEEN
@@ -0,0 +1,99 @@
+/**
+ * @file slab.h
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief caches of kernel objects of a single type each
+ */
+
+#ifndef SLAB_H_SEEN
+#define SLAB_H_SEEN
+
+#include <stdint.h> // uint32_t
+#include <mutex.h> // mutex_t
+#include <kernel_stats.h> // kernel_cache_stats_t
+
+struct slab_t;
+
+// how a cache has been used
+typedef struct slab_stats_t {
+    // objects handed out and given back so far
+    uint32_t alloc_count;
+    uint32_t free_count;
+    // objects handed out right now
+    uint32_t in_use_count;
+    // slabs the cache holds right now, and how many times a slab had to
+    // come from the heap so far
+    uint32_t slab_count;
+    uint32_t grow_count;
+} slab_stats_t;
+
+/**
+ * @brief A cache of objects of one size, carved out of slabs of whole
+ *        pages.
+ * 
+ * Each slab keeps a free list of its own objects. Slabs with free
+ * objects are tried first, so that the heap is searched only when every
+ * slab is full. One slab that empties out is kept for the next burst,
+ * and any more go back to the heap.
+ * 
+ * An object is constructed once, when its slab is carved, and reset
+ * every time it is given back, so that it is always handed out
+ * constructed. Either hook may be NULL.
+ */
+typedef struct slab_cache_t {
+    const char *name;
+    // the size objects are handed out with, and the room each takes in
+    // a slab
+    uint32_t object_size;
+    uint32_t stride;
+    uint32_t objects_per_slab;
+    uint32_t slab_len;
+    void (*construct)(void *object);
+    void (*reset)(void *object);
+    // slabs with free objects, those without, and at most one empty one
+    struct slab_t *partial_slabs;
+    struct slab_t *full_slabs;
+    struct slab_t *empty_slab;
+    slab_stats_t stats;
+    mutex_t lock;
+    // all caches, for the statistics
+    struct slab_cache_t *next;
+} slab_cache_t;
+
+/**
+ * @brief Initialize a cache.
+ * 
+ * @param cache_ptr The cache.
+ * @param name What the statistics call it.
+ * @param object_size The size of the objects.
+ * @param construct What to do to an object when its slab is carved.
+ * @param reset What to do to an object when it is given back.
+ * @return A negative value on failure, 0 otherwise.
+ */
+int slab_cache_init(
+    slab_cache_t *cache_ptr,
+    const char *name,
+    uint32_t object_size,
+    void (*construct)(void *object),
+    void (*reset)(void *object)
+);
+
+// Similar to malloc, except that the object comes from a cache.
+void *slab_alloc(slab_cache_t *cache_ptr);
+
+// Similar to free, except that the object goes back to its cache.
+void slab_free(slab_cache_t *cache_ptr, void *object);
+
+// get a snapshot of the statistics of a cache
+void get_slab_stats(slab_cache_t *cache_ptr, slab_stats_t *stats_ptr);
+
+/**
+ * @brief Get a snapshot of the statistics of every cache.
+ * 
+ * @param stats_ptr Where to store them.
+ * @param len How many entries stats_ptr has room for.
+ * @return How many entries are filled in.
+ */
+uint32_t get_all_slab_stats(kernel_cache_stats_t *stats_ptr, uint32_t len);
+
+#endif /* SLAB_H_SEEN */
@@ -0,0 +1,85 @@
+/**
+ * @file swap.h
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief a compressed store in kernel memory for cold user pages
+ */
+
+#ifndef SWAP_H_SEEN
+#define SWAP_H_SEEN
+
+#include <stdint.h> // uint32_t
+#include <vm.h> // pde_t
+
+struct pcb_t;
+struct pcb_ptr_node_t;
+
+int init_swap(void);
+
+/**
+ * @brief Let the pages of a process be moved to the compressed store.
+ * 
+ * Only the anonymous areas of a process that is not a guest are looked
+ * at, and only while its lock is free and pcb_ptr->swappable is set.
+ * 
+ * @param pcb_ptr The process, whose page directory and areas are set up.
+ * @return A negative value on memory allocation failure, 0 otherwise.
+ */
+int register_swappable(struct pcb_t *pcb_ptr);
+
+// forget a process before its page directory and areas are destroyed
+void unregister_swappable(struct pcb_t *pcb_ptr);
+
+/**
+ * @brief Lend the list of registered processes to a scan that cannot
+ *        wait, such as one in interrupt context.
+ * 
+ * The list stays as it is until return_swappable_list, which is to be
+ * called only on success. No page may move to the compressed store
+ * meanwhile.
+ * 
+ * @param list_ptr To hold the front of the list, NULL if it is empty.
+ * @return A negative value if the list is busy, 0 otherwise.
+ */
+int try_borrow_swappable_list(struct pcb_ptr_node_t **list_ptr);
+void return_swappable_list(void);
+
+/**
+ * @brief Free frames by moving cold pages to the compressed store.
+ * 
+ * Pages are looked at in a circle over the registered processes, and a
+ * page is moved only if it has not been accessed since the last time
+ * the circle passed by. The caller must not hold vm_lock.
+ * 
+ * @param count How many frames are wanted.
+ * @return How many frames have been freed.
+ */
+uint32_t reclaim_frames(uint32_t count);
+
+/**
+ * @brief Bring a page back from the compressed store into a new frame.
+ * 
+ * The caller holds the lock of the process that page_dir belongs to.
+ * 
+ * @param page_dir The page directory.
+ * @param v_addr The virtual address within the range of the page.
+ * @param access READ_ONLY or READ_WRITE.
+ * @return A negative value if the page is not swapped out or memory runs
+ *         out, 0 otherwise.
+ */
+int swap_in_page(pde_t *page_dir, uint32_t v_addr, uint32_t access);
+
+/**
+ * @brief Make a page of another page directory share a slot, for fork.
+ * 
+ * @param src_page_dir The page directory whose page is swapped out.
+ * @param dst_page_dir The page directory where the page is not mapped.
+ * @param v_addr The virtual address within the range of the page.
+ * @return A negative value on failure, 0 otherwise.
+ */
+int share_swap_slot(pde_t *src_page_dir, pde_t *dst_page_dir, uint32_t v_addr);
+
+// drop a reference to a slot, and free it with the last one
+void free_swap_slot(uint32_t slot);
+
+#endif /* SWAP_H_SEEN */
@@ -28,6 +28,8 @@ void handle_set_status(ureg_t *ureg_ptr);
 void handle_yield(ureg_t *ureg_ptr);
 void handle_deschedule(ureg_t *ureg_ptr);
 void handle_make_runnable(ureg_t *ureg_ptr);
+void handle_futex_wait(ureg_t *ureg_ptr);
+void handle_futex_wake(ureg_t *ureg_ptr);
 void handle_print(ureg_t *ureg_ptr);
 void handle_readline(ureg_t *ureg_ptr);
 void handle_getchar(ureg_t *ureg_ptr);
@@ -42,6 +44,9 @@ void handle_set_term_color(ureg_t *ureg_ptr);
 void handle_set_cursor_pos(ureg_t *ureg_ptr);
 void handle_get_cursor_pos(ureg_t *ureg_ptr);
 void handle_new_console(ureg_t *ureg_ptr);
+void handle_misbehave(ureg_t *ureg_ptr);
+void handle_set_fault_around(ureg_t *ureg_ptr);
+void handle_get_kernel_stats(ureg_t *ureg_ptr);
 
 bool check_eflags(uint32_t old_eflags, uint32_t new_eflags);
 
@@ -0,0 +1,80 @@
+/**
+ * @file timer_wheel.h
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief kernel timers that call a function once a tick has come
+ */
+
+#ifndef TIMER_WHEEL_H_SEEN
+#define TIMER_WHEEL_H_SEEN
+
+#include <variable_queue.h> // Q_NEW_LINK
+
+struct kernel_timer_t;
+typedef void (*timer_func_t)(struct kernel_timer_t *timer_ptr, void *arg);
+
+// A timer is owned by whoever armed it, and must stay where it is until
+// it has fired or been cancelled.
+typedef struct kernel_timer_t {
+    // the tick at or after which the timer fires
+    unsigned int expire_tick;
+    // called from the timer interrupt, with interrupts disabled
+    timer_func_t func;
+    void *arg;
+
+    // the slot of the wheel the timer is in, NULL if it is not armed
+    struct kernel_timer_queue_t *slot_ptr;
+    Q_NEW_LINK(kernel_timer_t) slot_link;
+} kernel_timer_t;
+// what Q_NEW_HEAD would define, but with a tag so that timers can point
+// to their slots
+typedef struct kernel_timer_queue_t {
+    kernel_timer_t *front;
+    kernel_timer_t *tail;
+} kernel_timer_queue_t;
+
+void init_timer_wheel(void);
+
+/**
+ * @brief Prepare a timer to be armed.
+ * 
+ * @param timer_ptr pointer to the timer
+ * @param func what to call when the timer fires
+ * @param arg what to pass to func
+ */
+void init_kernel_timer(kernel_timer_t *timer_ptr, timer_func_t func, void *arg);
+
+/**
+ * @brief Have a timer fire on a tick, or re-arm it if it is armed
+ *        already.
+ * 
+ * A tick that has passed fires the timer on the next tick. This
+ * function takes constant time, and should be called only when
+ * interrupts are disabled.
+ * 
+ * @param timer_ptr pointer to the timer
+ * @param expire_tick the tick to fire on
+ */
+void arm_kernel_timer(kernel_timer_t *timer_ptr, unsigned int expire_tick);
+
+/**
+ * @brief Keep an armed timer from firing. Nothing happens if the timer
+ *        is not armed.
+ * 
+ * This function takes constant time, and should be called only when
+ * interrupts are disabled.
+ * 
+ * @param timer_ptr pointer to the timer
+ */
+void cancel_kernel_timer(kernel_timer_t *timer_ptr);
+
+/**
+ * @brief Fire every timer whose tick has come, in a single pass.
+ * 
+ * This function is called by the timer interrupt handler.
+ * 
+ * @param now the current tick
+ */
+void run_timer_wheel(unsigned int now);
+
+#endif // TIMER_WHEEL_H_SEEN
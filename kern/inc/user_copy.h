@@ -0,0 +1,71 @@
+/**
+ * @file user_copy.h
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief copies between kernel and user memory
+ * 
+ * The copies do not check the page tables in advance. They just go,
+ * and a page fault the kernel cannot resolve makes them fail instead
+ * of killing the thread. Since resolving a page fault takes the lock
+ * of the current process, the caller must not hold it.
+ */
+
+#ifndef USER_COPY_H_SEEN
+#define USER_COPY_H_SEEN
+
+#include <stdint.h> // uint32_t
+#include <ureg.h> // ureg_t
+#include <stdbool.h> // bool
+
+/**
+ * @brief Test if a range of memory lies in user space.
+ * 
+ * @param addr memory start
+ * @param size memory size
+ * @return whether the range is in user space
+ */
+bool is_user_range(uint32_t addr, uint32_t size);
+
+/**
+ * @brief Copy len bytes of user memory into the kernel.
+ * 
+ * @param dst kernel buffer
+ * @param src user address
+ * @param len number of bytes
+ * @return a negative value on failure, 0 otherwise
+ */
+int copy_from_user(void *dst, uint32_t src, uint32_t len);
+
+/**
+ * @brief Copy len bytes of kernel memory out to the user.
+ * 
+ * @param dst user address
+ * @param src kernel buffer
+ * @param len number of bytes
+ * @return a negative value on failure, 0 otherwise
+ */
+int copy_to_user(uint32_t dst, const void *src, uint32_t len);
+
+/**
+ * @brief Copy a NUL terminated user string into the kernel.
+ * 
+ * @param dst kernel buffer
+ * @param src user address
+ * @param size capacity of dst, including the NUL
+ * @return a negative value on failure, including the case where the
+ *         string does not fit, the length of the string otherwise
+ */
+int copy_string_from_user(char *dst, uint32_t src, uint32_t size);
+
+/**
+ * @brief Resume a user copy that hit a page fault the kernel cannot
+ *        resolve at its failure path.
+ * 
+ * @param ureg_ptr pointer to the register values snapshotted before
+ *                 the page fault happens
+ * @return a negative value if the fault does not come from a user
+ *         copy, 0 if the copy is made to fail
+ */
+int fix_up_user_copy(ureg_t *ureg_ptr);
+
+#endif // USER_COPY_H_SEEN
@@ -0,0 +1,49 @@
+/**
+ * @file user_copy_stub.h
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief stubs that copy memory and survive page faults
+ */
+
+#ifndef USER_COPY_STUB_H_SEEN
+#define USER_COPY_STUB_H_SEEN
+
+#include <stdint.h> // uint32_t
+
+/**
+ * @brief A kernel instruction allowed to page fault, and the
+ *        instruction to resume at when the fault cannot be resolved.
+ */
+typedef struct {
+    uint32_t fault_eip;
+    uint32_t fixup_eip;
+} user_copy_fixup_t;
+
+// every instruction of the stubs that may touch user memory
+extern user_copy_fixup_t user_copy_fixups[];
+// number of entries in user_copy_fixups
+extern uint32_t user_copy_fixup_count;
+
+/**
+ * @brief Copy len bytes from src to dst.
+ * 
+ * @param dst where to copy to
+ * @param src where to copy from
+ * @param len number of bytes to copy
+ * @return 0 on success, -1 if an unresolvable page fault interrupts
+ *         the copy
+ */
+int copy_bytes(void *dst, const void *src, uint32_t len);
+
+/**
+ * @brief Copy a NUL terminated string from src to dst.
+ * 
+ * @param dst where to copy to
+ * @param src where to copy from
+ * @param size capacity of dst, including the NUL
+ * @return the length of the string, -1 if an unresolvable page fault
+ *         interrupts the copy, -2 if the string does not fit
+ */
+int copy_string(char *dst, const char *src, uint32_t size);
+
+#endif // USER_COPY_STUB_H_SEEN
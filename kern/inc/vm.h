@@ -25,17 +25,27 @@
 #define PTE_COUNT (PAGE_SIZE / sizeof(pte_t))
 // how many PDEs in a page directory
 #define PDE_COUNT (VIRTUAL_ADDR_END / PAGE_SIZE / PTE_COUNT)
+// how large a page mapped by a single PDE is
+#define LARGE_PAGE_SIZE (PTE_COUNT * PAGE_SIZE)
+// The top of the address space is a window through which the kernel heap
+// grows past the direct map. Every page directory shares its page tables,
+// and user memory ends where it starts.
+#define KERNEL_WINDOW_START (0xF0000000)
+#define KERNEL_WINDOW_SIZE (VIRTUAL_ADDR_END - KERNEL_WINDOW_START)
+#define USER_MEM_END (KERNEL_WINDOW_START)
 
 // read/write bit
 #define READ_ONLY (0)
 #define READ_WRITE (1)
 
-// Available bits in PTEs and PDEs,
-// when PTEs and PDEs are not present,
-// specify whether they can have
-// physical frames allocated on demand.
-#define PAGE_UNAVAILABLE (0)
-#define PAGE_AVAILABLE (1)
+// Available bits in PTEs, when PTEs are present, specify whether
+// the page is logically writable but shares its frame read only
+// until the first write.
+#define PAGE_PRIVATE (0)
+#define PAGE_COPY_ON_WRITE (2)
+// The available bits of a nonpresent PTE whose page has been moved to
+// the compressed store, in which case page_addr holds its slot.
+#define PAGE_SWAPPED (1)
 
 // page directory entry (PDE) structure
 typedef struct pde_t {
@@ -67,15 +77,56 @@ typedef struct pte_t {
     uint32_t page_addr          : 20;
 } pte_t;
 
+// How many pages a TLB batch invalidates one by one. Past that, the whole
+// non-global part of the TLB is flushed instead.
+#define TLB_BATCH_PAGE_COUNT_MAX (32)
+// how many frames a TLB batch holds back before it flushes on its own
+#define TLB_BATCH_FRAME_COUNT_MAX (64)
+
+// A batch of PTE updates to one page directory whose TLB entries are
+// invalidated together. Frames unmapped by the updates are freed only
+// after the invalidation, so that no stale TLB entry may reach a frame
+// that has been handed out again.
+typedef struct tlb_batch_t {
+    pde_t *page_dir;
+    uint32_t page_count;
+    // whether more pages are stale than page_array can track
+    bool full_flush;
+    uint32_t page_array[TLB_BATCH_PAGE_COUNT_MAX];
+    uint32_t frame_count;
+    uint32_t frame_array[TLB_BATCH_FRAME_COUNT_MAX];
+} tlb_batch_t;
+
 // information that tells how far a page is
 // from being mapped to a physical frame
 typedef enum mapping_info_t {
     PDE_NOT_PRESENT,
     PTE_NOT_PRESENT,
     ZERO_FRAME_MAPPED,
-    NEW_FRAME_MAPPED
+    NEW_FRAME_MAPPED,
+    // the page is not mapped, but its contents are in the compressed
+    // store
+    SWAPPED_OUT
 } mapping_info_t;
 
+// A cursor over the pages of a range of user memory. Each step covers a
+// single page, except that a step on a nonpresent PDE covers all of its
+// pages within the range at once, so that walking a range costs in
+// proportion to the page tables that are present.
+typedef struct page_iter_t {
+    pde_t *page_dir;
+    // where the next step starts and where the range ends
+    uint64_t next;
+    uint64_t end;
+    // the pages covered by the current step
+    uint32_t page;
+    uint32_t span;
+    mapping_info_t mapping_info;
+    // the read/write bit if the page is mapped, where a copy-on-write
+    // page counts as READ_WRITE
+    uint32_t access;
+} page_iter_t;
+
 /**
  * @brief Initialize the page directory manager
  * 
@@ -86,11 +137,39 @@ typedef enum mapping_info_t {
  */
 int init_page_dir_manager(void);
 
+/**
+ * @brief Start a batch of PTE updates to a page directory.
+ * 
+ * @param batch The batch.
+ * @param page_dir The page directory to be updated.
+ */
+void tlb_batch_init(tlb_batch_t *batch, pde_t *page_dir);
+
+/**
+ * @brief Invalidate the TLB entries of every page updated in the batch,
+ *        and then free the frames that were unmapped.
+ * 
+ * TLB entries are invalidated only if the page directory is the
+ * current one, since a switch of address spaces flushes them anyway.
+ * The batch is empty afterwards and may be reused.
+ * 
+ * @param batch The batch.
+ */
+void tlb_batch_flush(tlb_batch_t *batch);
+
+// invalidate the TLB entry of a single user page if page_dir is current
+void invalidate_page(pde_t *page_dir, uint32_t v_addr);
+
+// invalidate all non-global TLB entries if page_dir is current
+void invalidate_page_dir(pde_t *page_dir);
+
 /**
  * @brief Create a page directory and initialize it.
  * 
  * The page directory will do direct mapping for kernel address space
- * and leave user address space unmapped.
+ * and leave user address space unmapped. The page tables of the kernel
+ * address space are shared by all page directories, so only the page
+ * directory itself is allocated.
  * 
  * @return pde_t* The new page directory, which, on memory allocation
  *                failure, will be NULL.
@@ -99,19 +178,69 @@ pde_t *construct_page_dir(void);
 
 /**
  * @brief de-allocate the physical frames recorded in the page
- *        directory and free its PDEs and PTEs
+ *        directory and free its PDEs and user PTEs
  * 
  * @param page_dir The page directory.
  */
 void destruct_page_dir(pde_t *page_dir);
 
+/**
+ * @brief Back a range of the kernel window with frames.
+ * 
+ * The frames come from those not promised to anyone, and none is
+ * reclaimed from user pages for them, since the heap may be growing on
+ * behalf of the reclaimer. Either all the pages are mapped or none is.
+ * The frames stay mapped for good.
+ * 
+ * @param v_addr the first page, within the window and not mapped yet
+ * @param count how many pages to map
+ * @return A negative value on failure, 0 otherwise.
+ */
+int map_kernel_window(uint32_t v_addr, uint32_t count);
+
+/**
+ * @brief Move free frames into the pool of zeroed frames, clearing
+ *        them on the way.
+ * 
+ * This function is meant for time the CPU would otherwise spend idle.
+ * It is called with interrupts disabled, and gives up at once if the
+ * allocator is busy.
+ * 
+ * @param budget At most how many frames to clear.
+ */
+void refill_zeroed_frames(uint32_t budget);
+
+/**
+ * @brief Get how many requests for a zeroed frame have been served
+ *        from the pool, and how many had to clear a frame on the spot.
+ * 
+ * @param hit_count_ptr Where the hit count will be stored if not NULL.
+ * @param miss_count_ptr Where the miss count will be stored if not NULL.
+ */
+void get_zeroed_frame_stats(uint32_t *hit_count_ptr, uint32_t *miss_count_ptr);
+
+/**
+ * @brief Promise a number of frames to pages that will be given a frame
+ *        later, e.g., on their first write.
+ * 
+ * Reserved frames stay free, but no other allocation may take them.
+ * 
+ * @param count How many frames to reserve.
+ * @return A negative value if too few frames are left, 0 otherwise.
+ */
+int reserve_frames(uint32_t count);
+
+// give back frames promised by reserve_frames but not taken
+void unreserve_frames(uint32_t count);
+
 /**
  * @brief If the virtual page is not mapped, allocate a physical
- *        frame and map the virtual page to it.
+ *        frame filled with zeros and map the virtual page to it.
  * 
  * This function is used only for a user page. It may create a page
  * table if the PDE is not present. The mapped page will be assigned
- * read write access. 
+ * read write access. No TLB entry needs invalidating, since the TLB
+ * never caches a non-present PTE.
  * 
  * @param page_dir The page directory.
  * @param v_addr The virtual address within the range of the virtual
@@ -120,9 +249,200 @@ void destruct_page_dir(pde_t *page_dir);
  */
 int map_new_frame(pde_t *page_dir, uint32_t v_addr);
 
+// Similar to map_new_frame, except that the frame is one of those
+// reserved by reserve_frames, and the reservation shrinks by one.
+int map_reserved_frame(pde_t *page_dir, uint32_t v_addr);
+
 // Similar to map_new_frame, except that the zero frame is mapped.
 int map_zero_frame(pde_t *page_dir, uint32_t v_addr);
 
+/**
+ * @brief Map a user page read only to a frame that is already in use,
+ *        taking one more reference to it.
+ * 
+ * The page must not have been mapped.
+ * 
+ * @param page_dir The page directory.
+ * @param v_addr The virtual address within the range of the page.
+ * @param p_addr The physical address of the frame.
+ * @return A negative value on failure, 0 otherwise.
+ */
+int map_shared_frame(pde_t *page_dir, uint32_t v_addr, uint32_t p_addr);
+
+/**
+ * @brief Take one more reference to the frame a user page is mapped to,
+ *        so that the frame outlives the mapping.
+ * 
+ * @param page_dir The page directory.
+ * @param v_addr The virtual address within the range of the page.
+ * @param p_addr_ptr To hold the physical address of the frame.
+ * @return A negative value if the page is not mapped to a frame of its
+ *         own or the frame has too many references, 0 otherwise.
+ */
+int ref_mapped_frame(pde_t *page_dir, uint32_t v_addr, uint32_t *p_addr_ptr);
+
+// drop a reference taken by ref_mapped_frame
+void unref_frame(uint32_t p_addr);
+
+/**
+ * @brief Copy a page of data into a frame.
+ * 
+ * The frame does not have to be mapped anywhere.
+ * 
+ * @param p_addr The physical address of the frame.
+ * @param src Where the page of data is.
+ */
+void copy_to_frame(uint32_t p_addr, const void *src);
+
+// Similar to copy_to_frame, except that the data is copied out of the
+// frame.
+void copy_from_frame(void *dst, uint32_t p_addr);
+
+/**
+ * @brief Test if a user page is mapped to a frame that could move to
+ *        the compressed store, which is one of its own that has not been
+ *        accessed since the last test.
+ * 
+ * The accessed bit of the page is cleared on the way, so a page passes
+ * the test only if nothing has touched it between two tests. A page that
+ * passes has its dirty bit cleared as well, so that swap_out_frame can
+ * tell if it has been written since.
+ * 
+ * @param page_dir The page directory.
+ * @param v_addr The virtual address within the range of the page.
+ * @param p_addr_ptr To hold the physical address of the frame.
+ * @return A negative value if the page is in use or is not mapped to a
+ *         frame of its own, 0 otherwise.
+ */
+int find_cold_frame(pde_t *page_dir, uint32_t v_addr, uint32_t *p_addr_ptr);
+
+/**
+ * @brief Unmap a user page whose contents have been stored in a slot of
+ *        the compressed store, freeing its frame.
+ * 
+ * @param page_dir The page directory.
+ * @param v_addr The virtual address within the range of the page.
+ * @param p_addr The frame found by find_cold_frame.
+ * @param slot The slot, which the PTE remembers.
+ * @return A negative value if the page is no longer mapped to the frame
+ *         or has been touched since find_cold_frame, 0 otherwise.
+ */
+int swap_out_frame(
+    pde_t *page_dir,
+    uint32_t v_addr,
+    uint32_t p_addr,
+    uint32_t slot
+);
+
+/**
+ * @brief Map a swapped out user page to a new frame holding its
+ *        contents.
+ * 
+ * The slot the page pointed to is left for the caller to free.
+ * 
+ * @param page_dir The page directory.
+ * @param v_addr The virtual address within the range of the page.
+ * @param src The decompressed contents of the page.
+ * @param access Either READ_ONLY or READ_WRITE.
+ * @return A negative value if the page is not swapped out or no frame is
+ *         left, 0 otherwise.
+ */
+int swap_in_frame(
+    pde_t *page_dir,
+    uint32_t v_addr,
+    const void *src,
+    uint32_t access
+);
+
+/**
+ * @brief Get the slot of the compressed store a user page is in.
+ * 
+ * @param page_dir The page directory.
+ * @param v_addr The virtual address within the range of the page.
+ * @param slot_ptr To hold the slot.
+ * @return A negative value if the page is not swapped out, 0 otherwise.
+ */
+int get_swap_slot(pde_t *page_dir, uint32_t v_addr, uint32_t *slot_ptr);
+
+// Similar to map_zero_frame, except that the page is made to point to a
+// slot of the compressed store.
+int map_swap_slot(pde_t *page_dir, uint32_t v_addr, uint32_t slot);
+
+// forget the slot a user page points to without freeing it, so that the
+// page can be mapped again
+int unmap_swap_slot(pde_t *page_dir, uint32_t v_addr);
+
+/**
+ * @brief Test if a user page is mapped to a frame that could be merged
+ *        with identical ones, which is one of its own that has not been
+ *        written since the last test.
+ * 
+ * The dirty bit of the page is cleared on the way, so a page passes the
+ * test only if nothing has written it between two tests. Like the rest
+ * of the functions for merging, this one never waits for a lock and
+ * fails instead, so that it can run in interrupt context.
+ * 
+ * @param page_dir The page directory.
+ * @param v_addr The virtual address within the range of the page.
+ * @param p_addr_ptr To hold the physical address of the frame.
+ * @return A negative value if the page is being written, is not mapped
+ *         to a frame of its own or vm_lock is busy, 0 otherwise.
+ */
+int find_mergeable_frame(
+    pde_t *page_dir,
+    uint32_t v_addr,
+    uint32_t *p_addr_ptr
+);
+
+/**
+ * @brief Remap a user page found by find_mergeable_frame to another
+ *        frame with the same contents, freeing its own.
+ * 
+ * The page shares the other frame copy-on-write.
+ * 
+ * @param page_dir The page directory.
+ * @param v_addr The virtual address within the range of the page.
+ * @param p_addr The frame of the page.
+ * @param target_p_addr The frame to share, one pinned by
+ *                      pin_merged_frame.
+ * @return A negative value if the page is no longer mapped to p_addr or
+ *         has been written, the target cannot take one more reference or
+ *         vm_lock is busy, 0 otherwise.
+ */
+int merge_frame(
+    pde_t *page_dir,
+    uint32_t v_addr,
+    uint32_t p_addr,
+    uint32_t target_p_addr
+);
+
+// Similar to merge_frame, except that a page full of zeros is mapped to
+// the zero frame.
+int merge_zero_frame(pde_t *page_dir, uint32_t v_addr, uint32_t p_addr);
+
+/**
+ * @brief Turn the frame of a user page found by find_mergeable_frame into
+ *        one that other pages can be merged into.
+ * 
+ * The page becomes copy-on-write, and the frame takes one more reference
+ * that keeps it, and its contents, around until unpin_merged_frame.
+ * 
+ * @param page_dir The page directory.
+ * @param v_addr The virtual address within the range of the page.
+ * @param p_addr The frame of the page.
+ * @return A negative value on failure, 0 otherwise.
+ */
+int pin_merged_frame(pde_t *page_dir, uint32_t v_addr, uint32_t p_addr);
+
+// Drop the reference pin_merged_frame takes, only if no page maps the
+// frame any more when unused_only is set. A negative value is returned
+// if the reference is kept.
+int unpin_merged_frame(uint32_t p_addr, bool unused_only);
+
+// Similar to get_frame_ref_count, except that a negative value is
+// returned instead of waiting for vm_lock.
+int peek_frame_ref_count(uint32_t p_addr, uint32_t *ref_count_ptr);
+
 /**
  * @brief Find out which kind of frame a user page is mapped to.
  * 
@@ -146,16 +466,17 @@ int check_user_page(
  *        physical frame or the zero frame, unmap it. In the former
  *        case, the physical frame will also be de-allocated.
  * 
- * This function is used only for a user page. It will set the
- * available bits to PAGE_AVAILABLE in the end. It will not delete
+ * This function is used only for a user page. It will not delete
  * the page table if the page table ends up with no present PTE.
  * 
  * @param page_dir The page directory.
  * @param v_addr The virtual address within the range of the virtual
  *               page.
+ * @param batch The batch to defer the TLB invalidation and the frame
+ *              de-allocation to, or NULL to do both right away.
  * @return A negative value on failure, 0 otherwise.
  */
-int unmap_frame(pde_t *page_dir, uint32_t v_addr);
+int unmap_frame(pde_t *page_dir, uint32_t v_addr, tlb_batch_t *batch);
 
 /**
  * @brief Define whether the virtual page is read only or writtable
@@ -165,35 +486,151 @@ int unmap_frame(pde_t *page_dir, uint32_t v_addr);
  * @param v_addr The virtual address within the range of the virtual
  *               page.
  * @param access READ_ONLY or READ_WRITE.
+ * @param batch The batch to defer the TLB invalidation to, or NULL to
+ *              invalidate right away.
  * @return 0 if the virtual page is a user page and is mapped to a
  *         physical frame, in which case the function call succeeds.
  *         A negative value otherwise.
  */
-int set_access(pde_t *page_dir, uint32_t v_addr, uint32_t access);
+int set_access(
+    pde_t *page_dir,
+    uint32_t v_addr,
+    uint32_t access,
+    tlb_batch_t *batch
+);
 
 // get the read/write bit of a user page that has been mapped to a
-// physical frame
+// physical frame, where a copy-on-write page counts as READ_WRITE
 int get_access(pde_t *page_dir, uint32_t v_addr, uint32_t *access_ptr);
 
 /**
- * @brief Set the available bits of the virtual page, i.e., whether it can
- *        be mapped to a physical frame the first time it is accessed.
+ * @brief Map a user page of one page directory to the frame that
+ *        backs the same page of another, copy-on-write.
+ * 
+ * The page must be mapped to a previously allocated frame in
+ * src_page_dir and must not be mapped in dst_page_dir. If the page
+ * is writable, it becomes read only and copy-on-write in both page
+ * directories. The frame is freed only when neither maps it.
+ * 
+ * @param src_page_dir The page directory that owns the frame.
+ * @param dst_page_dir The page directory to share the frame with.
+ * @param v_addr The virtual address within the range of the
+ *               virtual page.
+ * @param batch The batch of src_page_dir to defer the TLB invalidation
+ *              to, or NULL to invalidate right away.
+ * @return A negative value on failure, including when the frame is
+ *         shared by too many page directories already, 0 otherwise.
+ */
+int share_frame(
+    pde_t *src_page_dir,
+    pde_t *dst_page_dir,
+    uint32_t v_addr,
+    tlb_batch_t *batch
+);
+
+/**
+ * @brief Map a user page of a page directory to a newly allocated
+ *        frame holding a copy of the same page in the current
+ *        address space.
+ * 
+ * The page must be mapped to a frame in the current address space
+ * and must not be mapped in page_dir. The access of the page is
+ * copied as well.
+ * 
+ * @param page_dir The page directory to map the copy in.
+ * @param v_addr The virtual address within the range of the
+ *               virtual page.
+ * @return A negative value on failure, 0 otherwise.
+ */
+int copy_frame(pde_t *page_dir, uint32_t v_addr);
+
+/**
+ * @brief Resolve a write to a copy-on-write user page of the current
+ *        address space.
+ * 
+ * If some other page directory still maps the frame, the page is
+ * remapped to a private copy. Otherwise the page simply becomes
+ * writable.
+ * 
+ * @param page_dir The current page directory.
+ * @param v_addr The virtual address within the range of the
+ *               virtual page.
+ * @return A negative value if the page is not copy-on-write or no
+ *         frame is left for the copy, 0 otherwise.
+ */
+int copy_on_write(pde_t *page_dir, uint32_t v_addr);
+
+
+/**
+ * @brief Start walking the user pages that overlap a range of memory.
  * 
- * This function is used only for a user page that has not been mapped
- * to a physical frame. It will create a page table if the PDE is not
- * present with different available bits.
+ * Pages below USER_PAGE_START or beyond the address space are left out.
  * 
+ * @param iter_ptr The cursor.
  * @param page_dir The page directory.
- * @param v_addr The virtual address within the range of the virtual page.
- * @param availability AVAILABLE or UNAVAILABLE.
- * @return A negative value if page_dir is NULL, availability is not a
- *         valid value, the virtual page is not a user page or the virtual
- *         page is mapped to a physical frame. 0 otherwise.
+ * @param addr Memory start.
+ * @param size Memory size.
  */
-int set_availability(pde_t *page_dir, uint32_t v_addr, uint32_t availability);
+void page_iter_init(
+    page_iter_t *iter_ptr,
+    pde_t *page_dir,
+    uint32_t addr,
+    uint32_t size
+);
+
+// move a cursor to its next step, false if the range is exhausted
+bool page_iter_next(page_iter_t *iter_ptr);
 
-// get the available bits of a user page that has not been mapped to
-// a physical frame
-int get_availability(pde_t *page_dir, uint32_t v_addr, uint32_t *availability_ptr);
+/**
+ * @brief Map every page of a range that is not mapped to a new frame or
+ *        the zero frame.
+ * 
+ * @param page_dir The page directory.
+ * @param addr Memory start.
+ * @param size Memory size.
+ * @param zero_frame Whether to map the zero frame.
+ * @return A negative value if memory runs out, in which case part of the
+ *         range may have been mapped. 0 otherwise.
+ */
+int map_range(pde_t *page_dir, uint32_t addr, uint32_t size, bool zero_frame);
+
+/**
+ * @brief Unmap every page of a range that is mapped.
+ * 
+ * @param page_dir The page directory.
+ * @param addr Memory start.
+ * @param size Memory size.
+ * @param batch The batch to defer the TLB invalidation and the freeing
+ *              of frames to, or NULL to do them right away.
+ * @return A negative value if memory runs out, in which case part of the
+ *         range may have been unmapped. 0 otherwise.
+ */
+int unmap_range(
+    pde_t *page_dir,
+    uint32_t addr,
+    uint32_t size,
+    tlb_batch_t *batch
+);
+
+/**
+ * @brief Set the read/write bit of every page of a range that is mapped,
+ *        see set_access.
+ * 
+ * @param page_dir The page directory.
+ * @param addr Memory start.
+ * @param size Memory size.
+ * @param access READ_ONLY or READ_WRITE.
+ * @param batch The batch to defer the TLB invalidation to, or NULL to
+ *              invalidate right away.
+ * @return A negative value if memory runs out, in which case part of the
+ *         range may have been changed. 0 otherwise.
+ */
+int protect_range(
+    pde_t *page_dir,
+    uint32_t addr,
+    uint32_t size,
+    uint32_t access,
+    tlb_batch_t *batch
+);
 
 #endif // VM_H_SEEN
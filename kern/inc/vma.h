@@ -0,0 +1,150 @@
+/**
+ * @file vma.h
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief virtual memory areas of a process
+ * 
+ * A process owns a balanced search tree of the areas of its address
+ * space that may be mapped, keyed by where they start. The areas never
+ * overlap. A page that is not in any area is not part of the process.
+ */
+
+#ifndef VMA_H_SEEN
+#define VMA_H_SEEN
+
+#include <stdint.h> // uint32_t
+#include <stdbool.h> // bool
+
+// what an area is for
+typedef enum vma_type_t {
+    // sections of the executable
+    VMA_EXECUTABLE,
+    // the user stack set up by exec
+    VMA_STACK,
+    // a region allocated by new_pages
+    VMA_NEW_PAGES,
+    // the physical memory of a guest
+    VMA_GUEST
+} vma_type_t;
+
+// where the contents of an area come from
+typedef enum vma_backing_t {
+    // Pages are filled with zeros on the first access.
+    VMA_ANONYMOUS,
+    // Pages are loaded from the executable by exec and are never
+    // missing afterwards.
+    VMA_IMAGE
+} vma_backing_t;
+
+// a virtual memory area, which is also a node of an AVL tree
+typedef struct vma_t {
+    // the first page of the area and one past the last page
+    uint32_t start;
+    uint64_t end;
+    // READ_ONLY or READ_WRITE, what the area allows
+    uint32_t access;
+    vma_type_t type;
+    vma_backing_t backing;
+    // how many frames are reserved for pages of the area that have none
+    uint32_t reserved_count;
+    // Where a sequential demand fault would come next, how many pages
+    // the next one maps ahead, and whether it maps them for writing.
+    // See fault_around_t.
+    uint64_t next_fault_page;
+    uint32_t fault_around_pages;
+    bool write_intent;
+
+    struct vma_t *left;
+    struct vma_t *right;
+    int height;
+} vma_t;
+
+/**
+ * @brief Find the area that covers an address.
+ * 
+ * @param root The root of the tree.
+ * @param addr The address.
+ * @return The area, or NULL if none covers addr.
+ */
+vma_t *find_vma(vma_t *root, uint32_t addr);
+
+/**
+ * @brief Find the first area that ends after an address.
+ * 
+ * @param root The root of the tree.
+ * @param addr The address.
+ * @return The area, or NULL if none.
+ */
+vma_t *find_vma_after(vma_t *root, uint64_t addr);
+
+/**
+ * @brief Test if a range of memory is fully covered by areas that allow
+ *        some access.
+ * 
+ * @param root The root of the tree.
+ * @param addr Memory start.
+ * @param size Memory size.
+ * @param access READ_ONLY if reading is enough, READ_WRITE otherwise.
+ * @return Whether the whole range is accessible.
+ */
+bool is_vma_range(vma_t *root, uint32_t addr, uint32_t size, uint32_t access);
+
+/**
+ * @brief Add an area to a tree.
+ * 
+ * The range is widened to whole pages.
+ * 
+ * @param root_ptr The pointer to the root of the tree.
+ * @param addr Memory start.
+ * @param size Memory size, not 0.
+ * @param access READ_ONLY or READ_WRITE.
+ * @param type What the area is for.
+ * @param backing Where the contents come from.
+ * @return A negative value if the area overlaps another one or memory
+ *         runs out, 0 otherwise.
+ */
+int insert_vma(
+    vma_t **root_ptr,
+    uint32_t addr,
+    uint32_t size,
+    uint32_t access,
+    vma_type_t type,
+    vma_backing_t backing
+);
+
+/**
+ * @brief Reserve a frame for every page of an area, so that touching
+ *        its pages never runs out of memory.
+ * 
+ * The frames left are given back when the area is removed.
+ * 
+ * @param vma_ptr The area, which has no reservation yet.
+ * @return A negative value if too few frames are left, 0 otherwise.
+ */
+int reserve_vma_frames(vma_t *vma_ptr);
+
+/**
+ * @brief Remove the area that starts at a page from a tree.
+ * 
+ * @param root_ptr The pointer to the root of the tree.
+ * @param start The first page of the area.
+ * @return A negative value if no area starts at start, 0 otherwise.
+ */
+int remove_vma(vma_t **root_ptr, uint32_t start);
+
+/**
+ * @brief Make a copy of a tree, for fork.
+ * 
+ * The copy reserves as many frames as the original still does.
+ * 
+ * @param root The root of the tree.
+ * @param copy_ptr To hold the root of the copy.
+ * @return A negative value if memory runs out, in which case nothing is
+ *         copied. 0 otherwise.
+ */
+int copy_vma_tree(vma_t *root, vma_t **copy_ptr);
+
+// free every area of a tree and make it empty
+void destroy_vma_tree(vma_t **root_ptr);
+
+#endif /* VMA_H_SEEN */
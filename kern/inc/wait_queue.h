@@ -0,0 +1,63 @@
+/**
+ * @file wait_queue.h
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief queues of threads waiting on a kernel object
+ */
+
+#ifndef WAIT_QUEUE_H_SEEN
+#define WAIT_QUEUE_H_SEEN
+
+struct tcb_t;
+
+// Waiters are linked through the state links of their TCBs, in the order
+// they started waiting. It is what Q_NEW_HEAD would define for them, but
+// it does not need the definition of tcb_t.
+typedef struct wait_queue_t {
+    struct tcb_t *front;
+    struct tcb_t *tail;
+} wait_queue_t;
+
+void init_wait_queue(wait_queue_t *queue_ptr);
+
+/**
+ * @brief Block the running thread on a queue until it is woken up.
+ * 
+ * This function should be called only when interrupts are disabled.
+ * 
+ * @param queue_ptr pointer to the queue
+ * @param reason the blocking reason
+ * @param next_tcb_ptr the thread to run meanwhile, NULL to let the
+ *                     scheduler pick one
+ * @return A negative value if there is no other thread to run, in which
+ *         case the running thread does not block. 0 after it has been
+ *         woken up otherwise.
+ */
+int wait_on_queue(
+    wait_queue_t *queue_ptr,
+    int reason,
+    struct tcb_t *next_tcb_ptr
+);
+
+/**
+ * @brief Make the thread that has waited the longest on a queue
+ *        runnable.
+ * 
+ * This function should be called only when interrupts are disabled.
+ * 
+ * @param queue_ptr pointer to the queue
+ * @return the woken thread, NULL if the queue is empty
+ */
+struct tcb_t *wake_one(wait_queue_t *queue_ptr);
+
+/**
+ * @brief Make every thread waiting on a queue runnable.
+ * 
+ * This function should be called only when interrupts are disabled.
+ * 
+ * @param queue_ptr pointer to the queue
+ * @return how many threads have been woken up
+ */
+int wake_all(wait_queue_t *queue_ptr);
+
+#endif // WAIT_QUEUE_H_SEEN
@@ -27,6 +27,7 @@
 #include <virtual_interrupt.h> // initialize_virtual_interrupt
 #include <keyhelp.h> // KEY_IDT_ENTRY
 #include <timer_defines.h> // TIMER_IDT_ENTRY
+#include <user_copy.h> // fix_up_user_copy
 
 // Put into IDT a dummy gate for the interrupt vector.
 // The gate will be a trap gate with DPL 0 and the corresponding
@@ -367,6 +368,14 @@ int initialize_idt(void) {
     add_trap_gate(DESCHEDULE_INT, wrap_handler70, USER_PL);
     handler_array[MAKE_RUNNABLE_INT] = handle_make_runnable;
     add_trap_gate(MAKE_RUNNABLE_INT, wrap_handler71, USER_PL);
+    handler_array[FUTEX_WAIT_INT] = handle_futex_wait;
+    add_trap_gate(FUTEX_WAIT_INT, wrap_handler128, USER_PL);
+    handler_array[FUTEX_WAKE_INT] = handle_futex_wake;
+    add_trap_gate(FUTEX_WAKE_INT, wrap_handler129, USER_PL);
+    handler_array[SET_FAULT_AROUND_INT] = handle_set_fault_around;
+    add_trap_gate(SET_FAULT_AROUND_INT, wrap_handler130, USER_PL);
+    handler_array[GET_KERNEL_STATS_INT] = handle_get_kernel_stats;
+    add_trap_gate(GET_KERNEL_STATS_INT, wrap_handler131, USER_PL);
     handler_array[PRINT_INT] = handle_print;
     add_trap_gate(PRINT_INT, wrap_handler78, USER_PL);
     handler_array[READLINE_INT] = handle_readline;
@@ -395,6 +404,8 @@ int initialize_idt(void) {
     add_trap_gate(GET_CURSOR_POS_INT, wrap_handler81, USER_PL);
     handler_array[NEW_CONSOLE_INT] = handle_new_console;
     add_trap_gate(NEW_CONSOLE_INT, wrap_handler88, USER_PL);
+    handler_array[MISBEHAVE_INT] = handle_misbehave;
+    add_trap_gate(MISBEHAVE_INT, wrap_handler84, USER_PL);
 
     // hypervisor specific
     initialize_virtual_interrupt();
@@ -411,8 +422,21 @@ int initialize_idt(void) {
  */
 void handle(ureg_t *ureg_ptr) {
     unsigned int interrupt = ureg_ptr->cause;
-    tcb_t *current_tcb_ptr = thread_lists[RUNNING_STATE]->data;
+    tcb_t *current_tcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]));
     pcb_t *current_pcb_ptr = current_tcb_ptr->pcb_ptr;
+
+    // Page faults the kernel can fix are not the business of the user
+    // provided handler. Nor are they the guest's, whose physical memory
+    // is backed on demand, whether the guest or the host touches it.
+    if (interrupt == IDT_PF && !(resolve_page_fault(ureg_ptr) < 0)) {
+        return;
+    }
+    // A copy between kernel and user memory that faults for good fails
+    // instead, leaving the system call to return an error.
+    if (interrupt == IDT_PF && !(fix_up_user_copy(ureg_ptr) < 0)) {
+        return;
+    }
+
     if (current_pcb_ptr->guest) {
         if (ureg_ptr->cs == SEGSEL_KERNEL_CS) {
             if (interrupt != TIMER_IDT_ENTRY && interrupt != KEY_IDT_ENTRY) {
@@ -20,6 +20,9 @@
 #include <interrupt.h>
 #include <ctrl_blk.h>
 #include <vm.h>
+#include <swap.h>
+#include <kernel_stack.h>
+#include <paging_pool.h>
 #include <console.h>
 #include <execution_state.h>
 #include <loader.h>
@@ -29,6 +32,7 @@
 #include <assert.h>
 #include <mem_allocation.h>
 #include <segmentation.h>
+#include <page_cache.h>
 
 volatile static int __kernel_all_done = 0;
 
@@ -62,14 +66,27 @@ int kernel_main(mbinfo_t *mbinfo, int argc, char **argv, char **envp)
     // Clear console.
     clear_console();
 
+    // Initialize the pool page directories and page tables come from.
+    affirm(!(init_paging_pool() < 0));
+
     // Initialize physical frame allocator and page directory manager.
     affirm(!(init_page_dir_manager() < 0));
 
+    // Initialize the cache of pages shared by processes running the same
+    // executable.
+    affirm(!(init_page_cache() < 0));
+
+    // Initialize the compressed store of cold pages.
+    affirm(!(init_swap() < 0));
+
+    // Initialize the pool kernel stacks come from.
+    affirm(!(init_kernel_stack_pool() < 0));
+
     // Set up the first TCB.
     affirm(!(init_ctrl_blk() < 0));
 
     // Initialize esp0.
-    tcb_t *current_tcb_ptr = thread_lists[RUNNING_STATE]->data;
+    tcb_t *current_tcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]));
     set_esp0((uint32_t)(current_tcb_ptr->kernel_stack + KERNEL_STACK_LEN));
     lprintf("esp0 is initialized.");
 
@@ -78,7 +95,11 @@ int kernel_main(mbinfo_t *mbinfo, int argc, char **argv, char **envp)
         (get_cr3() & ~((~0 >> PAGE_SHIFT) << PAGE_SHIFT)) |
         (uint32_t)current_tcb_ptr->pcb_ptr->page_directory
     );
-    set_cr0(get_cr0() | CR0_PG);
+    // Large pages must be enabled before paging walks the kernel's.
+    set_cr4(get_cr4() | CR4_PSE);
+    // Write protection makes the kernel's own writes to copy-on-write
+    // and zero frame pages fault like the user's do.
+    set_cr0(get_cr0() | CR0_PG | CR0_WP);
     set_cr4(get_cr4() | CR4_PGE);
     lprintf("Control registers are initialized.");
 
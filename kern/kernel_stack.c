@@ -0,0 +1,81 @@
+/**
+ * @file kernel_stack.c
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief a pool of page aligned kernel stacks
+ * 
+ * Stacks that threads give back stay in the pool, linked through their
+ * first words, so that threads created later take them without going
+ * through the heap. Only up to KERNEL_STACK_POOL_MAX of them are kept.
+ */
+
+#include <kernel_stack.h> // alloc_kernel_stack
+#include <malloc.h> // smemalign
+#include <mutex.h> // mutex_lock
+#include <page.h> // PAGE_SIZE
+#include <stddef.h> // NULL
+#include <stdint.h> // uint32_t
+
+// free stacks, each holding the next one in its first word
+uint32_t *free_kernel_stacks = NULL;
+int free_kernel_stack_count = 0;
+// the lock of the two fields above
+mutex_t kernel_stack_pool_lock;
+
+/**
+ * @brief initialize the pool of kernel stacks
+ * 
+ * @return a negative value on failure, 0 otherwise
+ */
+int init_kernel_stack_pool(void) {
+    return mutex_init(&kernel_stack_pool_lock);
+}
+
+/**
+ * @brief take a kernel stack from the pool, or from the heap if the
+ *        pool is empty
+ * 
+ * @return NULL on failure. The lowest address of a stack of
+ *         KERNEL_STACK_LEN words otherwise.
+ */
+uint32_t *alloc_kernel_stack(void) {
+    mutex_lock(&kernel_stack_pool_lock);
+    uint32_t *kernel_stack = free_kernel_stacks;
+    if (kernel_stack != NULL) {
+        free_kernel_stacks = (uint32_t *)kernel_stack[0];
+        free_kernel_stack_count--;
+    }
+    mutex_unlock(&kernel_stack_pool_lock);
+
+    if (kernel_stack == NULL) {
+        kernel_stack = smemalign(PAGE_SIZE, KERNEL_STACK_SIZE);
+    }
+    return kernel_stack;
+}
+
+/**
+ * @brief give a kernel stack back to the pool, or to the heap if the
+ *        pool is full
+ * 
+ * The stack may not be in use by any thread, including the caller.
+ * 
+ * @param kernel_stack the lowest address of the stack
+ */
+void free_kernel_stack(uint32_t *kernel_stack) {
+    if (kernel_stack == NULL) {
+        return;
+    }
+
+    mutex_lock(&kernel_stack_pool_lock);
+    if (free_kernel_stack_count < KERNEL_STACK_POOL_MAX) {
+        kernel_stack[0] = (uint32_t)free_kernel_stacks;
+        free_kernel_stacks = kernel_stack;
+        free_kernel_stack_count++;
+        kernel_stack = NULL;
+    }
+    mutex_unlock(&kernel_stack_pool_lock);
+
+    if (kernel_stack != NULL) {
+        sfree(kernel_stack, KERNEL_STACK_SIZE);
+    }
+}
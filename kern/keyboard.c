@@ -31,6 +31,7 @@ void handle_keyboard(ureg_t *ureg_ptr);
  * @brief install keyboard driver
  */
 void install_keyboard(void) {
+    init_wait_queue(&keystroke_queue);
     handler_array[KEY_IDT_ENTRY] = handle_keyboard;
     add_interrupt_gate(KEY_IDT_ENTRY, wrap_handler33, KERNEL_PL);
     lprintf("The keyboard has been installed.");
@@ -52,13 +53,11 @@ void handle_keyboard(ureg_t *ureg_ptr) {
 
     outb(INT_CTL_PORT,  INT_ACK_CURRENT);
 
-    // wake up the first reader if any
-    if (
-        thread_lists[READLINE] != NULL &&
-        thread_lists[READLINE]->data->blocking_detail.first_reader
-    ) {
-        switch_context(thread_lists[READLINE]->data, READY_STATE, NULL);
-    } 
+    // switch to the reader waiting for the keystroke if any
+    tcb_t *reader_tcb_ptr = Q_GET_FRONT(&keystroke_queue);
+    if (reader_tcb_ptr != NULL) {
+        switch_context(reader_tcb_ptr, READY_STATE, NULL);
+    }
 }
 
 /**
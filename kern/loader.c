@@ -31,23 +31,30 @@
 #include <string.h>
 #include <segmentation.h>
 #include <hvcall.h>
+#include <page_cache.h>
+#include <vma.h>
 
 // default user stack length, measured in double words
 #define USER_STACK_LEN (0x10000)
 
-int change_access(
-    pde_t *page_dir,
-    uint32_t addr,
+int load_section(
+    char *execname,
+    simple_elf_t *elf_ptr,
+    uint32_t offset,
     uint32_t size,
-    uint32_t access
+    uint32_t start,
+    bool skip_shareable
 );
-int change_availability(
+int set_up_executable_vmas(
     pde_t *page_dir,
-    uint32_t addr,
-    uint32_t size,
-    uint32_t availability
+    vma_t **root_ptr,
+    simple_elf_t *elf_ptr
+);
+int get_section_access(
+    simple_elf_t *elf_ptr,
+    uint32_t page,
+    uint32_t *access_ptr
 );
-int map_and_clear(uint32_t addr, uint32_t size, bool zero_frame);
 
 /**
  * Copies data from a file into a buffer.
@@ -180,12 +187,14 @@ int load_executable(char *execname, char **argvec, ureg_t *ureg_ptr) {
     
     // switch to a new page directory before loading the executable
     // so that we have way back on failure
-    pcb_t *current_pcb_ptr = thread_lists[RUNNING_STATE]->data->pcb_ptr;
+    pcb_t *current_pcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
     uint32_t old_cr3 = get_cr3();
     pde_t *old_page_dir = (pde_t *)((old_cr3 >> PAGE_SHIFT) << PAGE_SHIFT);
     uint32_t new_cr3 = (uint32_t)new_page_dir |
         (old_cr3 & ~((~0 >> PAGE_SHIFT) << PAGE_SHIFT));
     current_pcb_ptr->page_directory = new_page_dir;
+    vma_t *old_vma_tree = current_pcb_ptr->vma_tree;
+    current_pcb_ptr->vma_tree = NULL;
     set_cr3(new_cr3);
 
     // Test if the executable is a guest.
@@ -196,21 +205,19 @@ int load_executable(char *execname, char **argvec, ureg_t *ureg_ptr) {
     uint32_t stack_high;
     uint32_t stack_low;
     if (guest) {
-        // allocate all the frames at once
-        if (
-            change_availability(
-                new_page_dir,
-                USER_MEM_START,
-                GUEST_MEM_SIZE,
-                PAGE_AVAILABLE
-            ) < 0 ||
-            map_and_clear(
-                USER_MEM_START,
-                GUEST_MEM_SIZE,
-                false
-            ) < 0
-        ) {
+        // Guest physical memory is only made an area here. Frames are
+        // mapped on first access, like for any other process.
+        if (insert_vma(
+            &(current_pcb_ptr->vma_tree),
+            USER_MEM_START,
+            GUEST_MEM_SIZE,
+            READ_WRITE,
+            VMA_GUEST,
+            VMA_ANONYMOUS
+        ) < 0) {
             current_pcb_ptr->page_directory = old_page_dir;
+            destroy_vma_tree(&(current_pcb_ptr->vma_tree));
+            current_pcb_ptr->vma_tree = old_vma_tree;
             set_cr3(old_cr3);
             for (int i = 0; i < argc; i++) {
                 free(arg_array[i]);
@@ -223,17 +230,21 @@ int load_executable(char *execname, char **argvec, ureg_t *ureg_ptr) {
         stack_high = USER_MEM_START + GUEST_MEM_SIZE;
         stack_low = stack_high - USER_STACK_LEN * sizeof(uint32_t);
     } else {
-        // set pages for the user stack to be available before actually
-        // allocating frames to them
-        stack_high = (uint32_t)VIRTUAL_ADDR_END;
+        // make the user stack an area before actually allocating frames
+        // to it
+        stack_high = USER_MEM_END;
         stack_low = stack_high - USER_STACK_LEN * sizeof(uint32_t);
-        if (change_availability(
-            new_page_dir,
+        if (insert_vma(
+            &(current_pcb_ptr->vma_tree),
             stack_low,
             stack_high - stack_low,
-            PAGE_AVAILABLE
+            READ_WRITE,
+            VMA_STACK,
+            VMA_ANONYMOUS
         ) < 0) {
             current_pcb_ptr->page_directory = old_page_dir;
+            destroy_vma_tree(&(current_pcb_ptr->vma_tree));
+            current_pcb_ptr->vma_tree = old_vma_tree;
             set_cr3(old_cr3);
             for (int i = 0; i < argc; i++) {
                 free(arg_array[i]);
@@ -256,6 +267,8 @@ int load_executable(char *execname, char **argvec, ureg_t *ureg_ptr) {
                 (strlen(arg_array[i]) + 1) * sizeof(char)
             ) < 0) {
                 current_pcb_ptr->page_directory = old_page_dir;
+                destroy_vma_tree(&(current_pcb_ptr->vma_tree));
+                current_pcb_ptr->vma_tree = old_vma_tree;
                 set_cr3(old_cr3);
                 for (int j = i; j < argc; j++) {
                     free(arg_array[j]);
@@ -275,6 +288,8 @@ int load_executable(char *execname, char **argvec, ureg_t *ureg_ptr) {
             argc * sizeof(char *)
         ) < 0) {
             current_pcb_ptr->page_directory = old_page_dir;
+            destroy_vma_tree(&(current_pcb_ptr->vma_tree));
+            current_pcb_ptr->vma_tree = old_vma_tree;
             set_cr3(old_cr3);
             free(arg_array);
             free(executable_name);
@@ -318,7 +333,8 @@ int load_executable(char *execname, char **argvec, ureg_t *ureg_ptr) {
 
     // leave the rest of the user stack mapped to zero frame
     if (success) {
-        if (map_and_clear(
+        if (map_range(
+            new_page_dir,
             stack_low,
             esp - stack_low,
             true
@@ -370,8 +386,8 @@ int load_executable(char *execname, char **argvec, ureg_t *ureg_ptr) {
         // are for the guest kernel. Just like those for the host kernel,
         // they are open to any read write operation.
         
-        // No need to load .bss. The frames for it have been allocated
-        // and cleared.
+        // No need to load .bss. Its pages will be zero filled on
+        // demand.
 
         if (success) {
             *ureg_ptr = (ureg_t){
@@ -391,72 +407,39 @@ int load_executable(char *execname, char **argvec, ureg_t *ureg_ptr) {
             };
         }
     } else {
-        // set page availability for each section
-        if (success) {
-            if (
-                change_availability(
-                    new_page_dir,
-                    simple_elf.e_txtstart,
-                    simple_elf.e_txtlen,
-                    PAGE_AVAILABLE
-                ) < 0 ||
-                change_availability(
-                    new_page_dir,
-                    simple_elf.e_rodatstart,
-                    simple_elf.e_rodatlen,
-                    PAGE_AVAILABLE
-                ) < 0 ||
-                change_availability(
-                    new_page_dir,
-                    simple_elf.e_datstart,
-                    simple_elf.e_datlen,
-                    PAGE_AVAILABLE
-                ) < 0 ||
-                change_availability(
-                    new_page_dir,
-                    simple_elf.e_bssstart,
-                    simple_elf.e_bsslen,
-                    PAGE_AVAILABLE
-                ) < 0
-            ) {
-                success = false;
-            }
-        }
+        // Pages holding only .text and .rodata may be shared with other
+        // processes running the same executable, in which case they are
+        // not loaded again.
+        bool cached = success && !(map_cached_pages(
+            new_page_dir,
+            executable_name,
+            &simple_elf
+        ) < 0);
 
         // load .text
         if (success) {
-            if (
-                map_and_clear(
-                    simple_elf.e_txtstart,
-                    simple_elf.e_txtlen,
-                    false
-                ) < 0 ||
-                getbytes(
-                    executable_name,
-                    simple_elf.e_txtoff,
-                    simple_elf.e_txtlen,
-                    (char *)(simple_elf.e_txtstart)
-                ) < 0
-            ) {
+            if (load_section(
+                executable_name,
+                &simple_elf,
+                simple_elf.e_txtoff,
+                simple_elf.e_txtlen,
+                simple_elf.e_txtstart,
+                cached
+            ) < 0) {
                 success = false;
             }
         }
 
         // load .rodata
         if (success && simple_elf.e_rodatlen > 0) {
-            if (
-                map_and_clear(
-                    simple_elf.e_rodatstart,
-                    simple_elf.e_rodatlen,
-                    false
-                ) < 0 ||
-                getbytes(
-                    executable_name,
-                    simple_elf.e_rodatoff,
-                    simple_elf.e_rodatlen,
-                    (char *)(simple_elf.e_rodatstart)
-                ) < 0
-            ) {
+            if (load_section(
+                executable_name,
+                &simple_elf,
+                simple_elf.e_rodatoff,
+                simple_elf.e_rodatlen,
+                simple_elf.e_rodatstart,
+                cached
+            ) < 0) {
                 success = false;
             }
         }
@@ -464,7 +447,8 @@ int load_executable(char *execname, char **argvec, ureg_t *ureg_ptr) {
         // load .data
         if (success && simple_elf.e_datlen > 0) {
             if (
-                map_and_clear(
+                map_range(
+                    new_page_dir,
                     simple_elf.e_datstart,
                     simple_elf.e_datlen,
                     false
@@ -480,36 +464,27 @@ int load_executable(char *execname, char **argvec, ureg_t *ureg_ptr) {
             }
         }
 
-        // unset the R/W bit of each PTE of read only sections,
-        // then set the R/W bit of each PTE of read write sections
+        // Make an area of the pages of the sections, and unset the R/W
+        // bit of each PTE of those holding nothing but read only sections.
         if (success) {
-            if (
-                change_access(
-                    new_page_dir,
-                    simple_elf.e_txtstart,
-                    simple_elf.e_txtlen,
-                    READ_ONLY
-                ) < 0 ||
-                change_access(
-                    new_page_dir,
-                    simple_elf.e_rodatstart,
-                    simple_elf.e_rodatlen,
-                    READ_ONLY
-                ) < 0 ||
-                change_access(
-                    new_page_dir,
-                    simple_elf.e_datstart,
-                    simple_elf.e_datlen,
-                    READ_WRITE
-                ) < 0
-            ) {
+            if (set_up_executable_vmas(
+                new_page_dir,
+                &(current_pcb_ptr->vma_tree),
+                &simple_elf
+            ) < 0) {
                 success = false;
             }
         }
 
+        // let later processes running the executable share the pages
+        if (success && !cached) {
+            cache_pages(new_page_dir, executable_name, &simple_elf);
+        }
+
         // load .bss
         if (success && simple_elf.e_bsslen > 0) {
-            if (map_and_clear(
+            if (map_range(
+                new_page_dir,
                 simple_elf.e_bssstart,
                 simple_elf.e_bsslen,
                 true
@@ -536,6 +511,8 @@ int load_executable(char *execname, char **argvec, ureg_t *ureg_ptr) {
     // on failure, back off
     if (!success) {
         current_pcb_ptr->page_directory = old_page_dir;
+        destroy_vma_tree(&(current_pcb_ptr->vma_tree));
+        current_pcb_ptr->vma_tree = old_vma_tree;
         set_cr3(old_cr3);
         free(executable_name);
         destruct_page_dir(new_page_dir);
@@ -543,12 +520,7 @@ int load_executable(char *execname, char **argvec, ureg_t *ureg_ptr) {
     }
 
     destruct_page_dir(old_page_dir);
-    while (current_pcb_ptr->page_allocation_list != NULL) {
-        POP_FRONT(
-            page_allocation_node_t,
-            current_pcb_ptr->page_allocation_list
-        );
-    }
+    destroy_vma_tree(&old_vma_tree);
     current_pcb_ptr->guest = guest;
 
     sim_reg_process((void *)new_cr3, executable_name);
@@ -557,59 +529,6 @@ int load_executable(char *execname, char **argvec, ureg_t *ureg_ptr) {
     return 0;
 }
 
-/**
- * @brief walk through a range of memory and change the read/write bit of each
- *        PTE
- * 
- * Even if this function fails, some PTEs may still have been modified.
- * 
- * @param page_dir the page directory
- * @param addr memory start
- * @param size memory size
- * @param access the desired read/write bit
- * @return a negative value on failure, 0 otherwise
- */
-int change_access(
-    pde_t *page_dir,
-    uint32_t addr,
-    uint32_t size,
-    uint32_t access
-) {
-    if (size > 0) {
-        for (
-            uint64_t i = (addr >> PAGE_SHIFT) << PAGE_SHIFT;
-            i < (uint64_t)addr + (uint64_t)size;
-            i += PAGE_SIZE
-        ) {
-            if (set_access(page_dir, i, access) < 0) {
-                return -1;
-            }
-        }
-    }
-    return 0;
-}
-
-// Similar to change_access, except that the available bits are to be changed.
-int change_availability(
-    pde_t *page_dir,
-    uint32_t addr,
-    uint32_t size,
-    uint32_t availability
-) {
-    if (size > 0) {
-        for (
-            uint64_t i = (addr >> PAGE_SHIFT) << PAGE_SHIFT;
-            i < (uint64_t)addr + (uint64_t)size;
-            i += PAGE_SIZE
-        ) {
-            if (set_availability(page_dir, i, availability) < 0) {
-                return -1;
-            }
-        }
-    }
-    return 0;
-}
-
 /**
  * @brief treat a pointer like a stack pointer and push a value to
  *        the memory pointed to by it
@@ -629,7 +548,8 @@ int push_val(uint32_t *esp_ptr, void *val_ptr, uint32_t size) {
     if (size > 0) {
         uint32_t new_esp = (*esp_ptr - size) /
             sizeof(uint32_t) * sizeof(uint32_t);
-        if (map_and_clear(new_esp, *esp_ptr - new_esp, false) < 0) {
+        pde_t *page_dir = (pde_t *)((get_cr3() >> PAGE_SHIFT) << PAGE_SHIFT);
+        if (map_range(page_dir, new_esp, *esp_ptr - new_esp, false) < 0) {
             return -1;
         }
         for (uint32_t i = 0; i < size; i++) {
@@ -644,53 +564,182 @@ int push_val(uint32_t *esp_ptr, void *val_ptr, uint32_t size) {
 }
 
 /**
- * @brief walk through a range of user memory and map any unmapped
- *        page to a physical frame
+ * @brief load a section of an executable into the current address space
  * 
- * If any unmapped page is not available, this function will fail.
- * In the case it fails, part of the memory may still have been
- * mapped.
+ * The pages of the section are mapped to new frames before being filled
+ * in. In the case it fails, part of the section may still have been
+ * loaded.
  * 
- * @param addr memory start
- * @param size memory size
- * @param zero_frame whether the unmapped pages will be mapped to
- *                   the zero frame or a newly allocated frame
+ * @param execname the name of the executable
+ * @param elf_ptr the executable
+ * @param offset where the section is in the executable
+ * @param size size of the section
+ * @param start where the section is in memory
+ * @param skip_shareable whether to leave out the pages that have been
+ *                       mapped from the page cache
  * @return a negative value on failure, 0 on success
  */
-int map_and_clear(uint32_t addr, uint32_t size, bool zero_frame) {
-    if (size > 0) {
-        pde_t *page_dir = (pde_t *)((get_cr3() >> PAGE_SHIFT) << PAGE_SHIFT);
-        for (
-            uint64_t i = (addr >> PAGE_SHIFT) << PAGE_SHIFT;
-            i < (uint64_t)addr + (uint64_t)size;
-            i += PAGE_SIZE
+int load_section(
+    char *execname,
+    simple_elf_t *elf_ptr,
+    uint32_t offset,
+    uint32_t size,
+    uint32_t start,
+    bool skip_shareable
+) {
+    pde_t *page_dir = (pde_t *)((get_cr3() >> PAGE_SHIFT) << PAGE_SHIFT);
+    if (!skip_shareable) {
+        if (
+            map_range(page_dir, start, size, false) < 0 ||
+            getbytes(execname, offset, size, (char *)start) < 0
         ) {
-            mapping_info_t mapping_info;
-            if (check_user_page(page_dir, i, &mapping_info) < 0) {
-                return -1;
-            }
-            if (
-                mapping_info != ZERO_FRAME_MAPPED &&
-                mapping_info != NEW_FRAME_MAPPED
-            ) {
-                uint32_t availability;
-                get_availability(page_dir, i, &availability);
-                if (availability != PAGE_AVAILABLE) {
-                    return -1;
-                }
-                if (zero_frame) {
-                    if (map_zero_frame(page_dir, i) < 0) {
-                        return -1;
-                    }
-                } else {
-                    if (map_new_frame(page_dir, i) < 0) {
-                        return -1;
-                    }
-                    memset((void *)(uint32_t)i, 0, PAGE_SIZE);
-                }
-            }
+            return -1;
+        }
+        return 0;
+    }
+
+    // load the section page by page around the shared ones
+    uint64_t end = (uint64_t)start + (uint64_t)size;
+    for (
+        uint64_t i = (start >> PAGE_SHIFT) << PAGE_SHIFT;
+        i < end;
+        i += PAGE_SIZE
+    ) {
+        if (is_shareable_page(elf_ptr, i)) {
+            continue;
+        }
+        uint32_t chunk_start = i < start ? start : i;
+        uint32_t chunk_end = i + PAGE_SIZE < end ? i + PAGE_SIZE : end;
+        if (
+            map_range(
+                page_dir,
+                chunk_start,
+                chunk_end - chunk_start,
+                false
+            ) < 0 ||
+            getbytes(
+                execname,
+                offset + (chunk_start - start),
+                chunk_end - chunk_start,
+                (char *)chunk_start
+            ) < 0
+        ) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief get the access of a page of an executable
+ * 
+ * A page is writable if it holds any of .data and .bss, and read only
+ * if it holds nothing but .text and .rodata.
+ * 
+ * @param elf_ptr the executable
+ * @param page the page
+ * @param access_ptr to hold READ_ONLY or READ_WRITE
+ * @return a negative value if the page holds no section, 0 otherwise
+ */
+int get_section_access(
+    simple_elf_t *elf_ptr,
+    uint32_t page,
+    uint32_t *access_ptr
+) {
+    if (
+        overlaps_section(page, elf_ptr->e_datstart, elf_ptr->e_datlen) ||
+        overlaps_section(page, elf_ptr->e_bssstart, elf_ptr->e_bsslen)
+    ) {
+        *access_ptr = READ_WRITE;
+        return 0;
+    }
+    if (
+        overlaps_section(page, elf_ptr->e_txtstart, elf_ptr->e_txtlen) ||
+        overlaps_section(page, elf_ptr->e_rodatstart, elf_ptr->e_rodatlen)
+    ) {
+        *access_ptr = READ_ONLY;
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief add an area for each run of pages of an executable with the
+ *        same access, and set the R/W bit of the pages mapped in it
+ * 
+ * In the case it fails, some of the areas may still have been added.
+ * 
+ * @param page_dir the page directory being loaded
+ * @param root_ptr the tree of areas being loaded
+ * @param elf_ptr the executable
+ * @return a negative value on failure, 0 on success
+ */
+int set_up_executable_vmas(
+    pde_t *page_dir,
+    vma_t **root_ptr,
+    simple_elf_t *elf_ptr
+) {
+    unsigned long section_starts[] = {
+        elf_ptr->e_txtstart,
+        elf_ptr->e_rodatstart,
+        elf_ptr->e_datstart,
+        elf_ptr->e_bssstart
+    };
+    unsigned long section_lens[] = {
+        elf_ptr->e_txtlen,
+        elf_ptr->e_rodatlen,
+        elf_ptr->e_datlen,
+        elf_ptr->e_bsslen
+    };
+    uint32_t section_count = sizeof(section_starts) / sizeof(section_starts[0]);
+    uint64_t page = VIRTUAL_ADDR_END;
+    uint64_t end = 0;
+    for (uint32_t i = 0; i < section_count; i++) {
+        if (section_lens[i] > 0) {
+            uint64_t section_page = (section_starts[i] >> PAGE_SHIFT) <<
+                PAGE_SHIFT;
+            uint64_t section_end = (uint64_t)section_starts[i] +
+                (uint64_t)section_lens[i];
+            page = section_page < page ? section_page : page;
+            end = section_end > end ? section_end : end;
+        }
+    }
+
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, page_dir);
+    while (page < end) {
+        // find the run of pages starting at page with the same access
+        uint32_t access;
+        if (get_section_access(elf_ptr, page, &access) < 0) {
+            page += PAGE_SIZE;
+            continue;
+        }
+        uint64_t run_end = page + PAGE_SIZE;
+        uint32_t next_access;
+        while (
+            run_end < end &&
+            !(get_section_access(elf_ptr, run_end, &next_access) < 0) &&
+            next_access == access
+        ) {
+            run_end += PAGE_SIZE;
+        }
+        if (
+            insert_vma(
+                root_ptr,
+                page,
+                run_end - page,
+                access,
+                VMA_EXECUTABLE,
+                VMA_IMAGE
+            ) < 0 ||
+            protect_range(page_dir, page, run_end - page, access, &batch) < 0
+        ) {
+            tlb_batch_flush(&batch);
+            return -1;
         }
+        page = run_end;
     }
+    tlb_batch_flush(&batch);
     return 0;
 }
 
@@ -11,37 +11,49 @@
 #include <mem_allocation.h>
 #include <mutex.h>
 
+/* Run an allocation, and run it once more if it fails but the heap
+   manages to grow by size bytes. */
+#define ALLOC_OR_GROW(mem, size, allocation) \
+  { \
+    mutex_lock(&mem_allocation_lock); \
+    mem = (allocation); \
+    mutex_unlock(&mem_allocation_lock); \
+    if (mem == NULL && !(grow_kernel_heap(size) < 0)) { \
+      mutex_lock(&mem_allocation_lock); \
+      mem = (allocation); \
+      mutex_unlock(&mem_allocation_lock); \
+    } \
+  }
+
 /* safe versions of malloc functions */
 
 void *malloc(size_t size)
 {
-  mutex_lock(&mem_allocation_lock);
-  void *mem = _malloc(size);
-  mutex_unlock(&mem_allocation_lock);
+  void *mem;
+  ALLOC_OR_GROW(mem, size, _malloc(size));
   return mem;
 }
 
 void *memalign(size_t alignment, size_t size)
 {
-  mutex_lock(&mem_allocation_lock);
-  void *mem = _memalign(alignment, size);
-  mutex_unlock(&mem_allocation_lock);
+  void *mem;
+  ALLOC_OR_GROW(mem, size + alignment, _memalign(alignment, size));
   return mem;
 }
 
 void *calloc(size_t nelt, size_t eltsize)
 {
-  mutex_lock(&mem_allocation_lock);
-  void *mem = _calloc(nelt, eltsize);
-  mutex_unlock(&mem_allocation_lock);
+  if (eltsize != 0 && nelt > (size_t)-1 / eltsize)
+    return NULL;
+  void *mem;
+  ALLOC_OR_GROW(mem, nelt * eltsize, _calloc(nelt, eltsize));
   return mem;
 }
 
 void *realloc(void *buf, size_t new_size)
 {
-  mutex_lock(&mem_allocation_lock);
-  void *mem = _realloc(buf, new_size);
-  mutex_unlock(&mem_allocation_lock);
+  void *mem;
+  ALLOC_OR_GROW(mem, new_size, _realloc(buf, new_size));
   return mem;
 }
 
@@ -54,17 +66,15 @@ void free(void *buf)
 
 void *smalloc(size_t size)
 {
-  mutex_lock(&mem_allocation_lock);
-  void *mem = _smalloc(size);
-  mutex_unlock(&mem_allocation_lock);
+  void *mem;
+  ALLOC_OR_GROW(mem, size, _smalloc(size));
   return mem;
 }
 
 void *smemalign(size_t alignment, size_t size)
 {
-  mutex_lock(&mem_allocation_lock);
-  void *mem = _smemalign(alignment, size);
-  mutex_unlock(&mem_allocation_lock);
+  void *mem;
+  ALLOC_OR_GROW(mem, size + alignment, _smemalign(alignment, size));
   return mem;
 }
 
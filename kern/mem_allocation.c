@@ -3,13 +3,54 @@
  * @author Tony Xi (xiaolix)
  * @author Zekun Ma (zekunm)
  * @brief auxiliaries for implementing malloc wrappers
+ * 
+ * The heap starts out as what is left of the direct map. Once that runs
+ * out, it grows into the kernel window, a page at a time backed by a
+ * frame from the physical frame allocator, so that how many threads and
+ * processes the kernel holds scales with the memory installed. Memory
+ * the heap grows by is never given back to the frame allocator.
  */
 
 #include <mem_allocation.h> // mem_allocation_lock
 #include <mutex.h> // mutex_init
+#include <malloc_internal.h> // malloc_lmm
+#include <lmm/lmm_types.h> // lmm_region_t
+#include <vm.h> // map_kernel_window
+#include <page.h> // PAGE_SIZE
+#include <cr.h> // get_cr0
+#include <common_kern.h> // USER_MEM_START
+#include <stdint.h> // uint32_t
+#include <stddef.h> // NULL
+
+// The heap stops a page short of the end of the window, so that no block
+// of it ends at an address that wraps around.
+#define KERNEL_HEAP_LIMIT ((uint32_t)(VIRTUAL_ADDR_END - PAGE_SIZE))
 
 // the lock guarding execution of malloc family
 mutex_t mem_allocation_lock;
+// the region of malloc_lmm for the window, used only if none of the
+// regions made at boot covers it
+lmm_region_t kernel_window_region;
+// where the part of the window the heap has grown into ends
+uint32_t kernel_heap_end = KERNEL_WINDOW_START;
+// the lock guarding kernel_heap_end, so that one thread grows the heap
+// at a time
+mutex_t kernel_heap_growth_lock;
+// Pages of the direct map that serve direct_smemalign once the rest of
+// it is taken, guarded by mem_allocation_lock.
+void *direct_page_reserve[DIRECT_PAGE_RESERVE_LEN];
+uint32_t direct_page_reserve_count = 0;
+
+/**
+ * @brief Allocate memory in the direct map from malloc_lmm.
+ * 
+ * This function should be called only when mem_allocation_lock is held.
+ * 
+ * @param alignment the alignment of the memory
+ * @param size the size of the memory
+ * @return NULL on failure, the memory otherwise
+ */
+void *alloc_direct(size_t alignment, size_t size);
 
 /**
  * @brief initialize malloc wrappers
@@ -17,8 +58,144 @@ mutex_t mem_allocation_lock;
  * @return A negative value on failure, 0 otherwise.
  */
 int initialize_mem_allocation(void) {
-    if (mutex_init(&mem_allocation_lock) < 0) {
+    if (
+        mutex_init(&mem_allocation_lock) < 0 ||
+        mutex_init(&kernel_heap_growth_lock) < 0
+    ) {
+        return -1;
+    }
+
+    // The boot loader may have made a region covering the window
+    // already, and regions may not overlap.
+    lmm_region_t *region_ptr = malloc_lmm.regions;
+    while (region_ptr != NULL) {
+        if (
+            region_ptr->min < KERNEL_HEAP_LIMIT &&
+            region_ptr->max > KERNEL_WINDOW_START
+        ) {
+            break;
+        }
+        region_ptr = region_ptr->next;
+    }
+    if (region_ptr == NULL) {
+        lmm_add_region(
+            &malloc_lmm,
+            &kernel_window_region,
+            (void *)KERNEL_WINDOW_START,
+            KERNEL_HEAP_LIMIT - KERNEL_WINDOW_START,
+            0,
+            0
+        );
+    } else if (
+        region_ptr->min > KERNEL_WINDOW_START ||
+        region_ptr->max < KERNEL_HEAP_LIMIT
+    ) {
         return -1;
     }
+
+    // set aside the pages for page directories and page tables
+    while (direct_page_reserve_count < DIRECT_PAGE_RESERVE_LEN) {
+        void *page = alloc_direct(PAGE_SIZE, PAGE_SIZE);
+        if (page == NULL) {
+            return -1;
+        }
+        direct_page_reserve[direct_page_reserve_count++] = page;
+    }
     return 0;
 }
+
+/**
+ * @brief Grow the heap into the kernel window, so that an allocation
+ *        that has failed for lack of memory may succeed.
+ * 
+ * @param size how many bytes the allocation asked for, including any
+ *             alignment
+ * @return A negative value on failure, 0 otherwise.
+ */
+int grow_kernel_heap(size_t size) {
+    // The window is reachable only with paging enabled.
+    if ((get_cr0() & CR0_PG) == 0) {
+        return -1;
+    }
+
+    // leave a page for the bookkeeping of the heap
+    uint64_t needed_len = ((uint64_t)size + 2 * PAGE_SIZE - 1) /
+        PAGE_SIZE * PAGE_SIZE;
+    uint64_t len = KERNEL_HEAP_GROWTH_PAGES * PAGE_SIZE;
+    if (len < needed_len) {
+        len = needed_len;
+    }
+
+    mutex_lock(&kernel_heap_growth_lock);
+    if (len > KERNEL_HEAP_LIMIT - kernel_heap_end) {
+        len = KERNEL_HEAP_LIMIT - kernel_heap_end;
+    }
+    if (len < needed_len) {
+        mutex_unlock(&kernel_heap_growth_lock);
+        return -1;
+    }
+    if (map_kernel_window(kernel_heap_end, len / PAGE_SIZE) < 0) {
+        // fall back on just what is needed if frames are scarce
+        len = needed_len;
+        if (map_kernel_window(kernel_heap_end, len / PAGE_SIZE) < 0) {
+            mutex_unlock(&kernel_heap_growth_lock);
+            return -1;
+        }
+    }
+
+    mutex_lock(&mem_allocation_lock);
+    lmm_add_free(&malloc_lmm, (void *)kernel_heap_end, len);
+    mutex_unlock(&mem_allocation_lock);
+    kernel_heap_end += len;
+    mutex_unlock(&kernel_heap_growth_lock);
+    return 0;
+}
+
+void *direct_smemalign(size_t alignment, size_t size) {
+    mutex_lock(&mem_allocation_lock);
+    void *mem = alloc_direct(alignment, size);
+    if (
+        mem == NULL &&
+        alignment <= PAGE_SIZE &&
+        size == PAGE_SIZE &&
+        direct_page_reserve_count > 0
+    ) {
+        mem = direct_page_reserve[--direct_page_reserve_count];
+    }
+    mutex_unlock(&mem_allocation_lock);
+    return mem;
+}
+
+void direct_sfree(void *buf, size_t size) {
+    mutex_lock(&mem_allocation_lock);
+    // the reserve is refilled first
+    if (
+        size == PAGE_SIZE &&
+        direct_page_reserve_count < DIRECT_PAGE_RESERVE_LEN
+    ) {
+        direct_page_reserve[direct_page_reserve_count++] = buf;
+    } else {
+        _sfree(buf, size);
+    }
+    mutex_unlock(&mem_allocation_lock);
+}
+
+void *alloc_direct(size_t alignment, size_t size) {
+    // find the alignment shift in bits, as _smemalign does
+    int shift = 0;
+    while ((1 << shift) < alignment) {
+        shift++;
+    }
+    malloc_lmm_begin();
+    void *mem = lmm_alloc_gen(
+        &malloc_lmm,
+        size,
+        0,
+        shift,
+        0,
+        0,
+        USER_MEM_START
+    );
+    malloc_lmm_end();
+    return mem;
+}
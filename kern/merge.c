@@ -0,0 +1,416 @@
+/**
+ * @file merge.c
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief implementation of the merging of identical user pages
+ * 
+ * Guests carry the same library code, and processes often run the same
+ * programs, so many frames end up holding the same bytes. On ticks that
+ * would be spent idle, a cursor walks the pages of the processes
+ * registered for swapping, a few at a time, and hashes the ones that
+ * have not been written since the last pass.
+ * 
+ * Two tables, indexed by hash, remember what has been seen. A stable
+ * frame is one that pages have been merged into. It is shared
+ * copy-on-write and pinned, so its contents never change. A candidate
+ * is a page seen once, remembered by process and address, since its
+ * frame may be written or freed at any time. When a page matches a
+ * candidate, the candidate's frame becomes stable and the page is
+ * merged into it. Pages of zeros are simply mapped to the zero frame.
+ * 
+ * A write to a merged page faults, and copy-on-write gives the page its
+ * own frame again.
+ */
+
+#include <merge.h> // merge_pages
+#include <stdint.h> // uint32_t
+#include <stdbool.h> // bool
+#include <stddef.h> // NULL
+#include <string.h> // memcmp
+#include <page.h> // PAGE_SIZE
+#include <vm.h> // find_mergeable_frame
+#include <swap.h> // try_borrow_swappable_list
+#include <ctrl_blk.h> // pcb_t
+#include <mutex.h> // mutex_try_lock
+#include <asm.h> // disable_interrupts
+#include <eflags.h> // get_eflags
+
+// how many stable frames and candidates are remembered
+#define MERGE_TABLE_LEN (1024)
+// how many steps of the page walk a tick may take
+#define MERGE_STEP_COUNT (64)
+// how many pages a tick may hash
+#define MERGE_HASH_COUNT (4)
+#define PAGE_WORD_COUNT (PAGE_SIZE / sizeof(uint32_t))
+// FNV-1a, a word at a time
+#define HASH_OFFSET_BASIS (2166136261u)
+#define HASH_PRIME (16777619u)
+
+// a frame that pages have been merged into
+typedef struct stable_frame_t {
+    bool used;
+    uint32_t hash;
+    uint32_t p_addr;
+} stable_frame_t;
+
+// a page seen once, which may be merged with the next one like it
+typedef struct merge_candidate_t {
+    bool used;
+    uint32_t hash;
+    pcb_t *pcb_ptr;
+    uint32_t v_addr;
+} merge_candidate_t;
+
+/**
+ * @brief Hash a page.
+ * 
+ * @param page The page, as words.
+ * @param zero_ptr To hold whether the page is all zeros.
+ * @return The hash.
+ */
+uint32_t hash_page(const uint32_t *page, bool *zero_ptr);
+
+// test if a process is in the registry
+bool is_registered(pcb_ptr_node_t *list, pcb_t *pcb_ptr);
+
+/**
+ * @brief Test if the pages of a process may be merged now.
+ * 
+ * This function should be called only when the lock of the process is
+ * held.
+ * 
+ * A guest is left alone while any of its threads may run, since it may
+ * be in the middle of changing its own PTEs without the lock.
+ * 
+ * @param pcb_ptr The process.
+ * @return Whether its pages may be merged.
+ */
+bool can_merge_in(pcb_t *pcb_ptr);
+
+/**
+ * @brief Merge a page with a candidate that has the same hash, if their
+ *        contents are the same.
+ * 
+ * The page is in merge_buf. On success, the frame of the candidate
+ * becomes stable.
+ * 
+ * @param list The registry.
+ * @param candidate_ptr The candidate.
+ * @param pcb_ptr The process of the page, whose lock is held.
+ * @param v_addr The page.
+ * @param p_addr The frame of the page.
+ * @return Whether the page has been merged.
+ */
+bool merge_with_candidate(
+    pcb_ptr_node_t *list,
+    merge_candidate_t *candidate_ptr,
+    pcb_t *pcb_ptr,
+    uint32_t v_addr,
+    uint32_t p_addr
+);
+
+/**
+ * @brief Hash a page and merge it with one like it if any.
+ * 
+ * @param list The registry.
+ * @param pcb_ptr The process, whose lock is held.
+ * @param v_addr The page.
+ * @return Whether the page has been hashed, which is what costs.
+ */
+bool merge_page(pcb_ptr_node_t *list, pcb_t *pcb_ptr, uint32_t v_addr);
+
+// Let go of stable frames no page maps any longer, and count what the
+// rest save.
+void sweep_stable_frames(void);
+
+stable_frame_t stable_frames[MERGE_TABLE_LEN];
+merge_candidate_t merge_candidates[MERGE_TABLE_LEN];
+// the page being looked at, and the one it is compared with
+uint32_t merge_buf[PAGE_WORD_COUNT];
+uint32_t compare_buf[PAGE_WORD_COUNT];
+// where the walk is, as the position of the process in the registry,
+// which outlives the process itself
+uint32_t merge_cursor_idx = 0;
+uint64_t merge_cursor_addr = USER_PAGE_START;
+merge_stats_t merge_stats;
+
+uint32_t hash_page(const uint32_t *page, bool *zero_ptr) {
+    uint32_t hash = HASH_OFFSET_BASIS;
+    uint32_t bits = 0;
+    for (uint32_t i = 0; i < PAGE_WORD_COUNT; i++) {
+        hash = (hash ^ page[i]) * HASH_PRIME;
+        bits |= page[i];
+    }
+    *zero_ptr = (bits == 0);
+    return hash;
+}
+
+bool is_registered(pcb_ptr_node_t *list, pcb_t *pcb_ptr) {
+    if (list == NULL) {
+        return false;
+    }
+    pcb_ptr_node_t *node_ptr = list;
+    do {
+        if (node_ptr->data == pcb_ptr) {
+            return true;
+        }
+        node_ptr = node_ptr->next;
+    } while (node_ptr != list);
+    return false;
+}
+
+bool can_merge_in(pcb_t *pcb_ptr) {
+    if (!pcb_ptr->swappable) {
+        return false;
+    }
+    if (pcb_ptr->guest && pcb_ptr->tcb_list != NULL) {
+        tcb_node_t *node_ptr = pcb_ptr->tcb_list;
+        do {
+            if (node_ptr->data.state == READY_STATE) {
+                return false;
+            }
+            node_ptr = node_ptr->next;
+        } while (node_ptr != pcb_ptr->tcb_list);
+    }
+    return true;
+}
+
+bool merge_with_candidate(
+    pcb_ptr_node_t *list,
+    merge_candidate_t *candidate_ptr,
+    pcb_t *pcb_ptr,
+    uint32_t v_addr,
+    uint32_t p_addr
+) {
+    // The candidate is only a hint. Its process may be gone, and its
+    // page may have changed since.
+    pcb_t *other_pcb_ptr = candidate_ptr->pcb_ptr;
+    bool locked = false;
+    if (other_pcb_ptr != pcb_ptr) {
+        if (
+            !is_registered(list, other_pcb_ptr) ||
+            mutex_try_lock(&(other_pcb_ptr->lock)) < 0
+        ) {
+            return false;
+        }
+        locked = true;
+        if (!can_merge_in(other_pcb_ptr)) {
+            mutex_unlock(&(other_pcb_ptr->lock));
+            return false;
+        }
+    }
+
+    bool merged = false;
+    uint32_t other_p_addr;
+    if (
+        !(find_mergeable_frame(
+            other_pcb_ptr->page_directory,
+            candidate_ptr->v_addr,
+            &other_p_addr
+        ) < 0) &&
+        other_p_addr != p_addr
+    ) {
+        copy_from_frame(compare_buf, other_p_addr);
+        if (
+            memcmp(merge_buf, compare_buf, PAGE_SIZE) == 0 &&
+            !(pin_merged_frame(
+                other_pcb_ptr->page_directory,
+                candidate_ptr->v_addr,
+                other_p_addr
+            ) < 0)
+        ) {
+            stable_frames[candidate_ptr->hash % MERGE_TABLE_LEN] =
+                (stable_frame_t){
+                    .used = true,
+                    .hash = candidate_ptr->hash,
+                    .p_addr = other_p_addr
+                };
+            candidate_ptr->used = false;
+            if (!(merge_frame(
+                pcb_ptr->page_directory,
+                v_addr,
+                p_addr,
+                other_p_addr
+            ) < 0)) {
+                merge_stats.merged_count++;
+            }
+            merged = true;
+        }
+    }
+
+    if (locked) {
+        mutex_unlock(&(other_pcb_ptr->lock));
+    }
+    return merged;
+}
+
+bool merge_page(pcb_ptr_node_t *list, pcb_t *pcb_ptr, uint32_t v_addr) {
+    pde_t *page_dir = pcb_ptr->page_directory;
+    uint32_t p_addr;
+    if (find_mergeable_frame(page_dir, v_addr, &p_addr) < 0) {
+        return false;
+    }
+    copy_from_frame(merge_buf, p_addr);
+    bool zero;
+    uint32_t hash = hash_page(merge_buf, &zero);
+    merge_stats.scanned_count++;
+
+    if (zero) {
+        if (!(merge_zero_frame(page_dir, v_addr, p_addr) < 0)) {
+            merge_stats.merged_count++;
+            merge_stats.zero_merged_count++;
+        }
+        return true;
+    }
+
+    stable_frame_t *stable_ptr = &(stable_frames[hash % MERGE_TABLE_LEN]);
+    if (stable_ptr->used && stable_ptr->hash == hash) {
+        copy_from_frame(compare_buf, stable_ptr->p_addr);
+        if (
+            memcmp(merge_buf, compare_buf, PAGE_SIZE) == 0 &&
+            !(merge_frame(page_dir, v_addr, p_addr, stable_ptr->p_addr) < 0)
+        ) {
+            merge_stats.merged_count++;
+        }
+        return true;
+    }
+    // A stable frame no page maps gives its place up to the page.
+    if (
+        stable_ptr->used &&
+        !(unpin_merged_frame(stable_ptr->p_addr, true) < 0)
+    ) {
+        stable_ptr->used = false;
+    }
+
+    merge_candidate_t *candidate_ptr =
+        &(merge_candidates[hash % MERGE_TABLE_LEN]);
+    if (
+        !stable_ptr->used &&
+        candidate_ptr->used &&
+        candidate_ptr->hash == hash &&
+        !(candidate_ptr->pcb_ptr == pcb_ptr && candidate_ptr->v_addr == v_addr)
+    ) {
+        if (merge_with_candidate(
+            list,
+            candidate_ptr,
+            pcb_ptr,
+            v_addr,
+            p_addr
+        )) {
+            return true;
+        }
+    }
+    *candidate_ptr = (merge_candidate_t){
+        .used = true,
+        .hash = hash,
+        .pcb_ptr = pcb_ptr,
+        .v_addr = v_addr
+    };
+    return true;
+}
+
+void sweep_stable_frames(void) {
+    uint32_t stable_frame_count = 0;
+    uint32_t saved_frame_count = 0;
+    for (uint32_t i = 0; i < MERGE_TABLE_LEN; i++) {
+        if (!stable_frames[i].used) {
+            continue;
+        }
+        uint32_t ref_count;
+        if (peek_frame_ref_count(stable_frames[i].p_addr, &ref_count) < 0) {
+            // vm_lock is busy, so the numbers stay as they were
+            return;
+        }
+        if (
+            ref_count <= 1 &&
+            !(unpin_merged_frame(stable_frames[i].p_addr, true) < 0)
+        ) {
+            stable_frames[i].used = false;
+            continue;
+        }
+        // one reference is the pin, and one frame is needed anyway
+        stable_frame_count++;
+        if (ref_count > 2) {
+            saved_frame_count += ref_count - 2;
+        }
+    }
+    merge_stats.stable_frame_count = stable_frame_count;
+    merge_stats.saved_frame_count = saved_frame_count;
+}
+
+void merge_pages(void) {
+    pcb_ptr_node_t *list;
+    if (try_borrow_swappable_list(&list) < 0) {
+        return;
+    }
+    if (list == NULL) {
+        return_swappable_list();
+        return;
+    }
+
+    pcb_ptr_node_t *node_ptr = list;
+    for (uint32_t i = 0; i < merge_cursor_idx; i++) {
+        node_ptr = node_ptr->next;
+        if (node_ptr == list) {
+            // processes have gone since, so start over
+            merge_cursor_idx = 0;
+            merge_cursor_addr = USER_PAGE_START;
+            break;
+        }
+    }
+
+    pcb_t *pcb_ptr = node_ptr->data;
+    bool done = true;
+    if (!(mutex_try_lock(&(pcb_ptr->lock)) < 0)) {
+        if (can_merge_in(pcb_ptr) && merge_cursor_addr < USER_MEM_END) {
+            uint32_t step_count = 0;
+            uint32_t hash_count = 0;
+            page_iter_t iter;
+            page_iter_init(
+                &iter,
+                pcb_ptr->page_directory,
+                merge_cursor_addr,
+                USER_MEM_END - merge_cursor_addr
+            );
+            while (
+                step_count < MERGE_STEP_COUNT &&
+                hash_count < MERGE_HASH_COUNT &&
+                page_iter_next(&iter)
+            ) {
+                if (
+                    iter.mapping_info == NEW_FRAME_MAPPED &&
+                    merge_page(list, pcb_ptr, iter.page)
+                ) {
+                    hash_count++;
+                }
+                step_count++;
+                merge_cursor_addr = iter.next;
+            }
+            done = (merge_cursor_addr >= USER_MEM_END);
+        }
+        mutex_unlock(&(pcb_ptr->lock));
+    }
+
+    if (done) {
+        merge_cursor_addr = USER_PAGE_START;
+        merge_cursor_idx++;
+        if (node_ptr->next == list) {
+            merge_cursor_idx = 0;
+            sweep_stable_frames();
+        }
+    }
+    return_swappable_list();
+}
+
+void get_merge_stats(merge_stats_t *stats_ptr) {
+    if (stats_ptr == NULL) {
+        return;
+    }
+    // the statistics change in interrupt context
+    bool interrupt_enable_flag = ((get_eflags() & EFL_IF) != 0);
+    disable_interrupts();
+    *stats_ptr = merge_stats;
+    if (interrupt_enable_flag) {
+        enable_interrupts();
+    }
+}
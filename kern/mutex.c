@@ -1,8 +1,11 @@
 /**
  * @file mutex.c
  * @brief implementation of the basic mutex functions
- *        using the xchg assembly instruction and the
- *        yield system call handler
+ *        using the xchg assembly instruction and wait queues
+ * 
+ * A free mutex is taken with a single xchg. Threads that find it taken
+ * block on its wait queue, and unlocking hands the mutex straight to
+ * the one that has waited the longest, so it never sees the mutex free.
  * 
  * @author Tony Xi (xiaolix)
  * @author Zekun Ma (zekunm)
@@ -12,10 +15,13 @@
 #include <mutex.h>
 #include <xchange_stub.h>
 #include <stddef.h>
-#include <system_call.h>
+#include <stdbool.h>
 #include <assert.h>
 #include <simics.h>
 #include <ctrl_blk.h>
+#include <wait_queue.h>
+#include <asm.h>
+#include <eflags.h>
 
 #define UNLOCKED    (0)
 #define LOCKED      (1)
@@ -34,7 +40,8 @@
 int mutex_init(mutex_t *mp) {
     affirm(mp != NULL);
     mp->lock_state = UNLOCKED;
-    mp->tid = -1;
+    mp->owner_ptr = NULL;
+    init_wait_queue(&(mp->waiters));
     return 0;
 }
 
@@ -68,13 +75,37 @@ void mutex_destroy(mutex_t *mp) {
 void mutex_lock(mutex_t *mp) {
     affirm(mp != NULL);
 
-    // yield if the mutex is locked
-    while (xchange(&(mp->lock_state), LOCKED) != UNLOCKED) {
-        ureg_t ureg = {.esi = mp->tid};
-        handle_yield(&ureg);
+    tcb_t *tcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]));
+    if (xchange(&(mp->lock_state), LOCKED) == UNLOCKED) {
+        mp->owner_ptr = tcb_ptr;
+        return;
     }
 
-    mp->tid = thread_lists[RUNNING_STATE]->data->tid;
+    bool interrupt_enable_flag = ((get_eflags() & EFL_IF) != 0);
+    disable_interrupts();
+    while (xchange(&(mp->lock_state), LOCKED) != UNLOCKED) {
+        // Run the owner if it is ready, so that it releases the mutex
+        // sooner. The mutex is ours once we are woken up.
+        tcb_t *owner_ptr = mp->owner_ptr;
+        tcb_t *next_tcb_ptr = NULL;
+        if (owner_ptr != NULL && owner_ptr->state == READY_STATE) {
+            next_tcb_ptr = owner_ptr;
+        }
+        if (
+            tcb_ptr != NULL &&
+            !(wait_on_queue(&(mp->waiters), MUTEX_WAIT, next_tcb_ptr) < 0)
+        ) {
+            break;
+        }
+
+        // Nothing else can run, so wait for an interrupt to change that.
+        enable_interrupts();
+        disable_interrupts();
+    }
+    mp->owner_ptr = tcb_ptr;
+    if (interrupt_enable_flag) {
+        enable_interrupts();
+    }
 }
 
 /**
@@ -95,7 +126,7 @@ int mutex_try_lock(mutex_t *mp) {
         return -1;
     }
 
-    mp->tid = thread_lists[RUNNING_STATE]->data->tid;
+    mp->owner_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]));
     return 0;
 }
 
@@ -112,7 +143,17 @@ int mutex_try_lock(mutex_t *mp) {
 void mutex_unlock(mutex_t *mp) {
     affirm(mp != NULL);
 
-    // put UNLOCKED into the mutex
-    mp->tid = -1;
-    mp->lock_state = UNLOCKED;
+    bool interrupt_enable_flag = ((get_eflags() & EFL_IF) != 0);
+    disable_interrupts();
+    // hand the mutex to the first waiter if any, and free it otherwise
+    tcb_t *waiter_tcb_ptr = wake_one(&(mp->waiters));
+    if (waiter_tcb_ptr != NULL) {
+        mp->owner_ptr = waiter_tcb_ptr;
+    } else {
+        mp->owner_ptr = NULL;
+        mp->lock_state = UNLOCKED;
+    }
+    if (interrupt_enable_flag) {
+        enable_interrupts();
+    }
 }
@@ -0,0 +1,221 @@
+/**
+ * @file page_cache.c
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief implementation of the page cache of executables
+ * 
+ * A page that holds nothing but .text and .rodata looks the same in every
+ * process running the executable. The first exec fills in its frame as
+ * usual, then the cache takes a reference to the frame, and later execs
+ * map the frame read only instead of copying the executable again. The
+ * frames of an executable stay cached for as long as the kernel runs.
+ * They are bounded by the size of the executables built into the kernel.
+ */
+
+#include <page_cache.h> // cache_pages
+#include <stdint.h> // uint32_t
+#include <stdbool.h> // bool
+#include <stddef.h> // NULL
+#include <string.h> // strcmp
+#include <malloc.h> // calloc
+#include <exec2obj.h> // exec2obj_userapp_TOC
+#include <elf_410.h> // simple_elf_t
+#include <page.h> // PAGE_SIZE
+#include <vm.h> // map_shared_frame
+#include <mutex.h> // mutex_t
+
+// the cached frames of an executable
+typedef struct page_cache_t {
+    // the first page of .text and .rodata
+    uint32_t page_start;
+    uint32_t page_count;
+    // physical addresses of the frames indexed by page, 0 for pages that
+    // are not shareable, NULL if the executable has not been cached
+    uint32_t *frame_array;
+} page_cache_t;
+
+/**
+ * @brief Find the entry of an executable in the table of contents.
+ * 
+ * @param execname The name of the executable.
+ * @return The index of the entry, or a negative value if none.
+ */
+int find_executable(const char *execname);
+
+/**
+ * @brief Get the pages that cover .text and .rodata of an executable.
+ * 
+ * @param elf_ptr The executable.
+ * @param page_start_ptr To hold the first page.
+ * @param page_count_ptr To hold how many pages.
+ */
+void get_shareable_range(
+    simple_elf_t *elf_ptr,
+    uint32_t *page_start_ptr,
+    uint32_t *page_count_ptr
+);
+
+// one entry for each executable in the table of contents
+page_cache_t *page_caches = NULL;
+// protects page_caches
+mutex_t page_cache_lock;
+
+int init_page_cache(void) {
+    mutex_init(&page_cache_lock);
+    if (exec2obj_userapp_count > 0) {
+        page_caches = calloc(exec2obj_userapp_count, sizeof(page_cache_t));
+        if (page_caches == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int find_executable(const char *execname) {
+    if (execname == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < exec2obj_userapp_count; i++) {
+        if (strcmp(execname, exec2obj_userapp_TOC[i].execname) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool overlaps_section(uint32_t page, uint32_t start, uint32_t len) {
+    return len > 0 &&
+        (uint64_t)page < (uint64_t)start + (uint64_t)len &&
+        (uint64_t)start < (uint64_t)page + PAGE_SIZE;
+}
+
+bool is_shareable_page(simple_elf_t *elf_ptr, uint32_t v_addr) {
+    uint32_t page = (v_addr >> PAGE_SHIFT) << PAGE_SHIFT;
+    return (
+        overlaps_section(page, elf_ptr->e_txtstart, elf_ptr->e_txtlen) ||
+        overlaps_section(page, elf_ptr->e_rodatstart, elf_ptr->e_rodatlen)
+    ) && !(
+        overlaps_section(page, elf_ptr->e_datstart, elf_ptr->e_datlen) ||
+        overlaps_section(page, elf_ptr->e_bssstart, elf_ptr->e_bsslen)
+    );
+}
+
+void get_shareable_range(
+    simple_elf_t *elf_ptr,
+    uint32_t *page_start_ptr,
+    uint32_t *page_count_ptr
+) {
+    uint64_t start = elf_ptr->e_txtstart;
+    uint64_t end = (uint64_t)elf_ptr->e_txtstart + elf_ptr->e_txtlen;
+    if (elf_ptr->e_rodatlen > 0) {
+        uint64_t rodata_end =
+            (uint64_t)elf_ptr->e_rodatstart + elf_ptr->e_rodatlen;
+        if (elf_ptr->e_rodatstart < start) {
+            start = elf_ptr->e_rodatstart;
+        }
+        if (rodata_end > end) {
+            end = rodata_end;
+        }
+    }
+    start = (start >> PAGE_SHIFT) << PAGE_SHIFT;
+    *page_start_ptr = start;
+    *page_count_ptr = (end - start + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+int map_cached_pages(
+    pde_t *page_dir,
+    const char *execname,
+    simple_elf_t *elf_ptr
+) {
+    int executable_idx = find_executable(execname);
+    if (page_caches == NULL || executable_idx < 0) {
+        return -1;
+    }
+
+    mutex_lock(&page_cache_lock);
+    page_cache_t *cache_ptr = &page_caches[executable_idx];
+    if (cache_ptr->frame_array == NULL) {
+        mutex_unlock(&page_cache_lock);
+        return -1;
+    }
+    for (uint32_t i = 0; i < cache_ptr->page_count; i++) {
+        if (cache_ptr->frame_array[i] == 0) {
+            continue;
+        }
+        if (map_shared_frame(
+            page_dir,
+            cache_ptr->page_start + i * PAGE_SIZE,
+            cache_ptr->frame_array[i]
+        ) < 0) {
+            // back off, so that the caller loads every page by itself
+            tlb_batch_t batch;
+            tlb_batch_init(&batch, page_dir);
+            for (uint32_t j = 0; j < i; j++) {
+                if (cache_ptr->frame_array[j] != 0) {
+                    unmap_frame(
+                        page_dir,
+                        cache_ptr->page_start + j * PAGE_SIZE,
+                        &batch
+                    );
+                }
+            }
+            tlb_batch_flush(&batch);
+            mutex_unlock(&page_cache_lock);
+            return -1;
+        }
+    }
+    mutex_unlock(&page_cache_lock);
+    return 0;
+}
+
+void cache_pages(
+    pde_t *page_dir,
+    const char *execname,
+    simple_elf_t *elf_ptr
+) {
+    int executable_idx = find_executable(execname);
+    if (page_caches == NULL || executable_idx < 0) {
+        return;
+    }
+    uint32_t page_start;
+    uint32_t page_count;
+    get_shareable_range(elf_ptr, &page_start, &page_count);
+    if (page_count == 0) {
+        return;
+    }
+
+    mutex_lock(&page_cache_lock);
+    page_cache_t *cache_ptr = &page_caches[executable_idx];
+    // another process running the executable may have got here first
+    if (cache_ptr->frame_array != NULL) {
+        mutex_unlock(&page_cache_lock);
+        return;
+    }
+    uint32_t *frame_array = calloc(page_count, sizeof(uint32_t));
+    if (frame_array == NULL) {
+        mutex_unlock(&page_cache_lock);
+        return;
+    }
+    for (uint32_t i = 0; i < page_count; i++) {
+        uint32_t page = page_start + i * PAGE_SIZE;
+        if (
+            is_shareable_page(elf_ptr, page) &&
+            ref_mapped_frame(page_dir, page, &frame_array[i]) < 0
+        ) {
+            for (uint32_t j = 0; j < i; j++) {
+                if (frame_array[j] != 0) {
+                    unref_frame(frame_array[j]);
+                }
+            }
+            free(frame_array);
+            mutex_unlock(&page_cache_lock);
+            return;
+        }
+    }
+    *cache_ptr = (page_cache_t){
+        .page_start = page_start,
+        .page_count = page_count,
+        .frame_array = frame_array
+    };
+    mutex_unlock(&page_cache_lock);
+}
@@ -0,0 +1,139 @@
+/**
+ * @file paging_pool.c
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief a pool of zeroed pages for page directories and page tables
+ * 
+ * Every fork, exec and exit builds or tears down page directories and
+ * page tables. Pages given back stay in the pool, cleared and linked
+ * through their first words, so that the next address space takes them
+ * without an aligned search of the heap. An empty pool is refilled with
+ * PAGING_POOL_REFILL_LEN pages by a single search, and only up to
+ * PAGING_POOL_MAX pages are kept.
+ * 
+ * The pages come from the direct mapped heap rather than the frame
+ * allocator. The kernel walks paging structures through their physical
+ * addresses, and frames above USER_PAGE_START are not mapped for it.
+ */
+
+#include <paging_pool.h> // alloc_paging_page
+#include <mem_allocation.h> // direct_smemalign
+#include <mutex.h> // mutex_lock
+#include <page.h> // PAGE_SIZE
+#include <string.h> // memset
+#include <stdbool.h> // bool
+#include <stddef.h> // NULL
+#include <stdint.h> // uint32_t
+
+// free pages, each holding the next one in its first word and zeros
+// in the rest
+uint32_t *free_paging_pages = NULL;
+uint32_t free_paging_page_count = 0;
+// how many pages were taken from the pool, and how many times it was
+// found empty
+uint32_t paging_pool_hit_count = 0;
+uint32_t paging_pool_miss_count = 0;
+// the lock of the fields above
+mutex_t paging_pool_lock;
+
+/**
+ * @brief Take pages from the heap for an empty pool.
+ * 
+ * Pages beyond the first are put into the pool. This function is called
+ * without paging_pool_lock held.
+ * 
+ * @return NULL on failure, a zeroed page otherwise.
+ */
+void *refill_paging_pool(void);
+
+int init_paging_pool(void) {
+    return mutex_init(&paging_pool_lock);
+}
+
+void *refill_paging_pool(void) {
+    uint32_t len = PAGING_POOL_REFILL_LEN;
+    char *pages = direct_smemalign(PAGE_SIZE, len * PAGE_SIZE);
+    if (pages == NULL) {
+        // the direct map may be too fragmented for a whole batch
+        len = 1;
+        pages = direct_smemalign(PAGE_SIZE, PAGE_SIZE);
+        if (pages == NULL) {
+            return NULL;
+        }
+    }
+    memset(pages, 0, len * PAGE_SIZE);
+
+    mutex_lock(&paging_pool_lock);
+    uint32_t i;
+    for (i = 1; i < len && free_paging_page_count < PAGING_POOL_MAX; i++) {
+        uint32_t *page = (uint32_t *)(pages + i * PAGE_SIZE);
+        page[0] = (uint32_t)free_paging_pages;
+        free_paging_pages = page;
+        free_paging_page_count++;
+    }
+    mutex_unlock(&paging_pool_lock);
+
+    // give back whatever the pool has no room for
+    if (i < len) {
+        direct_sfree(pages + i * PAGE_SIZE, (len - i) * PAGE_SIZE);
+    }
+    return pages;
+}
+
+void *alloc_paging_page(void) {
+    mutex_lock(&paging_pool_lock);
+    uint32_t *page = free_paging_pages;
+    if (page != NULL) {
+        free_paging_pages = (uint32_t *)page[0];
+        free_paging_page_count--;
+        paging_pool_hit_count++;
+    } else {
+        paging_pool_miss_count++;
+    }
+    mutex_unlock(&paging_pool_lock);
+
+    if (page == NULL) {
+        return refill_paging_pool();
+    }
+    page[0] = 0;
+    return page;
+}
+
+void free_paging_page(void *page) {
+    if (page == NULL) {
+        return;
+    }
+
+    // clear the page outside the lock, unless the pool is already full
+    mutex_lock(&paging_pool_lock);
+    bool is_full = free_paging_page_count >= PAGING_POOL_MAX;
+    mutex_unlock(&paging_pool_lock);
+    if (!is_full) {
+        memset(page, 0, PAGE_SIZE);
+        mutex_lock(&paging_pool_lock);
+        // the pool may have filled up meanwhile
+        if (free_paging_page_count < PAGING_POOL_MAX) {
+            uint32_t *link = page;
+            link[0] = (uint32_t)free_paging_pages;
+            free_paging_pages = link;
+            free_paging_page_count++;
+            page = NULL;
+        }
+        mutex_unlock(&paging_pool_lock);
+    }
+
+    if (page != NULL) {
+        direct_sfree(page, PAGE_SIZE);
+    }
+}
+
+void get_paging_pool_stats(uint32_t *hit_count_ptr, uint32_t *miss_count_ptr) {
+    mutex_lock(&paging_pool_lock);
+    if (hit_count_ptr != NULL) {
+        *hit_count_ptr = paging_pool_hit_count;
+    }
+    if (miss_count_ptr != NULL) {
+        *miss_count_ptr = paging_pool_miss_count;
+    }
+    mutex_unlock(&paging_pool_lock);
+}
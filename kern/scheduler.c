@@ -23,22 +23,21 @@
  *                the TCB of a runnable thread otherwise.
  */
 tcb_t *round_robin(void) {
-    if (thread_lists[READY_STATE] == NULL) {
+    tcb_queue_t *ready_list_ptr = &(thread_lists[READY_STATE]);
+    tcb_t *tcb_ptr = Q_GET_FRONT(ready_list_ptr);
+    if (tcb_ptr == NULL) {
         return NULL;
-    } else {
-        tcb_t *tcb_ptr = thread_lists[READY_STATE]->data;
+    }
 
-        tcb_ptr_node_t *node_ptr = thread_lists[READY_STATE]->next;
-        while (node_ptr != thread_lists[READY_STATE]) {
-            if (node_ptr->data->pcb_ptr != thread_lists[READY_STATE]->data->pcb_ptr) {
-                thread_lists[READY_STATE] = node_ptr;
-                break;
-            }
-            node_ptr = node_ptr->next;
-        }
+    // The ready threads of a process sit next to each other, so moving
+    // those of the front process to the tail rotates the list.
+    Q_ROTATE_THROUGH(
+        ready_list_ptr,
+        tcb_ptr->pcb_ptr->ready_tail_ptr,
+        state_link
+    );
 
-        return tcb_ptr;
-    }
+    return tcb_ptr;
 }
 
 /**
@@ -46,22 +45,18 @@ tcb_t *round_robin(void) {
  *        running now. If such a thread does not exist, return the result
  *        of round robin.
  * 
- * This function should be called only when PCB lock is held and
- * interrupts are disabled. 
+ * The thread that has been ready the longest is picked, so the threads
+ * of a process take turns.
+ * 
+ * This function should be called only when interrupts are disabled.
  * 
  * @return tcb_t* NULL if there is no runnable thread. The pointer to
  *                the TCB of a runnable thread otherwise.
  */
 tcb_t *find_next_thread(void) {
-    pcb_t *current_process = thread_lists[RUNNING_STATE]->data->pcb_ptr;
-    if (current_process->tcb_list != NULL) {
-        tcb_node_t *node_ptr = current_process->tcb_list;
-        do {
-            if (node_ptr->data.state == READY_STATE) {
-                return &(node_ptr->data);
-            }
-            node_ptr = node_ptr->next;
-        } while (node_ptr != current_process->tcb_list);
+    pcb_t *current_process = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
+    if (current_process->ready_front_ptr != NULL) {
+        return current_process->ready_front_ptr;
     }
     return round_robin();
 }
@@ -0,0 +1,242 @@
+/**
+ * @file slab.c
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief implementation of caches of kernel objects
+ * 
+ * A slab is a run of whole pages from the heap. It starts with a header,
+ * followed by its objects. Every object is preceded by a pointer to its
+ * slab, so that giving an object back finds its slab right away,
+ * whatever the size of the objects.
+ */
+
+#include <slab.h> // slab_alloc
+#include <stdint.h> // uint32_t
+#include <stddef.h> // NULL
+#include <malloc.h> // smemalign
+#include <page.h> // PAGE_SIZE
+#include <mutex.h> // mutex_lock
+#include <string.h> // strncpy
+
+// how objects are aligned within a slab
+#define SLAB_ALIGN (sizeof(uint64_t))
+// A slab of objects larger than a page holds at least this many of
+// them, so that the heap is not searched on every other allocation.
+#define SLAB_OBJECT_COUNT_MIN (4)
+#define ROUND_UP(x, unit) (((x) + (unit) - 1) / (unit) * (unit))
+
+// the header of a slab
+typedef struct slab_t {
+    struct slab_t *previous;
+    struct slab_t *next;
+    // the first free object, which links to the next one
+    void *free_list;
+    uint32_t in_use_count;
+} slab_t;
+
+// room before the first object, which keeps objects aligned
+#define SLAB_HEADER_LEN (ROUND_UP(sizeof(slab_t), SLAB_ALIGN))
+// room before each object for the pointer to its slab
+#define OBJECT_HEADER_LEN (ROUND_UP(sizeof(slab_t *), SLAB_ALIGN))
+
+/**
+ * @brief Get a slab from the heap and carve it into objects.
+ * 
+ * This function should be called only when the lock of the cache is
+ * held.
+ * 
+ * @param cache_ptr The cache.
+ * @return The slab, or NULL if the heap is exhausted.
+ */
+slab_t *grow_cache(slab_cache_t *cache_ptr);
+
+// link a slab into a list of slabs
+void link_slab(slab_t **list_ptr, slab_t *slab_ptr);
+
+// unlink a slab from a list of slabs
+void unlink_slab(slab_t **list_ptr, slab_t *slab_ptr);
+
+// the caches that have been initialized
+slab_cache_t *slab_caches = NULL;
+
+int slab_cache_init(
+    slab_cache_t *cache_ptr,
+    const char *name,
+    uint32_t object_size,
+    void (*construct)(void *object),
+    void (*reset)(void *object)
+) {
+    if (cache_ptr == NULL || object_size == 0) {
+        return -1;
+    }
+    uint32_t stride = OBJECT_HEADER_LEN + ROUND_UP(object_size, SLAB_ALIGN);
+    uint32_t slab_len = PAGE_SIZE;
+    if (SLAB_HEADER_LEN + stride > PAGE_SIZE) {
+        slab_len = ROUND_UP(
+            SLAB_HEADER_LEN + SLAB_OBJECT_COUNT_MIN * stride,
+            PAGE_SIZE
+        );
+    }
+    *cache_ptr = (slab_cache_t){
+        .name = name,
+        .object_size = object_size,
+        .stride = stride,
+        .objects_per_slab = (slab_len - SLAB_HEADER_LEN) / stride,
+        .slab_len = slab_len,
+        .construct = construct,
+        .reset = reset,
+        .next = slab_caches
+    };
+    if (mutex_init(&(cache_ptr->lock)) < 0) {
+        return -1;
+    }
+    slab_caches = cache_ptr;
+    return 0;
+}
+
+void link_slab(slab_t **list_ptr, slab_t *slab_ptr) {
+    slab_ptr->previous = NULL;
+    slab_ptr->next = *list_ptr;
+    if (*list_ptr != NULL) {
+        (*list_ptr)->previous = slab_ptr;
+    }
+    *list_ptr = slab_ptr;
+}
+
+void unlink_slab(slab_t **list_ptr, slab_t *slab_ptr) {
+    if (slab_ptr->previous != NULL) {
+        slab_ptr->previous->next = slab_ptr->next;
+    } else {
+        *list_ptr = slab_ptr->next;
+    }
+    if (slab_ptr->next != NULL) {
+        slab_ptr->next->previous = slab_ptr->previous;
+    }
+}
+
+slab_t *grow_cache(slab_cache_t *cache_ptr) {
+    slab_t *slab_ptr = smemalign(PAGE_SIZE, cache_ptr->slab_len);
+    if (slab_ptr == NULL) {
+        return NULL;
+    }
+    slab_ptr->free_list = NULL;
+    slab_ptr->in_use_count = 0;
+    // Link the objects so that they are handed out in address order.
+    for (uint32_t i = cache_ptr->objects_per_slab; i > 0; i--) {
+        uint8_t *slot = (uint8_t *)slab_ptr + SLAB_HEADER_LEN +
+            (i - 1) * cache_ptr->stride;
+        *(slab_t **)slot = slab_ptr;
+        void *object = slot + OBJECT_HEADER_LEN;
+        if (cache_ptr->construct != NULL) {
+            cache_ptr->construct(object);
+        }
+        // The link lives in the first word of the object, which the
+        // constructor has to leave to the cache while the object is free.
+        *(void **)object = slab_ptr->free_list;
+        slab_ptr->free_list = object;
+    }
+    cache_ptr->stats.slab_count++;
+    cache_ptr->stats.grow_count++;
+    return slab_ptr;
+}
+
+void *slab_alloc(slab_cache_t *cache_ptr) {
+    if (cache_ptr == NULL) {
+        return NULL;
+    }
+    mutex_lock(&(cache_ptr->lock));
+    slab_t *slab_ptr = cache_ptr->partial_slabs;
+    if (slab_ptr == NULL) {
+        if (cache_ptr->empty_slab != NULL) {
+            slab_ptr = cache_ptr->empty_slab;
+            cache_ptr->empty_slab = NULL;
+        } else {
+            slab_ptr = grow_cache(cache_ptr);
+            if (slab_ptr == NULL) {
+                mutex_unlock(&(cache_ptr->lock));
+                return NULL;
+            }
+        }
+        link_slab(&(cache_ptr->partial_slabs), slab_ptr);
+    }
+
+    void *object = slab_ptr->free_list;
+    slab_ptr->free_list = *(void **)object;
+    slab_ptr->in_use_count++;
+    if (slab_ptr->free_list == NULL) {
+        unlink_slab(&(cache_ptr->partial_slabs), slab_ptr);
+        link_slab(&(cache_ptr->full_slabs), slab_ptr);
+    }
+    cache_ptr->stats.alloc_count++;
+    cache_ptr->stats.in_use_count++;
+    mutex_unlock(&(cache_ptr->lock));
+    return object;
+}
+
+void slab_free(slab_cache_t *cache_ptr, void *object) {
+    if (cache_ptr == NULL || object == NULL) {
+        return;
+    }
+    if (cache_ptr->reset != NULL) {
+        cache_ptr->reset(object);
+    }
+    slab_t *slab_ptr = *(slab_t **)((uint8_t *)object - OBJECT_HEADER_LEN);
+    slab_t *extra_slab_ptr = NULL;
+
+    mutex_lock(&(cache_ptr->lock));
+    if (slab_ptr->free_list == NULL) {
+        unlink_slab(&(cache_ptr->full_slabs), slab_ptr);
+        link_slab(&(cache_ptr->partial_slabs), slab_ptr);
+    }
+    *(void **)object = slab_ptr->free_list;
+    slab_ptr->free_list = object;
+    slab_ptr->in_use_count--;
+    if (slab_ptr->in_use_count == 0) {
+        // keep one empty slab, and give the one before back
+        unlink_slab(&(cache_ptr->partial_slabs), slab_ptr);
+        extra_slab_ptr = cache_ptr->empty_slab;
+        cache_ptr->empty_slab = slab_ptr;
+        if (extra_slab_ptr != NULL) {
+            cache_ptr->stats.slab_count--;
+        }
+    }
+    cache_ptr->stats.free_count++;
+    cache_ptr->stats.in_use_count--;
+    mutex_unlock(&(cache_ptr->lock));
+
+    if (extra_slab_ptr != NULL) {
+        sfree(extra_slab_ptr, cache_ptr->slab_len);
+    }
+}
+
+void get_slab_stats(slab_cache_t *cache_ptr, slab_stats_t *stats_ptr) {
+    if (cache_ptr == NULL || stats_ptr == NULL) {
+        return;
+    }
+    mutex_lock(&(cache_ptr->lock));
+    *stats_ptr = cache_ptr->stats;
+    mutex_unlock(&(cache_ptr->lock));
+}
+
+uint32_t get_all_slab_stats(kernel_cache_stats_t *stats_ptr, uint32_t len) {
+    uint32_t count = 0;
+    for (
+        slab_cache_t *cache_ptr = slab_caches;
+        cache_ptr != NULL && count < len;
+        cache_ptr = cache_ptr->next
+    ) {
+        slab_stats_t stats;
+        get_slab_stats(cache_ptr, &stats);
+        kernel_cache_stats_t *entry_ptr = &(stats_ptr[count]);
+        strncpy(entry_ptr->name, cache_ptr->name, KERNEL_STATS_NAME_LEN - 1);
+        entry_ptr->name[KERNEL_STATS_NAME_LEN - 1] = '\0';
+        entry_ptr->object_size = cache_ptr->object_size;
+        entry_ptr->in_use_count = stats.in_use_count;
+        entry_ptr->alloc_count = stats.alloc_count;
+        entry_ptr->free_count = stats.free_count;
+        entry_ptr->slab_count = stats.slab_count;
+        entry_ptr->grow_count = stats.grow_count;
+        count++;
+    }
+    return count;
+}
@@ -0,0 +1,434 @@
+/**
+ * @file swap.c
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief implementation of the compressed store of cold user pages
+ * 
+ * When frames run out, the allocator asks for some back. Pages of
+ * anonymous areas that have not been accessed for a while are then
+ * compressed into kernel memory, and their PTEs point to the slot they
+ * are in. A page fault on such a page brings it back.
+ * 
+ * A page is compressed as a sequence of runs of 32-bit words. Each run
+ * starts with a 16-bit header. If RUN_REPEATED is set in the header, the
+ * rest of it counts how many times the single word after it repeats.
+ * Otherwise it counts how many words follow as they are. Pages of user
+ * memory are mostly zeros, or counters and pointers in a sea of zeros,
+ * which this takes care of cheaply.
+ */
+
+#include <swap.h> // reclaim_frames
+#include <stdint.h> // uint32_t
+#include <stdbool.h> // bool
+#include <stddef.h> // NULL
+#include <string.h> // memcpy
+#include <malloc.h> // malloc
+#include <page.h> // PAGE_SIZE
+#include <vm.h> // find_cold_frame
+#include <vma.h> // find_vma_after
+#include <ctrl_blk.h> // pcb_t
+#include <mutex.h> // mutex_t
+
+// how many pages the store can hold
+#define SWAP_SLOT_COUNT (32768)
+// how much kernel memory the store may take
+#define SWAP_STORE_SIZE_MAX (4 * 1024 * 1024)
+// Pages that do not compress to this size stay where they are.
+#define COMPRESSED_SIZE_MAX (PAGE_SIZE / 2)
+// how many pages reclaim_frames looks at in one call at most
+#define SCAN_PAGE_COUNT_MAX (8192)
+// how many frames reclaim_frames frees at least, if it can, so that
+// the next allocations find some ready
+#define RECLAIM_BATCH_LEN (16)
+#define PAGE_WORD_COUNT (PAGE_SIZE / sizeof(uint32_t))
+// the header of a run of a single repeated word
+#define RUN_REPEATED (0x8000)
+// the longest run a header can describe
+#define RUN_LEN_MAX (RUN_REPEATED - 1)
+
+// a page in the store
+typedef struct swap_slot_t {
+    // the compressed page, NULL if the slot is free
+    uint8_t *data;
+    uint16_t size;
+    // how many page directories point to the slot
+    uint16_t ref_count;
+} swap_slot_t;
+
+/**
+ * @brief Compress a page.
+ * 
+ * @param src The page, as words.
+ * @param dst Where the compressed page goes, COMPRESSED_SIZE_MAX bytes.
+ * @return The compressed size, or a negative value if the page does not
+ *         fit in COMPRESSED_SIZE_MAX bytes.
+ */
+int compress_page(const uint32_t *src, uint8_t *dst);
+
+/**
+ * @brief Decompress a page made by compress_page.
+ * 
+ * @param src The compressed page.
+ * @param size The compressed size.
+ * @param dst Where the page goes, as words.
+ */
+void decompress_page(const uint8_t *src, uint32_t size, uint32_t *dst);
+
+/**
+ * @brief Move a cold page to the store.
+ * 
+ * This function should be called only when swap_lock is held.
+ * 
+ * @param page_dir The page directory.
+ * @param v_addr The virtual address within the range of the page.
+ * @return A negative value if the page stays where it is, 0 otherwise.
+ */
+int swap_out_page(pde_t *page_dir, uint32_t v_addr);
+
+/**
+ * @brief Move cold pages of a process to the store, starting at an
+ *        address and going up.
+ * 
+ * This function should be called only when swap_lock and the lock of
+ * the process are held.
+ * 
+ * @param pcb_ptr The process.
+ * @param addr_ptr Where to start. It is set to where to go on next time,
+ *                 or USER_MEM_END if the process is done.
+ * @param count How many frames are wanted.
+ * @param budget_ptr How many more pages may be looked at. It is
+ *                   decreased by the pages looked at.
+ * @return How many frames have been freed.
+ */
+uint32_t reclaim_from(
+    pcb_t *pcb_ptr,
+    uint64_t *addr_ptr,
+    uint32_t count,
+    uint32_t *budget_ptr
+);
+
+// the slots, indexed by what the PTEs of swapped out pages hold
+swap_slot_t swap_slots[SWAP_SLOT_COUNT];
+// where to start looking for a free slot
+uint32_t free_slot_hint = 0;
+// how much kernel memory the compressed pages take
+uint32_t swap_store_size = 0;
+// where pages are copied to be compressed
+uint32_t page_buf[PAGE_WORD_COUNT];
+uint8_t compressed_buf[COMPRESSED_SIZE_MAX];
+// the processes whose pages may be swapped out
+pcb_ptr_node_t *swappable_list = NULL;
+// where reclaim_frames left off, NULL to start over
+pcb_ptr_node_t *swap_hand = NULL;
+uint64_t swap_hand_addr = 0;
+// protects everything above
+mutex_t swap_lock;
+
+int init_swap(void) {
+    return mutex_init(&swap_lock);
+}
+
+int compress_page(const uint32_t *src, uint8_t *dst) {
+    uint32_t size = 0;
+    uint32_t i = 0;
+    while (i < PAGE_WORD_COUNT) {
+        uint32_t run_len = 1;
+        while (
+            i + run_len < PAGE_WORD_COUNT &&
+            run_len < RUN_LEN_MAX &&
+            src[i + run_len] == src[i]
+        ) {
+            run_len++;
+        }
+        uint16_t header;
+        uint32_t word_count;
+        if (run_len > 1) {
+            header = RUN_REPEATED | run_len;
+            word_count = 1;
+        } else {
+            // take words as they are until two in a row are the same
+            run_len = 1;
+            while (
+                i + run_len < PAGE_WORD_COUNT &&
+                run_len < RUN_LEN_MAX &&
+                !(
+                    i + run_len + 1 < PAGE_WORD_COUNT &&
+                    src[i + run_len] == src[i + run_len + 1]
+                )
+            ) {
+                run_len++;
+            }
+            header = run_len;
+            word_count = run_len;
+        }
+        uint32_t run_size = sizeof(uint16_t) + word_count * sizeof(uint32_t);
+        if (run_size > COMPRESSED_SIZE_MAX - size) {
+            return -1;
+        }
+        memcpy(dst + size, &header, sizeof(uint16_t));
+        memcpy(
+            dst + size + sizeof(uint16_t),
+            src + i,
+            word_count * sizeof(uint32_t)
+        );
+        size += run_size;
+        i += run_len;
+    }
+    return size;
+}
+
+void decompress_page(const uint8_t *src, uint32_t size, uint32_t *dst) {
+    uint32_t offset = 0;
+    uint32_t i = 0;
+    while (offset < size && i < PAGE_WORD_COUNT) {
+        uint16_t header;
+        memcpy(&header, src + offset, sizeof(uint16_t));
+        offset += sizeof(uint16_t);
+        if (header & RUN_REPEATED) {
+            uint32_t word;
+            memcpy(&word, src + offset, sizeof(uint32_t));
+            offset += sizeof(uint32_t);
+            for (uint32_t j = 0; j < (header & RUN_LEN_MAX); j++) {
+                dst[i++] = word;
+            }
+        } else {
+            memcpy(dst + i, src + offset, header * sizeof(uint32_t));
+            offset += header * sizeof(uint32_t);
+            i += header;
+        }
+    }
+}
+
+int register_swappable(pcb_t *pcb_ptr) {
+    bool success;
+    mutex_lock(&swap_lock);
+    PUSH_BACK(pcb_ptr_node_t, swappable_list, pcb_ptr, success);
+    mutex_unlock(&swap_lock);
+    return success ? 0 : -1;
+}
+
+void unregister_swappable(pcb_t *pcb_ptr) {
+    mutex_lock(&swap_lock);
+    pcb_ptr_node_t *node_ptr = swappable_list;
+    if (node_ptr == NULL) {
+        mutex_unlock(&swap_lock);
+        return;
+    }
+    while (node_ptr->data != pcb_ptr) {
+        node_ptr = node_ptr->next;
+        if (node_ptr == swappable_list) {
+            mutex_unlock(&swap_lock);
+            return;
+        }
+    }
+    if (swap_hand == node_ptr) {
+        swap_hand = NULL;
+    }
+    if (node_ptr == swappable_list) {
+        swappable_list = node_ptr == node_ptr->next ? NULL : node_ptr->next;
+    }
+    node_ptr->next->previous = node_ptr->previous;
+    node_ptr->previous->next = node_ptr->next;
+    free(node_ptr);
+    mutex_unlock(&swap_lock);
+}
+
+int try_borrow_swappable_list(pcb_ptr_node_t **list_ptr) {
+    if (list_ptr == NULL || mutex_try_lock(&swap_lock) < 0) {
+        return -1;
+    }
+    *list_ptr = swappable_list;
+    return 0;
+}
+
+void return_swappable_list(void) {
+    mutex_unlock(&swap_lock);
+}
+
+int swap_out_page(pde_t *page_dir, uint32_t v_addr) {
+    uint32_t p_addr;
+    if (find_cold_frame(page_dir, v_addr, &p_addr) < 0) {
+        return -1;
+    }
+
+    uint32_t slot = free_slot_hint;
+    while (swap_slots[slot].data != NULL) {
+        slot = (slot + 1) % SWAP_SLOT_COUNT;
+        if (slot == free_slot_hint) {
+            return -1;
+        }
+    }
+
+    copy_from_frame(page_buf, p_addr);
+    int size = compress_page(page_buf, compressed_buf);
+    if (size < 0 || size > SWAP_STORE_SIZE_MAX - swap_store_size) {
+        return -1;
+    }
+    uint8_t *data = malloc(size);
+    if (data == NULL) {
+        return -1;
+    }
+    memcpy(data, compressed_buf, size);
+
+    // The copy is good only if the page has not been written since
+    // find_cold_frame.
+    if (swap_out_frame(page_dir, v_addr, p_addr, slot) < 0) {
+        free(data);
+        return -1;
+    }
+
+    swap_slots[slot] = (swap_slot_t){
+        .data = data,
+        .size = size,
+        .ref_count = 1
+    };
+    free_slot_hint = (slot + 1) % SWAP_SLOT_COUNT;
+    swap_store_size += size;
+    return 0;
+}
+
+uint32_t reclaim_from(
+    pcb_t *pcb_ptr,
+    uint64_t *addr_ptr,
+    uint32_t count,
+    uint32_t *budget_ptr
+) {
+    uint32_t reclaimed_count = 0;
+    vma_t *vma_ptr = find_vma_after(pcb_ptr->vma_tree, *addr_ptr);
+    while (vma_ptr != NULL) {
+        if (vma_ptr->backing == VMA_ANONYMOUS) {
+            uint64_t start = *addr_ptr > vma_ptr->start ?
+                *addr_ptr : vma_ptr->start;
+            page_iter_t iter;
+            page_iter_init(
+                &iter,
+                pcb_ptr->page_directory,
+                start,
+                vma_ptr->end - start
+            );
+            while (page_iter_next(&iter)) {
+                if (
+                    iter.mapping_info == NEW_FRAME_MAPPED &&
+                    !(swap_out_page(pcb_ptr->page_directory, iter.page) < 0)
+                ) {
+                    reclaimed_count++;
+                }
+                (*budget_ptr)--;
+                if (reclaimed_count == count || *budget_ptr == 0) {
+                    *addr_ptr = iter.next;
+                    return reclaimed_count;
+                }
+            }
+        }
+        *addr_ptr = vma_ptr->end;
+        vma_ptr = find_vma_after(pcb_ptr->vma_tree, *addr_ptr);
+    }
+    *addr_ptr = USER_MEM_END;
+    return reclaimed_count;
+}
+
+uint32_t reclaim_frames(uint32_t count) {
+    if (count < RECLAIM_BATCH_LEN) {
+        count = RECLAIM_BATCH_LEN;
+    }
+    uint32_t reclaimed_count = 0;
+    uint32_t budget = SCAN_PAGE_COUNT_MAX;
+
+    mutex_lock(&swap_lock);
+    while (reclaimed_count < count && budget > 0 && swappable_list != NULL) {
+        if (swap_hand == NULL) {
+            swap_hand = swappable_list;
+            swap_hand_addr = USER_PAGE_START;
+        }
+        pcb_t *pcb_ptr = swap_hand->data;
+        uint32_t old_budget = budget;
+        // Processes that are busy with their own pages are skipped, which
+        // includes the one asking for frames while it holds its lock.
+        if (!(mutex_try_lock(&(pcb_ptr->lock)) < 0)) {
+            if (pcb_ptr->swappable && !pcb_ptr->guest) {
+                reclaimed_count += reclaim_from(
+                    pcb_ptr,
+                    &swap_hand_addr,
+                    count - reclaimed_count,
+                    &budget
+                );
+            } else {
+                swap_hand_addr = USER_MEM_END;
+            }
+            mutex_unlock(&(pcb_ptr->lock));
+        } else {
+            swap_hand_addr = USER_MEM_END;
+        }
+        // a skipped process still costs something, or the loop would
+        // go around forever when every process is busy
+        if (budget == old_budget) {
+            budget--;
+        }
+        if (swap_hand_addr >= USER_MEM_END) {
+            swap_hand = swap_hand->next;
+            swap_hand_addr = USER_PAGE_START;
+        }
+    }
+    mutex_unlock(&swap_lock);
+    return reclaimed_count;
+}
+
+int swap_in_page(pde_t *page_dir, uint32_t v_addr, uint32_t access) {
+    uint32_t slot;
+    if (get_swap_slot(page_dir, v_addr, &slot) < 0) {
+        return -1;
+    }
+    // The page is decompressed into a buffer of its own, since the frame
+    // it goes to is allocated without swap_lock, in case other pages have
+    // to move to the store first.
+    uint32_t *buf = malloc(PAGE_SIZE);
+    if (buf == NULL) {
+        return -1;
+    }
+    mutex_lock(&swap_lock);
+    decompress_page(swap_slots[slot].data, swap_slots[slot].size, buf);
+    mutex_unlock(&swap_lock);
+
+    int result = swap_in_frame(page_dir, v_addr, buf, access);
+    free(buf);
+    if (result < 0) {
+        return -1;
+    }
+    free_swap_slot(slot);
+    return 0;
+}
+
+int share_swap_slot(pde_t *src_page_dir, pde_t *dst_page_dir, uint32_t v_addr) {
+    uint32_t slot;
+    if (get_swap_slot(src_page_dir, v_addr, &slot) < 0) {
+        return -1;
+    }
+    mutex_lock(&swap_lock);
+    if (swap_slots[slot].ref_count == UINT16_MAX) {
+        mutex_unlock(&swap_lock);
+        return -1;
+    }
+    if (map_swap_slot(dst_page_dir, v_addr, slot) < 0) {
+        mutex_unlock(&swap_lock);
+        return -1;
+    }
+    swap_slots[slot].ref_count++;
+    mutex_unlock(&swap_lock);
+    return 0;
+}
+
+void free_swap_slot(uint32_t slot) {
+    if (slot >= SWAP_SLOT_COUNT) {
+        return;
+    }
+    mutex_lock(&swap_lock);
+    if (swap_slots[slot].data != NULL) {
+        swap_slots[slot].ref_count--;
+        if (swap_slots[slot].ref_count == 0) {
+            free(swap_slots[slot].data);
+            swap_store_size -= swap_slots[slot].size;
+            swap_slots[slot].data = NULL;
+        }
+    }
+    mutex_unlock(&swap_lock);
+}
@@ -24,13 +24,27 @@
 #include <scheduler.h> // find_next_thread
 #include <context_switcher.h> // switch_context
 #include <page.h> // PAGE_SHIFT
-#include <vm.h> // set_availability
+#include <vm.h> // map_range
+#include <vma.h> // insert_vma
 #include <cr.h> // get_cr3
 #include <string.h> // memset
 #include <seg.h> // SEGSEL_KERNEL_CS
 #include <execution_state.h> // load_ureg
 #include <eflags.h> // EFL_IOPL_SHIFT
 #include <timer.h> // tick_count
+#include <user_copy.h> // copy_from_user
+#include <exec2obj.h> // MAX_EXECNAME_LEN
+#include <malloc.h> // malloc
+#include <swap.h> // unregister_swappable
+#include <merge.h> // get_merge_stats
+#include <slab.h> // get_all_slab_stats
+#include <paging_pool.h> // get_paging_pool_stats
+#include <kernel_stack.h> // free_kernel_stack
+#include <timer_wheel.h> // arm_kernel_timer
+#include <wait_queue.h> // wait_on_queue
+#include <cond.h> // cond_wait
+#include <futex.h> // wait_on_futex
+#include <kernel_stats.h> // kernel_stats_t
 
 // Minimum size of user provided exception stack.
 // 7 stands for esp, ureg_ptr, arg, eax, ecx, edx, eip that should be
@@ -42,6 +56,11 @@
 // width of IOPL bits in eflags register
 #define IOPL_WIDTH (2)
 
+// longest argument string exec takes, including the NUL
+#define EXEC_ARG_LEN_MAX (PAGE_SIZE)
+// number of bytes print and readfile move through the kernel at a time
+#define COPY_CHUNK_SIZE (256)
+
 /**
  * @brief This buffer holds characters that are generated by parsing
  *        augmented characters. getchar and readline may communicate
@@ -59,6 +78,18 @@ mutex_t input_lock;
  * @brief control exclusive access to interaction with console
  */
 mutex_t output_lock;
+/**
+ * @brief threads blocked by deschedule, waiting for make_runnable
+ */
+wait_queue_t deschedule_queue;
+
+/**
+ * @brief Make a sleeping thread runnable once its timer fires.
+ * 
+ * @param timer_ptr the timer armed by handle_sleep
+ * @param arg pointer to the TCB of the sleeping thread
+ */
+void wake_sleeper(kernel_timer_t *timer_ptr, void *arg);
 
 /**
  * @brief Test if a range of memory referenced by user is writable.
@@ -76,47 +107,51 @@ bool is_writable(uint32_t addr, uint32_t size);
  * @return whether the memory is accessible for reading
  */
 bool is_readable(uint32_t addr, uint32_t size);
+/**
+ * @brief Fetch the argument packet of a system call, whose address
+ *        is in %esi.
+ * 
+ * @param ureg_ptr the execution state of the system call
+ * @param args where to store the arguments
+ * @param count number of arguments
+ * @return a negative value on failure, 0 otherwise
+ */
+int copy_args(ureg_t *ureg_ptr, uint32_t *args, uint32_t count);
+/**
+ * @brief Copy a NULL terminated user argument vector onto the kernel
+ *        heap.
+ * 
+ * @param argvec user address of the vector
+ * @return the copy, or NULL on failure
+ */
+char **copy_arg_vector(uint32_t argvec);
+/**
+ * @brief Free a copy made by copy_arg_vector.
+ * 
+ * @param argvec the copy
+ */
+void free_arg_vector(char **argvec);
+/**
+ * @brief Move characters of ch_buf out to a user buffer, which has
+ *        been checked to be writable.
+ * 
+ * @param buf user address of the buffer
+ * @param len capacity of the buffer
+ * @return number of characters moved, or -1 if the buffer turns out
+ *         not to be writable
+ */
+int pop_line(uint32_t buf, int len);
 
 bool is_writable(uint32_t addr, uint32_t size) {
     if (size > 0) {
-        if (!(addr >= USER_MEM_START && size <= VIRTUAL_ADDR_END - addr)) {
+        if (!is_user_range(addr, size)) {
             return false;
         }
 
-        pde_t *page_dir = (pde_t *)((get_cr3() >> PAGE_SHIFT) << PAGE_SHIFT);
-        for (
-            uint64_t i = (addr >> PAGE_SHIFT) << PAGE_SHIFT;
-            i < (uint64_t)addr + (uint64_t)size;
-            i += PAGE_SIZE
-        ) {
-            mapping_info_t mapping_info;
-            check_user_page(page_dir, i, &mapping_info);
-            switch (mapping_info) {
-                case PDE_NOT_PRESENT:
-                case PTE_NOT_PRESENT: {
-                    uint32_t availability;
-                    get_availability(page_dir, i, &availability);
-                    if (availability != PAGE_AVAILABLE) {
-                        return false;
-                    }
-                    break;
-                }
-                case ZERO_FRAME_MAPPED: {
-                    break;
-                }
-                case NEW_FRAME_MAPPED: {
-                    uint32_t access;
-                    get_access(page_dir, i, &access);
-                    if (access != READ_WRITE) {
-                        return false;
-                    }
-                    break;
-                }
-                default: {
-                    return false;
-                }
-            }
-        }
+        // Pages that are not mapped or are mapped read only for now get
+        // a frame of their own on the first write.
+        pcb_t *pcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
+        return is_vma_range(pcb_ptr->vma_tree, addr, size, READ_WRITE);
     }
 
     return true;
@@ -124,39 +159,95 @@ bool is_writable(uint32_t addr, uint32_t size) {
 
 bool is_readable(uint32_t addr, uint32_t size) {
     if (size > 0) {
-        if (!(addr >= USER_MEM_START && size <= VIRTUAL_ADDR_END - addr)) {
+        if (!is_user_range(addr, size)) {
             return false;
         }
 
-        pde_t *page_dir = (pde_t *)((get_cr3() >> PAGE_SHIFT) << PAGE_SHIFT);
-        for (
-            uint64_t i = (addr >> PAGE_SHIFT) << PAGE_SHIFT;
-            i < (uint64_t)addr + (uint64_t)size;
-            i += PAGE_SIZE
+        pcb_t *pcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
+        return is_vma_range(pcb_ptr->vma_tree, addr, size, READ_ONLY);
+    }
+
+    return true;
+}
+
+int copy_args(ureg_t *ureg_ptr, uint32_t *args, uint32_t count) {
+    return copy_from_user(args, ureg_ptr->esi, count * sizeof(uint32_t));
+}
+
+char **copy_arg_vector(uint32_t argvec) {
+    // count the arguments first
+    uint32_t argc = 0;
+    uint32_t arg;
+    do {
+        if (copy_from_user(
+            &arg,
+            argvec + argc * sizeof(uint32_t),
+            sizeof(uint32_t)
+        ) < 0) {
+            return NULL;
+        }
+        argc++;
+    } while (arg != 0);
+
+    char **copy = calloc(argc, sizeof(char *));
+    char *scratch = malloc(EXEC_ARG_LEN_MAX);
+    if (copy == NULL || scratch == NULL) {
+        free(copy);
+        free(scratch);
+        return NULL;
+    }
+    for (uint32_t i = 0; i + 1 < argc; i++) {
+        int len;
+        if (
+            copy_from_user(
+                &arg,
+                argvec + i * sizeof(uint32_t),
+                sizeof(uint32_t)
+            ) < 0 ||
+            (len = copy_string_from_user(scratch, arg, EXEC_ARG_LEN_MAX)) < 0 ||
+            (copy[i] = malloc(len + 1)) == NULL
         ) {
-            mapping_info_t mapping_info;
-            check_user_page(page_dir, i, &mapping_info);
-            switch (mapping_info) {
-                case PDE_NOT_PRESENT:
-                case PTE_NOT_PRESENT: {
-                    uint32_t availability;
-                    get_availability(page_dir, i, &availability);
-                    if (availability != PAGE_AVAILABLE) {
-                        return false;
-                    }
-                }
-                case ZERO_FRAME_MAPPED:
-                case NEW_FRAME_MAPPED: {
-                    break;
-                }
-                default: {
-                    return false;
-                }
-            }
+            free(scratch);
+            free_arg_vector(copy);
+            return NULL;
         }
+        memcpy(copy[i], scratch, len + 1);
     }
+    free(scratch);
+    return copy;
+}
 
-    return true;
+void free_arg_vector(char **argvec) {
+    for (int i = 0; argvec[i] != NULL; i++) {
+        free(argvec[i]);
+    }
+    free(argvec);
+}
+
+int pop_line(uint32_t buf, int len) {
+    char line[COPY_CHUNK_SIZE];
+    int ch_count = 0;
+    int line_count = 0;
+    char ch;
+    while (ch_count < len && !(pop_head(&ch_buf, &ch) < 0)) {
+        line[line_count] = ch;
+        line_count++;
+        ch_count++;
+        if (line_count == COPY_CHUNK_SIZE || ch_count == len) {
+            if (copy_to_user(
+                buf + ch_count - line_count,
+                line,
+                line_count
+            ) < 0) {
+                return -1;
+            }
+            line_count = 0;
+        }
+    }
+    if (copy_to_user(buf + ch_count - line_count, line, line_count) < 0) {
+        return -1;
+    }
+    return ch_count;
 }
 
 bool check_eflags(uint32_t old_eflags, uint32_t new_eflags) {
@@ -171,17 +262,19 @@ int initialize_system_call(void) {
     ) {
         return -1;
     }
+    init_wait_queue(&deschedule_queue);
+    init_futex_table();
     return 0;
 }
 
 void handle_gettid(ureg_t *ureg_ptr) {
-    tcb_t *tcb_ptr = thread_lists[RUNNING_STATE]->data;
+    tcb_t *tcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]));
     ureg_ptr->eax = tcb_ptr->tid;
 }
 
 void handle_fork(ureg_t *ureg_ptr) {
     // reject multi-threading processes
-    tcb_t *tcb_ptr = thread_lists[RUNNING_STATE]->data;
+    tcb_t *tcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]));
     pcb_t *pcb_ptr = tcb_ptr->pcb_ptr;
     mutex_lock(&(pcb_ptr->lock));
     int thread_alive_count;
@@ -204,7 +297,7 @@ void handle_fork(ureg_t *ureg_ptr) {
 
 void handle_exec(ureg_t *ureg_ptr) {
     // reject multi-threading processes
-    tcb_t *tcb_ptr = thread_lists[RUNNING_STATE]->data;
+    tcb_t *tcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]));
     pcb_t *pcb_ptr = tcb_ptr->pcb_ptr;
     mutex_lock(&(pcb_ptr->lock));
     int thread_alive_count;
@@ -217,10 +310,32 @@ void handle_exec(ureg_t *ureg_ptr) {
         return;
     }
 
-    void **arg_array = (void **)ureg_ptr->esi;
-    char *execname = arg_array[0];
-    char **argvec = arg_array[1];
-    if (load_executable(execname, argvec, ureg_ptr) < 0) {
+    // The loader gets kernel copies, which outlive the old address
+    // space.
+    uint32_t args[2];
+    char execname[MAX_EXECNAME_LEN];
+    if (
+        copy_args(ureg_ptr, args, 2) < 0 ||
+        copy_string_from_user(execname, args[0], MAX_EXECNAME_LEN) < 0
+    ) {
+        ureg_ptr->eax = -1;
+        return;
+    }
+    char **argvec = copy_arg_vector(args[1]);
+    if (argvec == NULL) {
+        ureg_ptr->eax = -1;
+        return;
+    }
+    // Keep pages where they are while the address space is replaced.
+    mutex_lock(&(pcb_ptr->lock));
+    pcb_ptr->swappable = false;
+    mutex_unlock(&(pcb_ptr->lock));
+    bool success = !(load_executable(execname, argvec, ureg_ptr) < 0);
+    mutex_lock(&(pcb_ptr->lock));
+    pcb_ptr->swappable = true;
+    mutex_unlock(&(pcb_ptr->lock));
+    free_arg_vector(argvec);
+    if (!success) {
         ureg_ptr->eax = -1;
         return;
     }
@@ -236,11 +351,14 @@ void handle_halt(ureg_t *ureg_ptr) {
 
 void handle_deschedule(ureg_t *ureg_ptr){
     ureg_ptr->eax = 0;
-    pcb_t *pcb_ptr = thread_lists[RUNNING_STATE]->data->pcb_ptr;
-    int *reject = (int*) ureg_ptr->esi;
-
-    // Check for valid pointer
-    if(!is_readable((uint32_t) reject, sizeof(int))){
+    pcb_t *pcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
+    uint32_t reject = ureg_ptr->esi;
+    int val;
+
+    // Read reject once without the lock, so that its page is in place
+    // by the time we read it again under the lock, where a page fault
+    // cannot be resolved.
+    if (copy_from_user(&val, reject, sizeof(int)) < 0) {
         ureg_ptr->eax = -1;
         return;
     }
@@ -249,7 +367,12 @@ void handle_deschedule(ureg_t *ureg_ptr){
     mutex_lock(&(pcb_ptr->lock));
     disable_interrupts();
 
-    int val = *reject;
+    if (copy_from_user(&val, reject, sizeof(int)) < 0) {
+        ureg_ptr->eax = -1;
+        mutex_unlock(&(pcb_ptr->lock));
+        enable_interrupts();
+        return;
+    }
     if (val)
     {
         mutex_unlock(&(pcb_ptr->lock));
@@ -257,16 +380,12 @@ void handle_deschedule(ureg_t *ureg_ptr){
         return;
     }
     
-    blocking_detail_t detail = (blocking_detail_t) {.reason = DESCHEDULE};
-    tcb_t *next_tcb = find_next_thread();
-    if (next_tcb == NULL)
+    mutex_unlock(&(pcb_ptr->lock));
+    if (wait_on_queue(&deschedule_queue, DESCHEDULE, NULL) < 0)
     {
         ureg_t ureg = {.cause = 0};
         handle_halt(&ureg);
     }
-    
-    mutex_unlock(&(pcb_ptr->lock));
-    switch_context(next_tcb, WAITING_STATE, &detail);
     enable_interrupts();
 }
 
@@ -275,8 +394,12 @@ void handle_make_runnable(ureg_t *ureg_ptr){
 
     // Find corresponding descheduled thread
     disable_interrupts();
-    tcb_t *tcb_ptr = find_tcb_in_list((void*) tid, DESCHEDULE);
-    if (tcb_ptr == NULL)
+    tcb_t *tcb_ptr = find_tcb(tid);
+    if (
+        tcb_ptr == NULL ||
+        tcb_ptr->state != WAITING_STATE ||
+        tcb_ptr->blocking_detail.reason != DESCHEDULE
+    )
     {
         ureg_ptr->eax = -1;
         enable_interrupts();
@@ -290,6 +413,74 @@ void handle_make_runnable(ureg_t *ureg_ptr){
     ureg_ptr->eax = 0;
 }
 
+void handle_futex_wait(ureg_t *ureg_ptr) {
+    uint32_t args[2];
+    if (copy_args(ureg_ptr, args, 2) < 0) {
+        ureg_ptr->eax = -1;
+        return;
+    }
+    uint32_t addr = args[0];
+    int expected = (int)args[1];
+    if (addr % sizeof(int) != 0) {
+        ureg_ptr->eax = -1;
+        return;
+    }
+    ureg_ptr->eax = 0;
+    pcb_t *pcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
+    int val;
+
+    // Read the word once without the lock, so that its page is in place
+    // by the time we read it again under the lock, where a page fault
+    // cannot be resolved.
+    if (copy_from_user(&val, addr, sizeof(int)) < 0) {
+        ureg_ptr->eax = -1;
+        return;
+    }
+    if (val != expected) {
+        ureg_ptr->eax = -1;
+        return;
+    }
+
+    // Atomically check the word, so that a wake up sent once it has
+    // changed cannot be missed
+    mutex_lock(&(pcb_ptr->lock));
+    disable_interrupts();
+
+    if (copy_from_user(&val, addr, sizeof(int)) < 0 || val != expected) {
+        ureg_ptr->eax = -1;
+        mutex_unlock(&(pcb_ptr->lock));
+        enable_interrupts();
+        return;
+    }
+
+    mutex_unlock(&(pcb_ptr->lock));
+    if (wait_on_futex(pcb_ptr, addr) < 0)
+    {
+        ureg_t ureg = {.cause = 0};
+        handle_halt(&ureg);
+    }
+    enable_interrupts();
+}
+
+void handle_futex_wake(ureg_t *ureg_ptr) {
+    uint32_t args[2];
+    if (copy_args(ureg_ptr, args, 2) < 0) {
+        ureg_ptr->eax = -1;
+        return;
+    }
+    uint32_t addr = args[0];
+    int count = (int)args[1];
+    if (addr % sizeof(int) != 0 || count < 0) {
+        ureg_ptr->eax = -1;
+        return;
+    }
+    pcb_t *pcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
+
+    disable_interrupts();
+    ureg_ptr->eax = wake_futex(pcb_ptr, addr, count);
+    enable_interrupts();
+}
+
 void handle_yield(ureg_t *ureg_ptr){
     int tid = ureg_ptr->esi;
     disable_interrupts();
@@ -304,8 +495,8 @@ void handle_yield(ureg_t *ureg_ptr){
         }
         switch_context(next_tcb, READY_STATE, NULL);
     }else{
-        tcb_t *tcb_ptr = find_tcb_in_list((void*) tid, READY_STATE);
-        if (tcb_ptr == NULL)
+        tcb_t *tcb_ptr = find_tcb(tid);
+        if (tcb_ptr == NULL || tcb_ptr->state != READY_STATE)
         {
             ureg_ptr->eax = -1;
             enable_interrupts();
@@ -318,16 +509,17 @@ void handle_yield(ureg_t *ureg_ptr){
 }
 
 void handle_wait(ureg_t *ureg_ptr) {
-    int *status_ptr = (int*) ureg_ptr->esi;
+    uint32_t status_ptr = ureg_ptr->esi;
 
-    // Check if memeory is writable
-    if (status_ptr && !is_writable((uint32_t) status_ptr, sizeof(int)))
+    // Check if memeory is writable, since a child is not given back
+    // once reaped.
+    if (status_ptr && !is_writable(status_ptr, sizeof(int)))
     {
         ureg_ptr->eax = -1;
         return;
     }
 
-    pcb_t *pcb_ptr = thread_lists[RUNNING_STATE]->data->pcb_ptr;
+    pcb_t *pcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
 
     mutex_lock(&(pcb_ptr->lock));
     pcb_node_t *child_pcb_node;
@@ -349,23 +541,12 @@ void handle_wait(ureg_t *ureg_ptr) {
             unlock_children(pcb_ptr, child_pcb_node);
             break;
         }else{
-            // Block and wait
-            blocking_detail_t detail = (blocking_detail_t) {.reason = VANISH_WAIT};
-            
+            // Block and wait. Interrupts stay disabled from releasing
+            // the children until blocking, so that no exit is missed.
             disable_interrupts();
             unlock_children(pcb_ptr, NULL);
-
-            tcb_t *next_tcb = find_next_thread();
-            if (next_tcb == NULL)
-            {
-                ureg_t ureg = {.cause = 0};
-                handle_halt(&ureg);
-            }
-            
-            mutex_unlock(&(pcb_ptr->lock));
-            switch_context(next_tcb, WAITING_STATE, &detail);
+            cond_wait(&(pcb_ptr->child_exit_cond), &(pcb_ptr->lock));
             enable_interrupts();
-            mutex_lock(&(pcb_ptr->lock));
         }
     }
     
@@ -427,53 +608,52 @@ void handle_wait(ureg_t *ureg_ptr) {
     
     mutex_unlock(&(pcb_ptr->lock));
 
-    // free tcb list
+    // take the threads out of the TERMINATED list and the TID table,
+    // then free tcb list and the kernel stacks
     tcb_node_t *current_tcb_list = child_pcb->tcb_list;
     ureg_ptr->eax = current_tcb_list->data.tid;
+    disable_interrupts();
+    tcb_node_t *current_tcb_node = current_tcb_list;
+    do
+    {
+        Q_REMOVE(
+            &(thread_lists[TERMINATED_STATE]),
+            &(current_tcb_node->data),
+            state_link
+        );
+        unregister_tid(&(current_tcb_node->data));
+        current_tcb_node = current_tcb_node->next;
+    } while (current_tcb_node != current_tcb_list);
+    enable_interrupts();
     while (current_tcb_list)
     {
-        POP_FRONT(tcb_node_t, current_tcb_list);
-    }
-
-    // free all tcb in TERMINATED list
-    while(thread_lists[TERMINATED_STATE]){
-        POP_FRONT(tcb_ptr_node_t, thread_lists[TERMINATED_STATE]);
+        free_kernel_stack(current_tcb_list->data.kernel_stack);
+        POP_FRONT_CACHED(tcb_node_t, &tcb_node_cache, current_tcb_list);
     }
 
     if (status_ptr){
-        *status_ptr = child_pcb->status;
+        copy_to_user(status_ptr, &(child_pcb->status), sizeof(int));
     }
     
-    // free page dir
+    // free page dir, out of reach of reclaim_frames first
+    unregister_swappable(child_pcb);
     destruct_page_dir(child_pcb->page_directory);
     mutex_destroy(&(child_pcb->lock));
+    cond_destroy(&(child_pcb->child_exit_cond));
 
-    // free alloc list
-    while (child_pcb->page_allocation_list)
-    {
-        POP_FRONT(page_allocation_node_t, child_pcb->page_allocation_list);
-    }
+    // free virtual memory areas
+    destroy_vma_tree(&(child_pcb->vma_tree));
 
     // delete child
-    POP_FRONT(pcb_node_t, child_pcb_node);
+    POP_FRONT_CACHED(pcb_node_t, &pcb_node_cache, child_pcb_node);
 
     // wake up next waiting thread, parent and init
-    disable_interrupts();
-    tcb_t *next_tcb = find_tcb_in_list(pcb_ptr, VANISH_WAIT);
-    if (next_tcb)
-    {
-        alter_state(next_tcb, READY_STATE, NULL);
-    }    
-    tcb_t *init_tcb = find_tcb_in_list(init_pcb, VANISH_WAIT);
-    if (init_tcb)
-    {
-        alter_state(init_tcb, READY_STATE, NULL);
-    }    
-    enable_interrupts();
+    cond_signal(&(pcb_ptr->child_exit_cond));
+    cond_signal(&(init_pcb->child_exit_cond));
 }
 
 void handle_vanish(ureg_t *ureg_ptr) {
-    pcb_t *pcb_ptr = thread_lists[RUNNING_STATE]->data->pcb_ptr;
+    pcb_t *pcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
 
     mutex_lock(&(pcb_ptr->lock));
     int thread_alive_count;
@@ -485,12 +665,9 @@ void handle_vanish(ureg_t *ureg_ptr) {
     if (thread_alive_count == 1)
     {
         // Last thread, find waiting tasks
-        next_tcb = find_tcb_in_list(pcb_ptr->parent_pcb_ptr, VANISH_WAIT);
-        if (next_tcb)
-        {
-            alter_state(next_tcb, READY_STATE, NULL);
-        }
-        
+        cond_signal(&(pcb_ptr->parent_pcb_ptr->child_exit_cond));
+
+
         // RR next
         next_tcb = round_robin();
 
@@ -513,7 +690,7 @@ void handle_vanish(ureg_t *ureg_ptr) {
 
 void handle_task_vanish(ureg_t *ureg_ptr) {
     int status = (int) ureg_ptr->esi;
-    tcb_t *tcb_ptr = thread_lists[RUNNING_STATE]->data;
+    tcb_t *tcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]));
     pcb_t *pcb_ptr = tcb_ptr->pcb_ptr;
     mutex_lock(&(pcb_ptr->lock));
     disable_interrupts();
@@ -533,33 +710,54 @@ void handle_task_vanish(ureg_t *ureg_ptr) {
 
 void handle_set_status(ureg_t *ureg_ptr) {
     int status = (int) ureg_ptr->esi;
-    pcb_t *pcb_ptr = thread_lists[RUNNING_STATE]->data->pcb_ptr;
+    pcb_t *pcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
     pcb_ptr->status = status;
 }
 
 void handle_print(ureg_t *ureg_ptr) {
-    void **arg_array = (void **)ureg_ptr->esi;
-    int len = (int)arg_array[0];
-    char *buf = arg_array[1];
+    uint32_t args[2];
+    if (copy_args(ureg_ptr, args, 2) < 0) {
+        ureg_ptr->eax = -1;
+        return;
+    }
+    int len = (int)args[0];
+    uint32_t buf = args[1];
 
-    if (len < 0 || !is_readable((uint32_t)buf, len)) {
+    if (len < 0) {
         ureg_ptr->eax = -1;
         return;
     }
-    
+
+    // The buffer is not checked in advance. Output stops at the first
+    // chunk that cannot be read.
+    char chunk[COPY_CHUNK_SIZE];
+    bool success = true;
     mutex_lock(&output_lock);
-    putbytes(buf, len);
+    for (int offset = 0; offset < len; offset += COPY_CHUNK_SIZE) {
+        int size = len - offset < COPY_CHUNK_SIZE ?
+            len - offset : COPY_CHUNK_SIZE;
+        if (copy_from_user(chunk, buf + offset, size) < 0) {
+            success = false;
+            break;
+        }
+        putbytes(chunk, size);
+    }
     mutex_unlock(&output_lock);
 
-    ureg_ptr->eax = 0;
+    ureg_ptr->eax = success ? 0 : -1;
 }
 
 void handle_readline(ureg_t *ureg_ptr) {
-    void **arg_array = (void **)ureg_ptr->esi;
-    int len = (int)arg_array[0];
-    char *buf = arg_array[1];
+    uint32_t args[2];
+    if (copy_args(ureg_ptr, args, 2) < 0) {
+        ureg_ptr->eax = -1;
+        return;
+    }
+    int len = (int)args[0];
+    uint32_t buf = args[1];
 
-    if (len < 0 || len > BUF_LEN || !is_writable((uint32_t)buf, len)) {
+    // Check the buffer before the line is taken from the console.
+    if (len < 0 || len > BUF_LEN || !is_writable(buf, len)) {
         ureg_ptr->eax = -1;
         return;
     }
@@ -569,70 +767,26 @@ void handle_readline(ureg_t *ureg_ptr) {
         return;
     }
 
-    tcb_t *original_tcb_ptr = thread_lists[RUNNING_STATE]->data;
-    mutex_lock(&(original_tcb_ptr->pcb_ptr->lock));
-    disable_interrupts();
-    if (mutex_try_lock(&input_lock) < 0) {
-        tcb_t *target_tcb_ptr = find_next_thread();
-        if (target_tcb_ptr == NULL) {
-            ureg_t ureg = {.cause = 0};
-            handle_halt(&ureg);
-        }
-        blocking_detail_t blocking_detail = {
-            .reason = READLINE,
-            .first_reader = false
-        };
-        mutex_unlock(&(original_tcb_ptr->pcb_ptr->lock));
-        switch_context(target_tcb_ptr, WAITING_STATE, &blocking_detail);
-        mutex_try_lock(&input_lock);
-        enable_interrupts();
-    } else {
-        enable_interrupts();
-        mutex_unlock(&(original_tcb_ptr->pcb_ptr->lock));
-    }
+    // Readers take turns, each reading a whole line.
+    mutex_lock(&input_lock);
 
     if (ch_buf.element_count > 0) {
-        int ch_count = 0;
-        char ch;
-        while (ch_count < len && !(pop_head(&ch_buf, &ch) < 0)) {
-            buf[ch_count] = ch;
-            ch_count++;
-        }
-        ureg_ptr->eax = ch_count;
-    
-        disable_interrupts();
+        ureg_ptr->eax = pop_line(buf, len);
         mutex_unlock(&input_lock);
-        if (thread_lists[READLINE] != NULL) {
-            switch_context(thread_lists[READLINE]->data, READY_STATE, NULL);
-        }
-        enable_interrupts();
         return;
     }
 
     bool newline = false;
     while (!newline) {
         char ch;
-        mutex_lock(&(original_tcb_ptr->pcb_ptr->lock));
         disable_interrupts();
         while (extract_ch(&scancode_buf, &ch) < 0) {
-            tcb_t *target_tcb_ptr = find_next_thread();
-            if (target_tcb_ptr == NULL) {
+            if (wait_on_queue(&keystroke_queue, READLINE, NULL) < 0) {
                 ureg_t ureg = {.cause = 0};
                 handle_halt(&ureg);
             }
-            blocking_detail_t blocking_detail = {
-                .reason = READLINE,
-                .first_reader = true
-            };
-            mutex_unlock(&(original_tcb_ptr->pcb_ptr->lock));
-            switch_context(target_tcb_ptr, WAITING_STATE, &blocking_detail);
-            enable_interrupts();
-
-            mutex_lock(&(original_tcb_ptr->pcb_ptr->lock));
-            disable_interrupts();
         }
         enable_interrupts();
-        mutex_unlock(&(original_tcb_ptr->pcb_ptr->lock));
     
         mutex_lock(&output_lock);
         putbyte(ch);
@@ -655,20 +809,8 @@ void handle_readline(ureg_t *ureg_ptr) {
         }
     }
 
-    int ch_count = 0;
-    char ch;
-    while (ch_count < len && !(pop_head(&ch_buf, &ch) < 0)) {
-        buf[ch_count] = ch;
-        ch_count++;
-    }
-    ureg_ptr->eax = ch_count;
-
-    disable_interrupts();
+    ureg_ptr->eax = pop_line(buf, len);
     mutex_unlock(&input_lock);
-    if (thread_lists[READLINE] != NULL) {
-        switch_context(thread_lists[READLINE]->data, READY_STATE, NULL);
-    }
-    enable_interrupts();
 }
 
 void handle_getchar(ureg_t *ureg_ptr) {
@@ -677,15 +819,20 @@ void handle_getchar(ureg_t *ureg_ptr) {
 }
 
 void handle_new_pages(ureg_t *ureg_ptr) {
-    pcb_t *pcb_ptr = thread_lists[RUNNING_STATE]->data->pcb_ptr;
-    mutex_lock(&(pcb_ptr->lock));
+    // page faults cannot be resolved under the lock
+    uint32_t args[2];
+    if (copy_args(ureg_ptr, args, 2) < 0) {
+        ureg_ptr->eax = -1;
+        return;
+    }
+    uint32_t base = args[0];
+    int len = (int)args[1];
 
-    void **arg_array = (void **)ureg_ptr->esi;
-    void *base = arg_array[0];
-    int len = (int)arg_array[1];
+    pcb_t *pcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
+    mutex_lock(&(pcb_ptr->lock));
 
-    uint32_t page = ((uint32_t)base >> PAGE_SHIFT) << PAGE_SHIFT;
-    if (page != (uint32_t)base) {
+    uint32_t page = (base >> PAGE_SHIFT) << PAGE_SHIFT;
+    if (page != base) {
         ureg_ptr->eax = -1;
         mutex_unlock(&(pcb_ptr->lock));
         return;
@@ -701,79 +848,27 @@ void handle_new_pages(ureg_t *ureg_ptr) {
         return;
     }
 
-    pde_t *page_dir = (pde_t *)((get_cr3() >> PAGE_SHIFT) << PAGE_SHIFT);
-    for (uint32_t i = 0; i < page_count; i++) {
-        uint32_t current_page = page + i * PAGE_SIZE;
-        uint32_t availability;
-        if (!(
-            get_availability(page_dir, current_page, &availability) < 0 ||
-            availability != PAGE_UNAVAILABLE ||
-            set_availability(page_dir, current_page, PAGE_AVAILABLE) < 0
-        )) {
-            if (!(map_new_frame(page_dir, current_page) < 0)) {
-                memset((void *)current_page, 0, PAGE_SIZE);
-                continue;
-            }
-            set_availability(
-                page_dir,
-                current_page,
-                PAGE_UNAVAILABLE
-            );
-        }
-        for (uint32_t j = 0; j < i; j++) {
-            uint32_t previous_page = page + j * PAGE_SIZE;
-            unmap_frame(page_dir, previous_page);
-            set_availability(
-                page_dir,
-                previous_page,
-                PAGE_UNAVAILABLE
-            );
-        }
+    if (page < USER_PAGE_START || !is_user_range(page, len)) {
         ureg_ptr->eax = -1;
         mutex_unlock(&(pcb_ptr->lock));
         return;
     }
-
-    page_allocation_t page_allocation = {
-        .base = base,
-        .len = len
-    };
-    bool success;
-    if (
-        pcb_ptr->page_allocation_list == NULL ||
-        pcb_ptr->page_allocation_list->data.base >= base
-    ) {
-        PUSH_FRONT(
-            page_allocation_node_t,
-            pcb_ptr->page_allocation_list,
-            page_allocation,
-            success
-        );
-    } else {
-        page_allocation_node_t *node_ptr = pcb_ptr->page_allocation_list->next;
-        while (
-            node_ptr != pcb_ptr->page_allocation_list &&
-            node_ptr->data.base < base
-        ) {
-            node_ptr = node_ptr->next;
-        }
-        PUSH_FRONT(
-            page_allocation_node_t,
-            node_ptr,
-            page_allocation,
-            success
-        );
+    // None of the pages may be in use. They are only reserved here, and
+    // get their frames when first written.
+    if (insert_vma(
+        &(pcb_ptr->vma_tree),
+        page,
+        len,
+        READ_WRITE,
+        VMA_NEW_PAGES,
+        VMA_ANONYMOUS
+    ) < 0) {
+        ureg_ptr->eax = -1;
+        mutex_unlock(&(pcb_ptr->lock));
+        return;
     }
-    if (!success) {
-        for (uint32_t i = 0; i < page_count; i++) {
-            uint32_t previous_page = page + i * PAGE_SIZE;
-            unmap_frame(page_dir, previous_page);
-            set_availability(
-                page_dir,
-                previous_page,
-                PAGE_UNAVAILABLE
-            );
-        }
+    if (reserve_vma_frames(find_vma(pcb_ptr->vma_tree, page)) < 0) {
+        remove_vma(&(pcb_ptr->vma_tree), page);
         ureg_ptr->eax = -1;
         mutex_unlock(&(pcb_ptr->lock));
         return;
@@ -784,68 +879,56 @@ void handle_new_pages(ureg_t *ureg_ptr) {
 }
 
 void handle_remove_pages(ureg_t *ureg_ptr) {
-    pcb_t *pcb_ptr = thread_lists[RUNNING_STATE]->data->pcb_ptr;
+    pcb_t *pcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
     mutex_lock(&(pcb_ptr->lock));
 
-    void *base = (void *)ureg_ptr->esi;
-
-    bool success = false;
-    uint32_t cr3 = get_cr3();
-    pde_t *page_dir = (pde_t *)((cr3 >> PAGE_SHIFT) << PAGE_SHIFT);
-    if (pcb_ptr->page_allocation_list != NULL) {
-        page_allocation_node_t *node_ptr = pcb_ptr->page_allocation_list;
-        do {
-            if (node_ptr->data.base == base) {
-                int len = node_ptr->data.len;
-                if (node_ptr == pcb_ptr->page_allocation_list) {
-                    POP_FRONT(
-                        page_allocation_node_t,
-                        pcb_ptr->page_allocation_list
-                    );
-                } else {
-                    POP_FRONT(
-                        page_allocation_node_t,
-                        node_ptr
-                    );
-                }
-                for (uint32_t i = 0; i < len; i += PAGE_SIZE) {
-                    uint32_t v_addr = (uint32_t)base + i;
-                    if (
-                        unmap_frame(page_dir, v_addr) < 0 ||
-                        set_availability(page_dir, v_addr, PAGE_UNAVAILABLE) < 0
-                    ) {
-                        ureg_ptr->eax = -1;
-                        mutex_unlock(&(pcb_ptr->lock));
-                        return;
-                    }
-                }
-                success = true;
-                break;
-            }
-            node_ptr = node_ptr->next;
-        } while (
-            node_ptr != pcb_ptr->page_allocation_list &&
-            node_ptr->data.base < base
-        );
+    uint32_t base = ureg_ptr->esi;
+
+    // only a whole region allocated by new_pages may be removed
+    vma_t *vma_ptr = find_vma(pcb_ptr->vma_tree, base);
+    if (
+        vma_ptr == NULL ||
+        vma_ptr->start != base ||
+        vma_ptr->type != VMA_NEW_PAGES
+    ) {
+        ureg_ptr->eax = -1;
+        mutex_unlock(&(pcb_ptr->lock));
+        return;
     }
-    if (!success) {
+    uint32_t len = vma_ptr->end - vma_ptr->start;
+    remove_vma(&(pcb_ptr->vma_tree), base);
+
+    pde_t *page_dir = (pde_t *)((get_cr3() >> PAGE_SHIFT) << PAGE_SHIFT);
+    // The pages are invalidated together, and their frames are not
+    // reused until then.
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, page_dir);
+    if (unmap_range(page_dir, base, len, &batch) < 0) {
+        tlb_batch_flush(&batch);
         ureg_ptr->eax = -1;
         mutex_unlock(&(pcb_ptr->lock));
         return;
     }
 
-    set_cr3(cr3);
+    tlb_batch_flush(&batch);
     ureg_ptr->eax = 0;
     mutex_unlock(&(pcb_ptr->lock));
 }
 
 void handle_swexn(ureg_t *ureg_ptr) {
-    void **arg_array = (void **)ureg_ptr->esi;
-    void *exception_stack = arg_array[0];
-    void (*handler)(void *arg, ureg_t *ureg_ptr) = arg_array[1];
-    void *arg = arg_array[2];
-    ureg_t *new_ureg_ptr = arg_array[3];
-
+    uint32_t args[4];
+    if (copy_args(ureg_ptr, args, 4) < 0) {
+        ureg_ptr->eax = -1;
+        return;
+    }
+    void *exception_stack = (void *)args[0];
+    void (*handler)(void *arg, ureg_t *ureg_ptr) = (void *)args[1];
+    void *arg = (void *)args[2];
+    ureg_t *new_ureg_ptr = (ureg_t *)args[3];
+    ureg_t new_ureg;
+
+    // The exception stack and the handler are used long after this
+    // call, so they are checked rather than copied.
     bool success = true;
     if (exception_stack != NULL && handler != NULL) {
         if (
@@ -864,8 +947,12 @@ void handle_swexn(ureg_t *ureg_ptr) {
     if (success) {
         if (new_ureg_ptr != NULL) {
             if (
-                !is_readable((uint32_t)new_ureg_ptr, sizeof(ureg_t)) ||
-                !check_eflags(ureg_ptr->eflags, new_ureg_ptr->eflags)
+                copy_from_user(
+                    &new_ureg,
+                    (uint32_t)new_ureg_ptr,
+                    sizeof(ureg_t)
+                ) < 0 ||
+                !check_eflags(ureg_ptr->eflags, new_ureg.eflags)
             ) {
                 success = false;
             }
@@ -878,7 +965,7 @@ void handle_swexn(ureg_t *ureg_ptr) {
 
     ureg_ptr->eax = 0;
 
-    tcb_t *current_tcb_ptr = thread_lists[RUNNING_STATE]->data;
+    tcb_t *current_tcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]));
     if (exception_stack != NULL && handler != NULL) {
         current_tcb_ptr->exception_stack = exception_stack;
         current_tcb_ptr->handler = handler;
@@ -887,7 +974,7 @@ void handle_swexn(ureg_t *ureg_ptr) {
         current_tcb_ptr->exception_stack = NULL;
     }
     if (new_ureg_ptr != NULL) {
-        load_ureg(new_ureg_ptr);
+        load_ureg(&new_ureg);
     }
 }
 
@@ -904,7 +991,7 @@ void handle_sleep(ureg_t *ureg_ptr) {
         return;
     }
 
-    tcb_t *original_tcb_ptr = thread_lists[RUNNING_STATE]->data;
+    tcb_t *original_tcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]));
     mutex_lock(&(original_tcb_ptr->pcb_ptr->lock));
     disable_interrupts();
     tcb_t *target_tcb_ptr = find_next_thread();
@@ -912,39 +999,84 @@ void handle_sleep(ureg_t *ureg_ptr) {
         ureg_t ureg = {.cause = 0};
         handle_halt(&ureg);
     }
+    // The timer lives on the kernel stack, which stays put until the
+    // thread stops sleeping, and alter_state cancels it then.
+    kernel_timer_t timer;
+    init_kernel_timer(&timer, wake_sleeper, original_tcb_ptr);
     blocking_detail_t blocking_detail = {
         .reason = SLEEP,
-        .wakeup_time = tick_count + ticks
+        .timer_ptr = &timer
     };
+    arm_kernel_timer(&timer, tick_count + ticks);
     mutex_unlock(&(original_tcb_ptr->pcb_ptr->lock));
     switch_context(target_tcb_ptr, WAITING_STATE, &blocking_detail);
     enable_interrupts();
     ureg_ptr->eax = 0;
 }
 
-void handle_readfile(ureg_t *ureg_ptr) {
-    void **arg_array = (void **)ureg_ptr->esi;
-    char *filename = arg_array[0];
-    char *buf = arg_array[1];
-    int count = (int)arg_array[2];
-    int offset = (int)arg_array[3];
+void wake_sleeper(kernel_timer_t *timer_ptr, void *arg) {
+    tcb_t *tcb_ptr = (tcb_t *)arg;
+    // only a thread still sleeping on this very timer may be woken up
+    if (!(
+        tcb_ptr->state == WAITING_STATE &&
+        tcb_ptr->blocking_detail.reason == SLEEP &&
+        tcb_ptr->blocking_detail.timer_ptr == timer_ptr
+    )) {
+        return;
+    }
+    alter_state(tcb_ptr, READY_STATE, NULL);
+}
 
-    if (count < 0 || !is_writable((uint32_t)buf, count)) {
+void handle_readfile(ureg_t *ureg_ptr) {
+    uint32_t args[4];
+    char filename[MAX_EXECNAME_LEN];
+    if (
+        copy_args(ureg_ptr, args, 4) < 0 ||
+        copy_string_from_user(filename, args[0], MAX_EXECNAME_LEN) < 0
+    ) {
         ureg_ptr->eax = -1;
         return;
     }
+    uint32_t buf = args[1];
+    int count = (int)args[2];
+    int offset = (int)args[3];
 
-    int byte_count = getbytes(filename, offset, count, buf);
-    if (byte_count == -1) {
+    if (count < 0) {
         ureg_ptr->eax = -1;
         return;
     }
 
+    // The file goes through the kernel a chunk at a time, and the
+    // buffer is not checked in advance.
+    char chunk[COPY_CHUNK_SIZE];
+    int byte_count = 0;
+    do {
+        int size = count - byte_count < COPY_CHUNK_SIZE ?
+            count - byte_count : COPY_CHUNK_SIZE;
+        int chunk_count = getbytes(
+            filename,
+            offset + byte_count,
+            size,
+            chunk
+        );
+        if (
+            chunk_count < 0 ||
+            copy_to_user(buf + byte_count, chunk, chunk_count) < 0
+        ) {
+            ureg_ptr->eax = -1;
+            return;
+        }
+        byte_count += chunk_count;
+        if (chunk_count < size) {
+            break;
+        }
+    } while (byte_count < count);
+
     ureg_ptr->eax = byte_count;
 }
 
 void handle_thread_fork(ureg_t *ureg_ptr) {
-    tcb_t *tcb_ptr = thread_lists[RUNNING_STATE]->data;
+    tcb_t *tcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]));
     pcb_t *pcb_ptr = tcb_ptr->pcb_ptr;
     mutex_lock(&(pcb_ptr->lock));
     int new_tid = thread_fork_ctrl_blk(ureg_ptr);
@@ -973,9 +1105,13 @@ void handle_set_term_color(ureg_t *ureg_ptr) {
 }
 
 void handle_set_cursor_pos(ureg_t *ureg_ptr) {
-    void **arg_array = (void **)ureg_ptr->esi;
-    int row = (int)arg_array[0];
-    int col = (int)arg_array[1];
+    uint32_t args[2];
+    if (copy_args(ureg_ptr, args, 2) < 0) {
+        ureg_ptr->eax = -1;
+        return;
+    }
+    int row = (int)args[0];
+    int col = (int)args[1];
     mutex_lock(&output_lock);
     bool success = !(set_cursor(row, col) < 0);
     mutex_unlock(&output_lock);
@@ -987,19 +1123,78 @@ void handle_set_cursor_pos(ureg_t *ureg_ptr) {
 }
 
 void handle_get_cursor_pos(ureg_t *ureg_ptr) {
-    void **arg_array = (void **)ureg_ptr->esi;
-    int *row = arg_array[0];
-    int *col = arg_array[1];
-    if (
-        !is_writable((uint32_t)row, sizeof(int)) ||
-        !is_writable((uint32_t)col, sizeof(int))
-    ) {
+    uint32_t args[2];
+    if (copy_args(ureg_ptr, args, 2) < 0) {
         ureg_ptr->eax = -1;
         return;
     }
+    int row;
+    int col;
     mutex_lock(&output_lock);
-    get_cursor(row, col);
+    get_cursor(&row, &col);
     mutex_unlock(&output_lock);
+    if (
+        copy_to_user(args[0], &row, sizeof(int)) < 0 ||
+        copy_to_user(args[1], &col, sizeof(int)) < 0
+    ) {
+        ureg_ptr->eax = -1;
+        return;
+    }
+    ureg_ptr->eax = 0;
+}
+
+void handle_misbehave(ureg_t *ureg_ptr) {
+    // There are no alternative behaviors to pick.
+}
+
+void handle_set_fault_around(ureg_t *ureg_ptr) {
+    int pages = ureg_ptr->esi;
+    if (pages < 0 || pages > FAULT_AROUND_PAGES_MAX) {
+        ureg_ptr->eax = -1;
+        return;
+    }
+
+    pcb_t *pcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
+    mutex_lock(&(pcb_ptr->lock));
+    pcb_ptr->fault_around.pages_max = pages;
+    mutex_unlock(&(pcb_ptr->lock));
+    ureg_ptr->eax = 0;
+}
+
+void handle_get_kernel_stats(ureg_t *ureg_ptr) {
+    uint32_t stats_addr = ureg_ptr->esi;
+    kernel_stats_t stats = {0};
+
+    pcb_t *pcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
+    mutex_lock(&(pcb_ptr->lock));
+    stats.fault_around_pages_max = pcb_ptr->fault_around.pages_max;
+    stats.demand_fault_count = pcb_ptr->fault_around.fault_count;
+    stats.mapped_ahead_count = pcb_ptr->fault_around.mapped_ahead_count;
+    mutex_unlock(&(pcb_ptr->lock));
+
+    merge_stats_t merge_stats;
+    get_merge_stats(&merge_stats);
+    stats.merge_scanned_count = merge_stats.scanned_count;
+    stats.merge_merged_count = merge_stats.merged_count;
+    stats.merge_zero_merged_count = merge_stats.zero_merged_count;
+    stats.merge_stable_frame_count = merge_stats.stable_frame_count;
+    stats.merge_saved_frame_count = merge_stats.saved_frame_count;
+
+    stats.cache_count = get_all_slab_stats(stats.caches, KERNEL_STATS_CACHE_MAX);
+    get_paging_pool_stats(
+        &(stats.paging_pool_hit_count),
+        &(stats.paging_pool_miss_count)
+    );
+    get_zeroed_frame_stats(
+        &(stats.zeroed_pool_hit),
+        &(stats.zeroed_pool_miss)
+    );
+
+    // page faults cannot be resolved under the lock
+    if (copy_to_user(stats_addr, &stats, sizeof(stats)) < 0) {
+        ureg_ptr->eax = -1;
+        return;
+    }
     ureg_ptr->eax = 0;
 }
 
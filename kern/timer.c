@@ -17,11 +17,17 @@
 #include <scheduler.h> // round_robin
 #include <context_switcher.h> // switch_context
 #include <ctrl_blk.h> // thread_lists
+#include <vm.h> // refill_zeroed_frames
+#include <merge.h> // merge_pages
+#include <seg.h> // SEGSEL_USER_CS
+#include <timer_wheel.h> // run_timer_wheel
 
 // how many timer interrupts within a second
 #define TIMER_INTERRUPT_HZ (500)
 // how many context switches triggered by timer interrupts within a second
 #define ROUND_ROBIN_HZ (500)
+// at most how many frames to zero in a tick that would be spent idle
+#define ZEROING_BUDGET (8)
 
 void handle_timer(ureg_t *ureg_ptr);
 void register_timer(void (*tickback)(unsigned int));
@@ -50,20 +56,25 @@ void handle_timer(ureg_t *ureg_ptr) {
         callback(tick_count);
     }
 
-    // we don't take this turn to round robin if there's a sleeping thread
-    // to wake up
+    // The idle process owns the root PCB. Its ticks are better spent
+    // zeroing frames ahead of page faults and merging identical pages.
     if (
-        thread_lists[SLEEP] != NULL &&
-        thread_lists[SLEEP]->data->blocking_detail.wakeup_time <= tick_count
+        Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr ==
+            &(root_pcb_node_ptr->data) &&
+        ureg_ptr->cs == SEGSEL_USER_CS
     ) {
-        tcb_t *target_tcb_ptr = thread_lists[SLEEP]->data;
-        switch_context(target_tcb_ptr, READY_STATE, NULL);
-    } else {
-        if (tick_count % (TIMER_INTERRUPT_HZ / ROUND_ROBIN_HZ) == 0) {
-            tcb_t *target_tcb_ptr = round_robin();
-            if (target_tcb_ptr != NULL) {
-                switch_context(target_tcb_ptr, READY_STATE, NULL);
-            }
+        refill_zeroed_frames(ZEROING_BUDGET);
+        merge_pages();
+    }
+
+    // wake up every sleeper whose time has come, before picking the
+    // next thread
+    run_timer_wheel(tick_count);
+
+    if (tick_count % (TIMER_INTERRUPT_HZ / ROUND_ROBIN_HZ) == 0) {
+        tcb_t *target_tcb_ptr = round_robin();
+        if (target_tcb_ptr != NULL) {
+            switch_context(target_tcb_ptr, READY_STATE, NULL);
         }
     }
 }
@@ -98,6 +109,7 @@ void start_timer(void) {
  * @param tickback the callback function invoked by timer interrupt handler
  */
 void install_timer(void (*tickback)(unsigned int)) {
+    init_timer_wheel();
     register_timer(tickback);
     start_timer();
     lprintf("The timer has been installed.");
@@ -0,0 +1,151 @@
+/**
+ * @file timer_wheel.c
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief a hierarchical timer wheel
+ * 
+ * Timers due within TIMER_ROOT_LEN ticks sit in the root level, in the
+ * slot of their tick. Later ones sit in coarser levels, each slot of
+ * which covers a whole turn of the level below. Whenever a level turns
+ * over, the next slot of the level above is cascaded, i.e., its timers
+ * are put back into the finer levels. Arming and cancelling take
+ * constant time, and each tick fires the whole slot of the tick at once.
+ */
+
+#include <timer_wheel.h> // kernel_timer_t
+#include <variable_queue.h> // Q_INSERT_TAIL
+#include <stddef.h> // NULL
+
+// bits of the tick indexing the root level, and each coarser level
+#define TIMER_ROOT_BITS (8)
+#define TIMER_LEVEL_BITS (6)
+#define TIMER_ROOT_LEN (1 << TIMER_ROOT_BITS)
+#define TIMER_LEVEL_LEN (1 << TIMER_LEVEL_BITS)
+// how many levels above the root, which together cover 32 bits of ticks
+#define TIMER_LEVEL_COUNT (4)
+
+// the slot of a tick in a level above the root
+#define TIMER_LEVEL_IDX(tick, level) \
+    (((tick) >> (TIMER_ROOT_BITS + (level) * TIMER_LEVEL_BITS)) % \
+        TIMER_LEVEL_LEN)
+
+kernel_timer_queue_t timer_root[TIMER_ROOT_LEN];
+kernel_timer_queue_t timer_levels[TIMER_LEVEL_COUNT][TIMER_LEVEL_LEN];
+// the next tick whose slot is to be fired
+unsigned int wheel_tick = 0;
+
+/**
+ * @brief Put a timer into the slot its tick falls in, as seen from
+ *        wheel_tick.
+ * 
+ * @param timer_ptr pointer to the timer, which is in no slot
+ */
+void add_to_wheel(kernel_timer_t *timer_ptr);
+
+/**
+ * @brief Put the timers of a slot above the root back into the wheel.
+ * 
+ * @param level which level the slot is in
+ * @return the index of the slot, which is 0 if the level has turned over
+ *         as well
+ */
+unsigned int cascade(int level);
+
+void init_timer_wheel(void) {
+    for (int i = 0; i < TIMER_ROOT_LEN; i++) {
+        Q_INIT_HEAD(&(timer_root[i]));
+    }
+    for (int level = 0; level < TIMER_LEVEL_COUNT; level++) {
+        for (int i = 0; i < TIMER_LEVEL_LEN; i++) {
+            Q_INIT_HEAD(&(timer_levels[level][i]));
+        }
+    }
+    wheel_tick = 0;
+}
+
+void init_kernel_timer(kernel_timer_t *timer_ptr, timer_func_t func, void *arg) {
+    timer_ptr->expire_tick = 0;
+    timer_ptr->func = func;
+    timer_ptr->arg = arg;
+    timer_ptr->slot_ptr = NULL;
+    Q_INIT_ELEM(timer_ptr, slot_link);
+}
+
+void add_to_wheel(kernel_timer_t *timer_ptr) {
+    unsigned int expire_tick = timer_ptr->expire_tick;
+    unsigned int delta = expire_tick - wheel_tick;
+    kernel_timer_queue_t *slot_ptr;
+    if ((int)delta < 0) {
+        // overdue, so fire it with the next slot
+        slot_ptr = &(timer_root[wheel_tick % TIMER_ROOT_LEN]);
+    } else if (delta < TIMER_ROOT_LEN) {
+        slot_ptr = &(timer_root[expire_tick % TIMER_ROOT_LEN]);
+    } else {
+        int level = 0;
+        while (
+            level < TIMER_LEVEL_COUNT - 1 &&
+            delta >= 1u << (TIMER_ROOT_BITS + (level + 1) * TIMER_LEVEL_BITS)
+        ) {
+            level++;
+        }
+        slot_ptr = &(timer_levels[level][TIMER_LEVEL_IDX(expire_tick, level)]);
+    }
+    Q_INSERT_TAIL(slot_ptr, timer_ptr, slot_link);
+    timer_ptr->slot_ptr = slot_ptr;
+}
+
+void arm_kernel_timer(kernel_timer_t *timer_ptr, unsigned int expire_tick) {
+    cancel_kernel_timer(timer_ptr);
+    timer_ptr->expire_tick = expire_tick;
+    add_to_wheel(timer_ptr);
+}
+
+void cancel_kernel_timer(kernel_timer_t *timer_ptr) {
+    if (timer_ptr->slot_ptr == NULL) {
+        return;
+    }
+    Q_REMOVE(timer_ptr->slot_ptr, timer_ptr, slot_link);
+    timer_ptr->slot_ptr = NULL;
+}
+
+unsigned int cascade(int level) {
+    unsigned int idx = TIMER_LEVEL_IDX(wheel_tick, level);
+    kernel_timer_queue_t *slot_ptr = &(timer_levels[level][idx]);
+    kernel_timer_t *timer_ptr = Q_GET_FRONT(slot_ptr);
+    Q_INIT_HEAD(slot_ptr);
+    while (timer_ptr != NULL) {
+        kernel_timer_t *next_timer_ptr = Q_GET_NEXT(timer_ptr, slot_link);
+        add_to_wheel(timer_ptr);
+        timer_ptr = next_timer_ptr;
+    }
+    return idx;
+}
+
+void run_timer_wheel(unsigned int now) {
+    while ((int)(now - wheel_tick) >= 0) {
+        // Turning over a level cascades the next slot of the one above.
+        if (wheel_tick % TIMER_ROOT_LEN == 0) {
+            int level = 0;
+            while (level < TIMER_LEVEL_COUNT && cascade(level) == 0) {
+                level++;
+            }
+        }
+
+        // Fire the slot of this tick. A timer may arm or cancel timers,
+        // itself included, so the slot is detached first.
+        kernel_timer_queue_t *slot_ptr =
+            &(timer_root[wheel_tick % TIMER_ROOT_LEN]);
+        kernel_timer_queue_t expired = *slot_ptr;
+        Q_INIT_HEAD(slot_ptr);
+        kernel_timer_t *timer_ptr;
+        Q_FOREACH(timer_ptr, &expired, slot_link) {
+            timer_ptr->slot_ptr = &expired;
+        }
+        wheel_tick++;
+        while ((timer_ptr = Q_GET_FRONT(&expired)) != NULL) {
+            Q_REMOVE(&expired, timer_ptr, slot_link);
+            timer_ptr->slot_ptr = NULL;
+            timer_ptr->func(timer_ptr, timer_ptr->arg);
+        }
+    }
+}
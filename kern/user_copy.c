@@ -0,0 +1,61 @@
+/**
+ * @file user_copy.c
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief copies between kernel and user memory
+ */
+
+#include <user_copy.h> // copy_from_user
+#include <user_copy_stub.h> // copy_bytes
+#include <common_kern.h> // USER_MEM_START
+#include <vm.h> // USER_MEM_END
+#include <seg.h> // SEGSEL_KERNEL_CS
+#include <stdbool.h> // bool
+
+bool is_user_range(uint32_t addr, uint32_t size) {
+    // check addr before subtracting, or the kernel window above user
+    // memory would wrap around into range
+    return size == 0 || (
+        addr >= USER_MEM_START &&
+        addr <= USER_MEM_END &&
+        size <= USER_MEM_END - addr
+    );
+}
+
+int copy_from_user(void *dst, uint32_t src, uint32_t len) {
+    if (!is_user_range(src, len)) {
+        return -1;
+    }
+    return copy_bytes(dst, (void *)src, len);
+}
+
+int copy_to_user(uint32_t dst, const void *src, uint32_t len) {
+    if (!is_user_range(dst, len)) {
+        return -1;
+    }
+    return copy_bytes((void *)dst, src, len);
+}
+
+int copy_string_from_user(char *dst, uint32_t src, uint32_t size) {
+    if (size == 0 || src < USER_MEM_START || src >= USER_MEM_END) {
+        return -1;
+    }
+    // never walk off the end of user memory
+    if (size > USER_MEM_END - src) {
+        size = USER_MEM_END - src;
+    }
+    return copy_string(dst, (char *)src, size);
+}
+
+int fix_up_user_copy(ureg_t *ureg_ptr) {
+    if (ureg_ptr->cs != SEGSEL_KERNEL_CS) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < user_copy_fixup_count; i++) {
+        if (user_copy_fixups[i].fault_eip == ureg_ptr->eip) {
+            ureg_ptr->eip = user_copy_fixups[i].fixup_eip;
+            return 0;
+        }
+    }
+    return -1;
+}
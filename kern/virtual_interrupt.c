@@ -20,6 +20,7 @@
 #include <common_kern.h> // USER_MEM_START
 #include <page.h> // PAGE_SIZE
 #include <vm.h> // USER_PAGE_START
+#include <vma.h> // is_vma_range
 #include <hvcall.h> // GUEST_CRASH_STATUS
 #include <asm.h> // outb
 #include <interrupt_defines.h> // INT_CTL_PORT
@@ -103,7 +104,8 @@ void handle_virtual_interrupt(ureg_t *ureg_ptr) {
     // lprintf("Interrupt %d is not handled for the guest.", interrupt)
 
     unsigned int interrupt = ureg_ptr->cause;
-    pcb_t *current_pcb_ptr = thread_lists[RUNNING_STATE]->data->pcb_ptr;
+    pcb_t *current_pcb_ptr =
+        Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
     if (interrupt == HV_INT) {
         unsigned int call_num = ureg_ptr->eax;
         if (
@@ -202,10 +204,9 @@ void handle_virtual_interrupt(ureg_t *ureg_ptr) {
         // Note that when a guest switches from guest kernel mode to guest
         // user mode, which pages it has permission to access must change
         // accordingly.
-        uint32_t cr3 = get_cr3();
-        pde_t *page_dir = (pde_t *)((cr3 >> PAGE_SHIFT) << PAGE_SHIFT);
+        pde_t *page_dir = (pde_t *)((get_cr3() >> PAGE_SHIFT) << PAGE_SHIFT);
         alter_page_dir(page_dir, true);
-        set_cr3(cr3);
+        invalidate_page_dir(page_dir);
 
         ureg_ptr->ss = SEGSEL_GUEST_KERNEL_DS;
         ureg_ptr->esp = esp - USER_MEM_START;
@@ -229,6 +230,9 @@ void handle_virtual_interrupt(ureg_t *ureg_ptr) {
  *        This is used to change page permissions accordingly when switching
  *        between guest kernel and guest user mode  
  * 
+ * Guest memory is mapped on demand, so pages that are not mapped yet
+ * are skipped. They will be mapped with the us bit set.
+ * 
  * @param page_dir address of the page directory
  * @param kernel_mode Permission level of the the page directory 
  * 
@@ -245,12 +249,13 @@ int alter_page_dir(pde_t *page_dir, bool kernel_mode) {
     ) {
         uint32_t pde_idx = (addr >> PAGE_SHIFT) / PTE_COUNT;
         if (page_dir[pde_idx].p != 1) {
-            return -1;
+            addr += LARGE_PAGE_SIZE - PAGE_SIZE;
+            continue;
         }
         pte_t *page_table = (pte_t *)(page_dir[pde_idx].pt_addr << PAGE_SHIFT);
         uint32_t pte_idx = (addr >> PAGE_SHIFT) % PTE_COUNT;
         if (page_table[pte_idx].p != 1) {
-            return -1;
+            continue;
         }
         page_table[pte_idx].us = kernel_mode ? 1 : 0;
     }
@@ -274,12 +279,14 @@ void handle_hv_magic(ureg_t *ureg_ptr) {
 }
 
 void handle_hv_disable_interrupts(ureg_t *ureg_ptr) {
-    pcb_t *current_pcb_ptr = thread_lists[RUNNING_STATE]->data->pcb_ptr;
+    pcb_t *current_pcb_ptr =
+        Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
     current_pcb_ptr->guest_resource.interrupt_enable_flag = false;
 }
 
 void handle_hv_enable_interrupts(ureg_t *ureg_ptr) {
-    pcb_t *current_pcb_ptr = thread_lists[RUNNING_STATE]->data->pcb_ptr;
+    pcb_t *current_pcb_ptr =
+        Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
     current_pcb_ptr->guest_resource.interrupt_enable_flag = true;
 }
 
@@ -292,7 +299,8 @@ void handle_hv_setidt(ureg_t *ureg_ptr) {
         return;
     }
 
-    pcb_t *current_pcb_ptr = thread_lists[RUNNING_STATE]->data->pcb_ptr;
+    pcb_t *current_pcb_ptr =
+        Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
     if (eip == NULL) {
         current_pcb_ptr->guest_resource.virtual_idt[irqno] = (uint32_t)NULL;
     } else {
@@ -319,7 +327,8 @@ void handle_hv_iret(ureg_t *ureg_ptr) {
     // Alter the registers to the values specified 
     ureg_ptr->eip = (uint32_t)eip;
     ureg_ptr->eflags = eflags | EFL_IF;
-    pcb_t *current_pcb_ptr = thread_lists[RUNNING_STATE]->data->pcb_ptr;
+    pcb_t *current_pcb_ptr =
+        Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
     current_pcb_ptr->guest_resource.interrupt_enable_flag =
         ((eflags & EFL_IF) != 0);
     ureg_ptr->esp = (uint32_t)esp;
@@ -441,7 +450,8 @@ void handle_hv_exit(ureg_t *ureg_ptr) {
     void **arg_array = (void **)(ureg_ptr->esp + USER_MEM_START);
     int status = (int)arg_array[0];
 
-    pcb_t *current_pcb_ptr = thread_lists[RUNNING_STATE]->data->pcb_ptr;
+    pcb_t *current_pcb_ptr =
+        Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
     current_pcb_ptr->status = status;
     ureg_t ureg = {.cause = 0};
     handle_vanish(&ureg);
@@ -471,18 +481,9 @@ bool is_host_writable(uint32_t addr, uint32_t size) {
             return false;
         }
 
-        pde_t *page_dir = (pde_t *)((get_cr3() >> PAGE_SHIFT) << PAGE_SHIFT);
-        for (
-            uint64_t i = (addr >> PAGE_SHIFT) << PAGE_SHIFT;
-            i < (uint64_t)addr + (uint64_t)size;
-            i += PAGE_SIZE
-        ) {
-            uint32_t access;
-            get_access(page_dir, i, &access);
-            if (access != READ_WRITE) {
-                return false;
-            }
-        }
+        // Pages not mapped yet will be given a frame on the first write.
+        pcb_t *pcb_ptr = Q_GET_FRONT(&(thread_lists[RUNNING_STATE]))->pcb_ptr;
+        return is_vma_range(pcb_ptr->vma_tree, addr, size, READ_WRITE);
     }
 
     return true;
@@ -1,26 +1,54 @@
 #include <vm.h> // pde_t
 #include <stdint.h> // uint32_t
-#include <list.h> // PUSH_BACK
 #include <page.h> // PAGE_SIZE
-#include <malloc.h> // smemalign
+#include <paging_pool.h> // alloc_paging_page
 #include <stddef.h> // NULL
 #include <string.h> // memset
 #include <stdbool.h> // bool
 #include <simics.h> // lprintf
 #include <mutex.h> // mutex_t
 #include <common_kern.h> // machine_phys_frames
+#include <limits.h> // CHAR_BIT
+#include <cr.h> // get_cr3
+#include <asm.h> // disable_interrupts
+#include <eflags.h> // get_eflags
+#include <invlpg_stub.h> // invlpg
+#include <swap.h> // reclaim_frames
 
 #define ZERO_FRAME (USER_PAGE_START)
+// how many physical frames the allocator can keep track of
+#define FRAME_COUNT_MAX (VIRTUAL_ADDR_END / PAGE_SIZE)
+// how many bits in a bitmap word
+#define WORD_BITS (sizeof(uint32_t) * CHAR_BIT)
+// how many levels the frame bitmap has
+#define FRAME_LEVEL_COUNT (4)
+// how many words in each level of the frame bitmap, from bottom to top
+#define FRAME_LEVEL0_LEN (FRAME_COUNT_MAX / WORD_BITS)
+#define FRAME_LEVEL1_LEN (FRAME_LEVEL0_LEN / WORD_BITS)
+#define FRAME_LEVEL2_LEN (FRAME_LEVEL1_LEN / WORD_BITS)
+#define FRAME_LEVEL3_LEN (FRAME_LEVEL2_LEN / WORD_BITS)
+// how many frames destruct_page_dir frees under one acquisition of vm_lock
+#define FREE_BATCH_LEN (64)
+// how many page directories may map a frame at the same time
+#define FRAME_REF_COUNT_MAX (UINT8_MAX)
+// how many zeroed frames are kept aside for page faults
+#define ZEROED_FRAME_POOL_LEN (128)
+// how many pages the kernel direct map has
+#define KERNEL_PAGE_COUNT (USER_PAGE_START / PAGE_SIZE)
+// how many page tables the kernel direct map needs
+#define KERNEL_PAGE_TABLE_COUNT ((KERNEL_PAGE_COUNT + PTE_COUNT - 1) / PTE_COUNT)
+// the PDEs of user memory end at the first one of the kernel window
+#define USER_PAGE_TABLE_END (USER_MEM_END / LARGE_PAGE_SIZE)
 
 typedef enum lookup_result_t { 
     NULL_PAGE_DIR,
     NONPRESENT_PDE,
     NONPRESENT_PTE,
-    PHYSICAL_FRAME_MAPPED
+    SWAPPED_PTE,
+    PHYSICAL_FRAME_MAPPED,
+    LARGE_FRAME_MAPPED
 } lookup_result_t;
 
-DEFINE_NODE_T(frame_node, uint32_t);
-
 /**
  * @brief This function attempts to get the PDE, the PTE and
  *        the physical frame related to a virtual address.
@@ -32,7 +60,8 @@ DEFINE_NODE_T(frame_node, uint32_t);
  *                       allocated.
  * @param pte_ptr_holder To hold the PTE pointer if not NULL.
  *                       Used only when the page directory is
- *                       allocated and the PDE is present.
+ *                       allocated and the PDE is present and
+ *                       points to a page table.
  * @param p_addr_holder To hold the physical address of the frame
  *                      if not NULL. Used only when the page
  *                      directory is allocated, both the PDE and
@@ -42,6 +71,11 @@ DEFINE_NODE_T(frame_node, uint32_t);
  *         but the PDE is not present.
  *         NONPRESENT_PTE if the page directory is allocated,
  *         the PDE is present but the PTE is not present.
+ *         SWAPPED_PTE if, in addition, the PTE points to a slot of the
+ *         compressed store.
+ *         LARGE_FRAME_MAPPED if the PDE maps a large page of the
+ *         kernel direct map, in which case p_addr_holder gets the frame
+ *         within it. User memory is never mapped with large pages.
  *         PHYSICAL_FRAME_MAPPED otherwise.
  */
 lookup_result_t find_frame (
@@ -52,9 +86,51 @@ lookup_result_t find_frame (
     uint32_t *p_addr_holder
 );
 
-// a pool of physical frames that can be allocated,
-// sorted in ascending order
-frame_node *alloc_list = NULL;
+// The physical frame allocator is a bitmap with one bit per frame, set
+// when the frame is free. Every level above summarizes the one below,
+// i.e., bit i of a word in level n + 1 is set when the ith word it covers
+// in level n is nonzero, so that a free frame can be found or released
+// with a constant number of word operations. The bitmap lives in .bss so
+// that the allocator never touches the kernel heap.
+uint32_t frame_level0[FRAME_LEVEL0_LEN];
+uint32_t frame_level1[FRAME_LEVEL1_LEN];
+uint32_t frame_level2[FRAME_LEVEL2_LEN];
+uint32_t frame_level3[FRAME_LEVEL3_LEN];
+uint32_t *frame_levels[FRAME_LEVEL_COUNT] = {
+    frame_level0,
+    frame_level1,
+    frame_level2,
+    frame_level3
+};
+// how many frames are free in the bitmap
+uint32_t free_frame_count = 0;
+// how many page directories map each allocated frame, indexed by the
+// frame number. Like the bitmap, it is sized for every frame there could
+// be, so that it stays out of the kernel heap.
+uint8_t frame_ref_counts[FRAME_COUNT_MAX];
+// Frames zeroed ahead of time. They are neither free in the bitmap nor
+// referenced by any page directory.
+uint32_t zeroed_frame_pool[ZEROED_FRAME_POOL_LEN];
+uint32_t zeroed_frame_count = 0;
+// How many frames are promised to pages that have none yet. Frames for
+// anything else come only from those above the promise.
+uint32_t reserved_frame_count = 0;
+// how many requests for a zeroed frame the pool has served or not
+uint32_t zeroed_frame_hit_count = 0;
+uint32_t zeroed_frame_miss_count = 0;
+// A page in the kernel image through which the kernel reaches frames
+// outside its direct map. It should be used only when interrupts are
+// disabled.
+uint8_t frame_window[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+// The kernel direct map consists of large pages, except for the part
+// around frame_window, which needs a PTE of its own. Every page directory
+// points at the same page table, so an edit to it shows in every address
+// space.
+pte_t window_page_table[PTE_COUNT] __attribute__((aligned(PAGE_SIZE)));
+// The page tables of the kernel window, as shared as window_page_table.
+// Only the pages the heap has grown into are present.
+pte_t kernel_window_page_tables[KERNEL_WINDOW_SIZE / PAGE_SIZE]
+    __attribute__((aligned(PAGE_SIZE)));
 // manage VM bookkeeping
 mutex_t vm_lock;
 
@@ -82,6 +158,32 @@ int init_allocator(void);
  */
 int alloc_frame(uint32_t *p_addr_ptr);
 
+/**
+ * @brief Allocate a number of physical frames at once.
+ * 
+ * Either all the frames are allocated or none is. The frames are not
+ * necessarily contiguous.
+ * 
+ * @param count How many frames to allocate.
+ * @param p_addr_array Where the physical addresses of the allocated
+ *                     frames will be stored.
+ * @return A negative value on failure, 0 otherwise.
+ */
+int alloc_frames(uint32_t count, uint32_t *p_addr_array);
+
+/**
+ * @brief Take a number of frames off the free ones, with a reference
+ *        each.
+ * 
+ * This function should be called only when vm_lock is held and at least
+ * count frames are unreserved.
+ * 
+ * @param count How many frames to take.
+ * @param p_addr_array Where the physical addresses of the frames will
+ *                     be stored.
+ */
+void take_free_frames(uint32_t count, uint32_t *p_addr_array);
+
 /**
  * @brief De-allocate a physical frame if it was allocated by
  *        physical frame allocator before.
@@ -91,6 +193,136 @@ int alloc_frame(uint32_t *p_addr_ptr);
  */
 int free_frame(uint32_t p_addr);
 
+// Similar to free_frame, except that a number of frames are de-allocated
+// under a single acquisition of vm_lock.
+int free_frames(uint32_t count, uint32_t *p_addr_array);
+
+/**
+ * @brief Record one more page directory mapping an allocated frame.
+ * 
+ * A frame stays allocated until free_frame has been called once for
+ * every reference taken, plus once for the allocation itself.
+ * 
+ * @param p_addr The physical address of the frame.
+ * @return A negative value if the frame is not allocated or its
+ *         reference count would overflow, 0 otherwise.
+ */
+int ref_frame(uint32_t p_addr);
+
+// get how many page directories map an allocated frame, 0 if the frame
+// is not allocated
+uint32_t get_frame_ref_count(uint32_t p_addr);
+
+/**
+ * @brief Allocate a physical frame filled with zeros if any.
+ * 
+ * The frame comes from the pool of zeroed frames when possible, and
+ * is cleared on the spot otherwise.
+ * 
+ * @param p_addr_ptr The pointer to the physical address of the
+ *                   allocated frame.
+ * @return A negative value on failure, 0 otherwise.
+ */
+int alloc_zeroed_frame(uint32_t *p_addr_ptr);
+
+// Similar to alloc_zeroed_frame, except that the frame is one of those
+// reserved by reserve_frames.
+int alloc_reserved_frame(uint32_t *p_addr_ptr);
+
+/**
+ * @brief Allocate a zeroed frame, either from the reserved frames or
+ *        from the rest.
+ * 
+ * @param p_addr_ptr The pointer to the physical address of the
+ *                   allocated frame.
+ * @param reserved Whether the frame is taken out of the reservation.
+ * @return A negative value on failure, 0 otherwise.
+ */
+int take_zeroed_frame(uint32_t *p_addr_ptr, bool reserved);
+
+// Give back a frame of alloc_reserved_frame and the reservation with it.
+void free_reserved_frame(uint32_t p_addr);
+
+// get how many frames can be handed out beyond the reserved ones, should
+// be called only when vm_lock is held
+uint32_t get_unreserved_frame_count(void);
+
+/**
+ * @brief Try to make a number of frames available beyond the reserved
+ *        ones by moving cold pages to the compressed store.
+ * 
+ * This function should be called only when vm_lock is held. The lock is
+ * released while pages are moved, so whatever was learned under it has
+ * to be learned again.
+ * 
+ * @param count How many frames are wanted.
+ */
+void make_room_for(uint32_t count);
+
+// test if a frame is handed out by the allocator and still referenced,
+// should be called only when vm_lock is held
+bool is_frame_allocated(uint32_t frame);
+
+/**
+ * @brief Point the frame window at a frame.
+ * 
+ * This function should be called only when interrupts are disabled.
+ * Pointing the window at itself puts it back.
+ * 
+ * @param p_addr The physical address of the frame.
+ */
+void point_frame_window(uint32_t p_addr);
+
+// Similar to copy_to_frame, except that the frame is filled with zeros.
+void clear_frame(uint32_t p_addr);
+
+/**
+ * @brief Map a user page to a given frame.
+ * 
+ * The page must not be mapped yet. A page table will be created if
+ * the PDE is not present. The page will be assigned read write
+ * access.
+ * 
+ * @param page_dir The page directory.
+ * @param v_addr The virtual address within the range of the virtual
+ *               page.
+ * @param p_addr The physical address of the frame.
+ * @return A negative value on failure, 0 otherwise.
+ */
+int map_frame(pde_t *page_dir, uint32_t v_addr, uint32_t p_addr);
+
+// test if a page directory is the one the MMU is walking
+bool is_current_page_dir(pde_t *page_dir);
+
+/**
+ * @brief Record in a batch that the TLB entry of a page may be stale.
+ * 
+ * @param page_dir The page directory whose PTE has changed.
+ * @param v_addr The virtual address within the range of the page.
+ * @param batch The batch of page_dir, or NULL to invalidate right away.
+ */
+void mark_page_stale(pde_t *page_dir, uint32_t v_addr, tlb_batch_t *batch);
+
+/**
+ * @brief Hand a frame over to a batch to be freed after the TLB is
+ *        clean.
+ * 
+ * The batch flushes on its own when it cannot hold any more frames.
+ * 
+ * @param batch The batch, or NULL to free right away.
+ * @param p_addr The physical address of the frame.
+ */
+void tlb_batch_add_frame(tlb_batch_t *batch, uint32_t p_addr);
+
+/**
+ * @brief Make a non-present PDE point to a newly allocated page table.
+ * 
+ * @param pde_ptr The PDE.
+ * @param v_addr A virtual address within the range of the PDE.
+ * @return The PTE of v_addr, or NULL on memory allocation failure.
+ */
+pte_t *make_page_table(pde_t *pde_ptr, uint32_t v_addr);
+
 /**
  * @brief Get the zero frame (concerning ZFOD).
  * 
@@ -98,6 +330,89 @@ int free_frame(uint32_t p_addr);
  */
 uint32_t get_zero_frame(void);
 
+/**
+ * @brief Mark a frame as free in every level of the bitmap.
+ * 
+ * This function should be called only when vm_lock is held.
+ * 
+ * @param frame_idx The frame number.
+ */
+void set_frame_bit(uint32_t frame_idx) {
+    uint32_t idx = frame_idx;
+    for (int level = 0; level < FRAME_LEVEL_COUNT; level++) {
+        uint32_t word_idx = idx / WORD_BITS;
+        bool was_empty = (frame_levels[level][word_idx] == 0);
+        frame_levels[level][word_idx] |= (uint32_t)1 << (idx % WORD_BITS);
+        // upper levels already know about this word
+        if (!was_empty) {
+            break;
+        }
+        idx = word_idx;
+    }
+}
+
+/**
+ * @brief Mark a frame as allocated in every level of the bitmap.
+ * 
+ * This function should be called only when vm_lock is held.
+ * 
+ * @param frame_idx The frame number.
+ */
+void clear_frame_bit(uint32_t frame_idx) {
+    uint32_t idx = frame_idx;
+    for (int level = 0; level < FRAME_LEVEL_COUNT; level++) {
+        uint32_t word_idx = idx / WORD_BITS;
+        frame_levels[level][word_idx] &= ~((uint32_t)1 << (idx % WORD_BITS));
+        // upper levels still see free frames under this word
+        if (frame_levels[level][word_idx] != 0) {
+            break;
+        }
+        idx = word_idx;
+    }
+}
+
+/**
+ * @brief Find the lowest free frame by descending the bitmap.
+ * 
+ * This function should be called only when vm_lock is held and
+ * free_frame_count is positive.
+ * 
+ * @return The frame number.
+ */
+uint32_t find_free_frame(void) {
+    uint32_t idx = 0;
+    for (int level = FRAME_LEVEL_COUNT - 1; level >= 0; level--) {
+        uint32_t word = frame_levels[level][idx];
+        idx = idx * WORD_BITS + __builtin_ctz(word);
+    }
+    return idx;
+}
+
+// test if a frame is free, should be called only when vm_lock is held
+bool is_frame_free(uint32_t frame_idx) {
+    return (
+        frame_level0[frame_idx / WORD_BITS] >> (frame_idx % WORD_BITS)
+    ) & 1;
+}
+
+// test if a physical address lies in a frame the allocator gives out
+bool is_allocatable(uint32_t frame) {
+    return (
+        frame >= USER_PAGE_START &&
+        frame != ZERO_FRAME &&
+        frame / PAGE_SIZE < machine_phys_frames()
+    );
+}
+
+bool is_frame_allocated(uint32_t frame) {
+    uint32_t frame_idx = frame / PAGE_SIZE;
+    return (
+        is_allocatable(frame) &&
+        !is_frame_free(frame_idx) &&
+        frame_ref_counts[frame_idx] > 0
+    );
+}
+
 int init_allocator(void) {
     mutex_init(&vm_lock);
 
@@ -106,20 +421,17 @@ int init_allocator(void) {
     if (frame_count <= 0) {
         return -1;
     }
+    if (machine_phys_frames() > FRAME_COUNT_MAX) {
+        return -1;
+    }
     for (int i = 0; i < frame_count; i++)
     {
         uint32_t frame = USER_PAGE_START + i * PAGE_SIZE;
         if (frame == ZERO_FRAME) {
             continue;
         }
-        bool success;
-        PUSH_BACK(frame_node, alloc_list, frame, success);
-        if (!success) {
-            while (alloc_list != NULL) {
-                POP_BACK(frame_node, alloc_list);
-            }
-            return -1;
-        }
+        set_frame_bit(frame / PAGE_SIZE);
+        free_frame_count++;
     }
 
     // zero out the zero frame
@@ -133,244 +445,1027 @@ int alloc_frame(uint32_t *p_addr_ptr){
     if (p_addr_ptr == NULL) {
         return -1;
     }
-    
+    return alloc_frames(1, p_addr_ptr);
+}
+
+int alloc_frames(uint32_t count, uint32_t *p_addr_array) {
+    if (p_addr_array == NULL) {
+        return -1;
+    }
+
     mutex_lock(&vm_lock);
-    if (alloc_list == NULL) {
+    make_room_for(count);
+    if (count > get_unreserved_frame_count()) {
         mutex_unlock(&vm_lock);
         return -1;
     }
-
-    *p_addr_ptr = alloc_list->data;
-    POP_FRONT(frame_node, alloc_list);
+    take_free_frames(count, p_addr_array);
     mutex_unlock(&vm_lock);
     return 0;
 }
 
-int free_frame(uint32_t p_addr){
-    uint32_t frame = (p_addr >> PAGE_SHIFT) << PAGE_SHIFT;
-    if (frame >= USER_PAGE_START && frame != ZERO_FRAME) {
-        mutex_lock(&vm_lock);
-        if (alloc_list == NULL || alloc_list->data > frame) {
-            bool success;
-            PUSH_FRONT(frame_node, alloc_list, frame, success);
-            if (!success) {
-                mutex_unlock(&vm_lock);
-                return -1;
-            }
+void take_free_frames(uint32_t count, uint32_t *p_addr_array) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t frame_idx;
+        if (free_frame_count > 0) {
+            frame_idx = find_free_frame();
+            clear_frame_bit(frame_idx);
+            free_frame_count--;
         } else {
-            frame_node *node = alloc_list;
-            while (node->next != alloc_list && node->next->data <= frame) {
-                node = node->next;
-            }
-            // double check if the frame exists in the pool
-            if (node->data != frame) {
-                node = node->next;
-                bool success;
-                PUSH_FRONT(frame_node, node, frame, success);
-                if (!success) {
-                    mutex_unlock(&vm_lock);
-                    return -1;
-                }
-            }
+            // zeroed frames are the last resort of those that need not be
+            frame_idx = zeroed_frame_pool[--zeroed_frame_count] / PAGE_SIZE;
         }
+        frame_ref_counts[frame_idx] = 1;
+        p_addr_array[i] = frame_idx << PAGE_SHIFT;
+    }
+}
+
+int alloc_zeroed_frame(uint32_t *p_addr_ptr) {
+    return take_zeroed_frame(p_addr_ptr, false);
+}
+
+int alloc_reserved_frame(uint32_t *p_addr_ptr) {
+    return take_zeroed_frame(p_addr_ptr, true);
+}
+
+int take_zeroed_frame(uint32_t *p_addr_ptr, bool reserved) {
+    if (p_addr_ptr == NULL) {
+        return -1;
+    }
+
+    mutex_lock(&vm_lock);
+    if (!reserved) {
+        make_room_for(1);
+    }
+    uint32_t available_count = reserved ?
+        reserved_frame_count : get_unreserved_frame_count();
+    if (available_count == 0) {
         mutex_unlock(&vm_lock);
+        return -1;
+    }
+    if (reserved) {
+        reserved_frame_count--;
+    }
+    if (zeroed_frame_count > 0) {
+        uint32_t frame = zeroed_frame_pool[--zeroed_frame_count];
+        frame_ref_counts[frame / PAGE_SIZE] = 1;
+        zeroed_frame_hit_count++;
+        mutex_unlock(&vm_lock);
+        *p_addr_ptr = frame;
+        return 0;
     }
+    zeroed_frame_miss_count++;
+    uint32_t frame_idx = find_free_frame();
+    clear_frame_bit(frame_idx);
+    free_frame_count--;
+    frame_ref_counts[frame_idx] = 1;
+    mutex_unlock(&vm_lock);
+
+    *p_addr_ptr = frame_idx << PAGE_SHIFT;
+    clear_frame(*p_addr_ptr);
     return 0;
 }
 
-uint32_t get_zero_frame(void) {
-    return ZERO_FRAME;
+void free_reserved_frame(uint32_t p_addr) {
+    mutex_lock(&vm_lock);
+    reserved_frame_count++;
+    mutex_unlock(&vm_lock);
+    free_frame(p_addr);
 }
 
-int init_page_dir_manager(void) {
-    if (init_allocator() < 0) {
+uint32_t get_unreserved_frame_count(void) {
+    return free_frame_count + zeroed_frame_count - reserved_frame_count;
+}
+
+void make_room_for(uint32_t count) {
+    uint32_t available_count = get_unreserved_frame_count();
+    if (count <= available_count) {
+        return;
+    }
+    // reclaim_frames frees what it takes through free_frame
+    mutex_unlock(&vm_lock);
+    reclaim_frames(count - available_count);
+    mutex_lock(&vm_lock);
+}
+
+int reserve_frames(uint32_t count) {
+    mutex_lock(&vm_lock);
+    make_room_for(count);
+    if (count > get_unreserved_frame_count()) {
+        mutex_unlock(&vm_lock);
         return -1;
     }
-    lprintf("Page directory manager is initialized.");
+    reserved_frame_count += count;
+    mutex_unlock(&vm_lock);
     return 0;
 }
 
-pde_t *construct_page_dir(void) {
-    pde_t *page_dir = smemalign(PAGE_SIZE, PAGE_SIZE);
-    if (page_dir == NULL) {
-        return NULL;
+void unreserve_frames(uint32_t count) {
+    mutex_lock(&vm_lock);
+    reserved_frame_count -= count;
+    mutex_unlock(&vm_lock);
+}
+
+void refill_zeroed_frames(uint32_t budget) {
+    // never wait for the lock, since this runs in interrupt context
+    if (mutex_try_lock(&vm_lock) < 0) {
+        return;
+    }
+    for (
+        uint32_t i = 0;
+        i < budget &&
+        zeroed_frame_count < ZEROED_FRAME_POOL_LEN &&
+        free_frame_count > 0;
+        i++
+    ) {
+        uint32_t frame_idx = find_free_frame();
+        clear_frame_bit(frame_idx);
+        free_frame_count--;
+        clear_frame(frame_idx << PAGE_SHIFT);
+        zeroed_frame_pool[zeroed_frame_count++] = frame_idx << PAGE_SHIFT;
     }
+    mutex_unlock(&vm_lock);
+}
 
-    uint32_t kernel_page_count = USER_PAGE_START / PAGE_SIZE;
-    uint32_t kernel_page_table_count = (kernel_page_count + PTE_COUNT - 1) /
-        PTE_COUNT;
+void get_zeroed_frame_stats(uint32_t *hit_count_ptr, uint32_t *miss_count_ptr) {
+    mutex_lock(&vm_lock);
+    if (hit_count_ptr != NULL) {
+        *hit_count_ptr = zeroed_frame_hit_count;
+    }
+    if (miss_count_ptr != NULL) {
+        *miss_count_ptr = zeroed_frame_miss_count;
+    }
+    mutex_unlock(&vm_lock);
+}
 
-    for (uint32_t i = 0; i < kernel_page_table_count; i++) {
-        pte_t *pt = (pte_t *)smemalign(PAGE_SIZE, PAGE_SIZE);
-        if (pt == NULL) {
-            for (uint32_t j = 0; j < i; j++) {
-                sfree((void *)(page_dir[j].pt_addr << PAGE_SHIFT), PAGE_SIZE);
-            }
-            sfree(page_dir, PAGE_SIZE);
-            return NULL;
-        }
-        
-        for (uint32_t j = 0; j < PTE_COUNT; j++) {
-            uint32_t page_idx = i * PTE_COUNT + j;
-            // With no pre-assumption, the kernel address space may not
-            // be page directory aligned.
-            if (page_idx < kernel_page_count) {
-                pt[j] = (pte_t){
-                    .page_addr = page_idx,
-                    .p = 1,
-                    .g = 1,
-                    .rw = READ_WRITE
-                };
-            } else {
-                pt[j] = (pte_t){
-                    .p = 0
-                };
+int free_frame(uint32_t p_addr){
+    return free_frames(1, &p_addr);
+}
+
+int free_frames(uint32_t count, uint32_t *p_addr_array) {
+    if (p_addr_array == NULL) {
+        return -1;
+    }
+
+    mutex_lock(&vm_lock);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t frame = (p_addr_array[i] >> PAGE_SHIFT) << PAGE_SHIFT;
+        uint32_t frame_idx = frame / PAGE_SIZE;
+        // double check if the frame has been handed out
+        if (is_frame_allocated(frame)) {
+            // shared frames are kept for their other users
+            frame_ref_counts[frame_idx]--;
+            if (frame_ref_counts[frame_idx] == 0) {
+                set_frame_bit(frame_idx);
+                free_frame_count++;
             }
         }
-        bool user_page_involved = (i + 1) * PTE_COUNT > kernel_page_count;
-        page_dir[i] = (pde_t){
-            .pt_addr = ((uint32_t)pt) >> PAGE_SHIFT,
-            .g = user_page_involved ? 0 : 1,
-            .us = user_page_involved ? 1 : 0,
-            .p = 1,
-            .rw = READ_WRITE
-        };
     }
+    mutex_unlock(&vm_lock);
+    return 0;
+}
 
-    for (uint32_t i = kernel_page_table_count; i < PDE_COUNT; i++) {
-        page_dir[i] = (pde_t){
-            .p = 0
-        };
+int ref_frame(uint32_t p_addr) {
+    uint32_t frame = (p_addr >> PAGE_SHIFT) << PAGE_SHIFT;
+    uint32_t frame_idx = frame / PAGE_SIZE;
+    mutex_lock(&vm_lock);
+    if (
+        !is_frame_allocated(frame) ||
+        frame_ref_counts[frame_idx] == FRAME_REF_COUNT_MAX
+    ) {
+        mutex_unlock(&vm_lock);
+        return -1;
     }
-    
-    return page_dir;
+    frame_ref_counts[frame_idx]++;
+    mutex_unlock(&vm_lock);
+    return 0;
 }
 
-void destruct_page_dir(pde_t *page_dir) {
-    if (page_dir == NULL) {
+uint32_t get_frame_ref_count(uint32_t p_addr) {
+    uint32_t frame = (p_addr >> PAGE_SHIFT) << PAGE_SHIFT;
+    uint32_t frame_idx = frame / PAGE_SIZE;
+    uint32_t ref_count = 0;
+    mutex_lock(&vm_lock);
+    if (is_frame_allocated(frame)) {
+        ref_count = frame_ref_counts[frame_idx];
+    }
+    mutex_unlock(&vm_lock);
+    return ref_count;
+}
+
+void point_frame_window(uint32_t p_addr) {
+    uint32_t window_page_idx = (uint32_t)frame_window >> PAGE_SHIFT;
+    window_page_table[window_page_idx % PTE_COUNT].page_addr =
+        p_addr >> PAGE_SHIFT;
+    invlpg(frame_window);
+}
+
+void copy_to_frame(uint32_t p_addr, const void *src) {
+    // Borrow the window for the copy. No other thread may see it
+    // pointing to somewhere else.
+    bool interrupt_enable_flag = ((get_eflags() & EFL_IF) != 0);
+    disable_interrupts();
+    point_frame_window(p_addr);
+    memcpy(frame_window, src, PAGE_SIZE);
+    point_frame_window((uint32_t)frame_window);
+    if (interrupt_enable_flag) {
+        enable_interrupts();
+    }
+}
+
+void copy_from_frame(void *dst, uint32_t p_addr) {
+    bool interrupt_enable_flag = ((get_eflags() & EFL_IF) != 0);
+    disable_interrupts();
+    point_frame_window(p_addr);
+    memcpy(dst, frame_window, PAGE_SIZE);
+    point_frame_window((uint32_t)frame_window);
+    if (interrupt_enable_flag) {
+        enable_interrupts();
+    }
+}
+
+void clear_frame(uint32_t p_addr) {
+    bool interrupt_enable_flag = ((get_eflags() & EFL_IF) != 0);
+    disable_interrupts();
+    point_frame_window(p_addr);
+    memset(frame_window, 0, PAGE_SIZE);
+    point_frame_window((uint32_t)frame_window);
+    if (interrupt_enable_flag) {
+        enable_interrupts();
+    }
+}
+
+bool is_current_page_dir(pde_t *page_dir) {
+    return (get_cr3() >> PAGE_SHIFT) << PAGE_SHIFT == (uint32_t)page_dir;
+}
+
+void tlb_batch_init(tlb_batch_t *batch, pde_t *page_dir) {
+    batch->page_dir = page_dir;
+    batch->page_count = 0;
+    batch->full_flush = false;
+    batch->frame_count = 0;
+}
+
+void mark_page_stale(pde_t *page_dir, uint32_t v_addr, tlb_batch_t *batch) {
+    if (batch == NULL) {
+        invalidate_page(page_dir, v_addr);
         return;
     }
-    uint32_t kernel_page_count = USER_PAGE_START / PAGE_SIZE;
-    for (uint32_t i = 0; i < PDE_COUNT; i++) {
-        if (page_dir[i].p == 1) {
-            pte_t *page_table = (pte_t *)(page_dir[i].pt_addr << PAGE_SHIFT);
-            for (uint32_t j = 0; j < PTE_COUNT; j++) {
-                if (
-                    page_table[j].p == 1 &&
-                    (i * PTE_COUNT + j) >= kernel_page_count
-                ) {
-                    free_frame(page_table[j].page_addr << PAGE_SHIFT);
-                }
+    if (batch->page_count < TLB_BATCH_PAGE_COUNT_MAX) {
+        batch->page_array[batch->page_count++] = v_addr;
+    } else {
+        batch->full_flush = true;
+    }
+}
+
+void tlb_batch_add_frame(tlb_batch_t *batch, uint32_t p_addr) {
+    if (batch == NULL) {
+        free_frame(p_addr);
+        return;
+    }
+    if (batch->frame_count == TLB_BATCH_FRAME_COUNT_MAX) {
+        tlb_batch_flush(batch);
+    }
+    batch->frame_array[batch->frame_count++] = p_addr;
+}
+
+void tlb_batch_flush(tlb_batch_t *batch) {
+    if (is_current_page_dir(batch->page_dir)) {
+        if (batch->full_flush) {
+            invalidate_page_dir(batch->page_dir);
+        } else {
+            for (uint32_t i = 0; i < batch->page_count; i++) {
+                invlpg((void *)batch->page_array[i]);
             }
-            sfree(page_table, PAGE_SIZE);
         }
     }
-    sfree(page_dir, PAGE_SIZE);
+    free_frames(batch->frame_count, batch->frame_array);
+    tlb_batch_init(batch, batch->page_dir);
+}
+
+void invalidate_page(pde_t *page_dir, uint32_t v_addr) {
+    if (is_current_page_dir(page_dir)) {
+        invlpg((void *)v_addr);
+    }
+}
+
+void invalidate_page_dir(pde_t *page_dir) {
+    if (is_current_page_dir(page_dir)) {
+        // Reloading CR3 leaves global, i.e., kernel, entries alone.
+        set_cr3(get_cr3());
+    }
+}
+
+pte_t *make_page_table(pde_t *pde_ptr, uint32_t v_addr) {
+    pte_t *page_table = (pte_t *)alloc_paging_page();
+    if (page_table == NULL) {
+        return NULL;
+    }
+    *pde_ptr = (pde_t){
+        .pt_addr = ((uint32_t)page_table) >> PAGE_SHIFT,
+        .us = 1,
+        .p = 1,
+        .rw = READ_WRITE
+    };
+    return &(page_table[(v_addr >> PAGE_SHIFT) % PTE_COUNT]);
+}
+
+uint32_t get_zero_frame(void) {
+    return ZERO_FRAME;
+}
+
+int init_page_dir_manager(void) {
+    // A page table is either the kernel's, shared by every page directory,
+    // or a process's own, never a mix.
+    if (USER_PAGE_START % (PTE_COUNT * PAGE_SIZE) != 0) {
+        return -1;
+    }
+    if (init_allocator() < 0) {
+        return -1;
+    }
+
+    // direct map the large page around frame_window with small pages
+    uint32_t window_pde_idx = ((uint32_t)frame_window >> PAGE_SHIFT) /
+        PTE_COUNT;
+    for (uint32_t i = 0; i < PTE_COUNT; i++) {
+        window_page_table[i] = (pte_t){
+            .page_addr = window_pde_idx * PTE_COUNT + i,
+            .p = 1,
+            .g = 1,
+            .rw = READ_WRITE
+        };
+    }
+
+    lprintf("Page directory manager is initialized.");
+    return 0;
+}
+
+pde_t *construct_page_dir(void) {
+    pde_t *page_dir = alloc_paging_page();
+    if (page_dir == NULL) {
+        return NULL;
+    }
+
+    // direct map the kernel address space
+    uint32_t window_pde_idx = ((uint32_t)frame_window >> PAGE_SHIFT) /
+        PTE_COUNT;
+    for (uint32_t i = 0; i < KERNEL_PAGE_TABLE_COUNT; i++) {
+        if (i == window_pde_idx) {
+            page_dir[i] = (pde_t){
+                .pt_addr = ((uint32_t)window_page_table) >> PAGE_SHIFT,
+                .p = 1,
+                .rw = READ_WRITE
+            };
+        } else {
+            page_dir[i] = (pde_t){
+                .pt_addr = i * PTE_COUNT,
+                .g = 1,
+                .ps = 1,
+                .p = 1,
+                .rw = READ_WRITE
+            };
+        }
+    }
+
+    for (uint32_t i = KERNEL_PAGE_TABLE_COUNT; i < USER_PAGE_TABLE_END; i++) {
+        page_dir[i] = (pde_t){
+            .p = 0
+        };
+    }
+
+    // share the page tables of the kernel window
+    for (uint32_t i = USER_PAGE_TABLE_END; i < PDE_COUNT; i++) {
+        pte_t *page_table = &(
+            kernel_window_page_tables[(i - USER_PAGE_TABLE_END) * PTE_COUNT]
+        );
+        page_dir[i] = (pde_t){
+            .pt_addr = ((uint32_t)page_table) >> PAGE_SHIFT,
+            .p = 1,
+            .rw = READ_WRITE
+        };
+    }
+    
+    return page_dir;
+}
+
+void destruct_page_dir(pde_t *page_dir) {
+    if (page_dir == NULL) {
+        return;
+    }
+    // frames are handed back to the allocator in batches
+    uint32_t batch[FREE_BATCH_LEN];
+    uint32_t batch_len = 0;
+    // the kernel page tables are shared, so they are left alone
+    for (uint32_t i = KERNEL_PAGE_TABLE_COUNT; i < USER_PAGE_TABLE_END; i++) {
+        if (page_dir[i].p == 1) {
+            pte_t *page_table = (pte_t *)(page_dir[i].pt_addr << PAGE_SHIFT);
+            for (uint32_t j = 0; j < PTE_COUNT; j++) {
+                if (page_table[j].p == 1) {
+                    batch[batch_len++] = page_table[j].page_addr << PAGE_SHIFT;
+                    if (batch_len == FREE_BATCH_LEN) {
+                        free_frames(batch_len, batch);
+                        batch_len = 0;
+                    }
+                } else if (page_table[j].available == PAGE_SWAPPED) {
+                    free_swap_slot(page_table[j].page_addr);
+                }
+            }
+            free_paging_page(page_table);
+        }
+    }
+    free_frames(batch_len, batch);
+    free_paging_page(page_dir);
+}
+
+int map_kernel_window(uint32_t v_addr, uint32_t count) {
+    if (
+        v_addr % PAGE_SIZE != 0 ||
+        v_addr < KERNEL_WINDOW_START ||
+        count > (VIRTUAL_ADDR_END - v_addr) / PAGE_SIZE
+    ) {
+        return -1;
+    }
+
+    mutex_lock(&vm_lock);
+    if (count > get_unreserved_frame_count()) {
+        mutex_unlock(&vm_lock);
+        return -1;
+    }
+    pte_t *pte_ptr = &(
+        kernel_window_page_tables[(v_addr - KERNEL_WINDOW_START) >> PAGE_SHIFT]
+    );
+    uint32_t batch[FREE_BATCH_LEN];
+    while (count > 0) {
+        uint32_t batch_len = count < FREE_BATCH_LEN ? count : FREE_BATCH_LEN;
+        take_free_frames(batch_len, batch);
+        // No TLB entry needs invalidating, since the PTEs were not present.
+        for (uint32_t i = 0; i < batch_len; i++) {
+            *(pte_ptr++) = (pte_t){
+                .page_addr = batch[i] >> PAGE_SHIFT,
+                .p = 1,
+                .g = 1,
+                .rw = READ_WRITE
+            };
+        }
+        count -= batch_len;
+    }
+    mutex_unlock(&vm_lock);
+    return 0;
+}
+
+int map_new_frame(pde_t *page_dir, uint32_t v_addr) {
+    uint32_t p_addr;
+    if (alloc_zeroed_frame(&p_addr) < 0) {
+        return -1;
+    }
+    if (map_frame(page_dir, v_addr, p_addr) < 0) {
+        free_frame(p_addr);
+        return -1;
+    }
+    return 0;
+}
+
+int map_reserved_frame(pde_t *page_dir, uint32_t v_addr) {
+    uint32_t p_addr;
+    if (alloc_reserved_frame(&p_addr) < 0) {
+        return -1;
+    }
+    if (map_frame(page_dir, v_addr, p_addr) < 0) {
+        free_reserved_frame(p_addr);
+        return -1;
+    }
+    return 0;
+}
+
+int map_frame(pde_t *page_dir, uint32_t v_addr, uint32_t p_addr) {
+    if (page_dir == NULL) {
+        return -1;
+    }
+    uint32_t page = (v_addr >> PAGE_SHIFT) << PAGE_SHIFT;
+    if (page < USER_PAGE_START) {
+        return -1;
+    }
+    pde_t *pde_ptr;
+    pte_t *pte_ptr;
+    lookup_result_t lookup_result = find_frame(
+        page_dir,
+        v_addr,
+        &pde_ptr,
+        &pte_ptr,
+        NULL
+    );
+    // Should be either NONPRESENT_PDE or NONPRESENT_PTE.
+    // In the former case, a page table will be created.
+    if (lookup_result == NONPRESENT_PDE) {
+        pte_ptr = make_page_table(pde_ptr, v_addr);
+        if (pte_ptr == NULL) {
+            return -1;
+        }
+    } else {
+        if (lookup_result != NONPRESENT_PTE) {
+            return -1;
+        }
+    }
+    *pte_ptr = (pte_t){
+        .p = 1,
+        .page_addr = p_addr >> PAGE_SHIFT,
+        .us = 1,
+        .rw = READ_WRITE
+    };
+    return 0;
+}
+
+int map_zero_frame(pde_t *page_dir, uint32_t v_addr) {
+    if (page_dir == NULL) {
+        return -1;
+    }
+    uint32_t page = (v_addr >> PAGE_SHIFT) << PAGE_SHIFT;
+    if (page < USER_PAGE_START) {
+        return -1;
+    }
+    pde_t *pde_ptr;
+    pte_t *pte_ptr;
+    lookup_result_t lookup_result = find_frame(
+        page_dir,
+        v_addr,
+        &pde_ptr,
+        &pte_ptr,
+        NULL
+    );
+    // Should be either NONPRESENT_PDE or NONPRESENT_PTE.
+    // In the former case, a page table will be created.
+    if (lookup_result == NONPRESENT_PDE) {
+        pte_ptr = make_page_table(pde_ptr, v_addr);
+        if (pte_ptr == NULL) {
+            return -1;
+        }
+    } else {
+        if (lookup_result != NONPRESENT_PTE) {
+            return -1;
+        }
+    }
+    *pte_ptr = (pte_t){
+        .p = 1,
+        .page_addr = get_zero_frame() >> PAGE_SHIFT,
+        .us = 1,
+        .rw = READ_ONLY
+    };
+    return 0;
+}
+
+int map_shared_frame(pde_t *page_dir, uint32_t v_addr, uint32_t p_addr) {
+    if (page_dir == NULL) {
+        return -1;
+    }
+    uint32_t page = (v_addr >> PAGE_SHIFT) << PAGE_SHIFT;
+    if (page < USER_PAGE_START) {
+        return -1;
+    }
+    pde_t *pde_ptr;
+    pte_t *pte_ptr;
+    lookup_result_t lookup_result = find_frame(
+        page_dir,
+        v_addr,
+        &pde_ptr,
+        &pte_ptr,
+        NULL
+    );
+    // Should be either NONPRESENT_PDE or NONPRESENT_PTE.
+    // In the former case, a page table will be created.
+    if (lookup_result == NONPRESENT_PDE) {
+        pte_ptr = make_page_table(pde_ptr, v_addr);
+        if (pte_ptr == NULL) {
+            return -1;
+        }
+    } else {
+        if (lookup_result != NONPRESENT_PTE) {
+            return -1;
+        }
+    }
+    if (ref_frame(p_addr) < 0) {
+        return -1;
+    }
+    *pte_ptr = (pte_t){
+        .p = 1,
+        .page_addr = p_addr >> PAGE_SHIFT,
+        .us = 1,
+        .rw = READ_ONLY
+    };
+    return 0;
+}
+
+int ref_mapped_frame(pde_t *page_dir, uint32_t v_addr, uint32_t *p_addr_ptr) {
+    if (page_dir == NULL || p_addr_ptr == NULL) {
+        return -1;
+    }
+    uint32_t page = (v_addr >> PAGE_SHIFT) << PAGE_SHIFT;
+    if (page < USER_PAGE_START) {
+        return -1;
+    }
+    uint32_t p_addr;
+    if (find_frame(
+        page_dir,
+        v_addr,
+        NULL,
+        NULL,
+        &p_addr
+    ) != PHYSICAL_FRAME_MAPPED) {
+        return -1;
+    }
+    p_addr = (p_addr >> PAGE_SHIFT) << PAGE_SHIFT;
+    // the zero frame is never handed out by the allocator
+    if (p_addr == get_zero_frame() || ref_frame(p_addr) < 0) {
+        return -1;
+    }
+    *p_addr_ptr = p_addr;
+    return 0;
+}
+
+void unref_frame(uint32_t p_addr) {
+    free_frames(1, &p_addr);
+}
+
+int find_cold_frame(pde_t *page_dir, uint32_t v_addr, uint32_t *p_addr_ptr) {
+    if (page_dir == NULL || p_addr_ptr == NULL) {
+        return -1;
+    }
+    uint32_t page = (v_addr >> PAGE_SHIFT) << PAGE_SHIFT;
+    if (page < USER_PAGE_START) {
+        return -1;
+    }
+    pte_t *pte_ptr;
+    uint32_t p_addr;
+    if (find_frame(
+        page_dir,
+        v_addr,
+        NULL,
+        &pte_ptr,
+        &p_addr
+    ) != PHYSICAL_FRAME_MAPPED) {
+        return -1;
+    }
+    if (
+        p_addr == get_zero_frame() ||
+        pte_ptr->available != PAGE_PRIVATE ||
+        get_frame_ref_count(p_addr) != 1
+    ) {
+        return -1;
+    }
+    // The TLB entry has to go whenever a bit is cleared, or the MMU would
+    // not set the bit again on the next access.
+    if (pte_ptr->accessed == 1) {
+        pte_ptr->accessed = 0;
+        invalidate_page(page_dir, page);
+        return -1;
+    }
+    // a write from now on shows up as the dirty bit
+    pte_ptr->dirty = 0;
+    invalidate_page(page_dir, page);
+    *p_addr_ptr = p_addr;
+    return 0;
+}
+
+int swap_out_frame(
+    pde_t *page_dir,
+    uint32_t v_addr,
+    uint32_t p_addr,
+    uint32_t slot
+) {
+    if (page_dir == NULL) {
+        return -1;
+    }
+    uint32_t page = (v_addr >> PAGE_SHIFT) << PAGE_SHIFT;
+    if (page < USER_PAGE_START) {
+        return -1;
+    }
+    // No thread may touch the page between the test and the update.
+    bool interrupt_enable_flag = ((get_eflags() & EFL_IF) != 0);
+    disable_interrupts();
+    pte_t *pte_ptr;
+    uint32_t mapped_p_addr;
+    if (
+        find_frame(
+            page_dir,
+            v_addr,
+            NULL,
+            &pte_ptr,
+            &mapped_p_addr
+        ) != PHYSICAL_FRAME_MAPPED ||
+        mapped_p_addr != p_addr ||
+        pte_ptr->accessed == 1 ||
+        pte_ptr->dirty == 1
+    ) {
+        if (interrupt_enable_flag) {
+            enable_interrupts();
+        }
+        return -1;
+    }
+    *pte_ptr = (pte_t){
+        .p = 0,
+        .available = PAGE_SWAPPED,
+        .page_addr = slot
+    };
+    if (interrupt_enable_flag) {
+        enable_interrupts();
+    }
+    invalidate_page(page_dir, page);
+    free_frame(p_addr);
+    return 0;
+}
+
+int swap_in_frame(
+    pde_t *page_dir,
+    uint32_t v_addr,
+    const void *src,
+    uint32_t access
+) {
+    uint32_t slot;
+    if (get_swap_slot(page_dir, v_addr, &slot) < 0) {
+        return -1;
+    }
+    uint32_t p_addr;
+    if (alloc_frame(&p_addr) < 0) {
+        return -1;
+    }
+    copy_to_frame(p_addr, src);
+    // The allocation may have moved pages to the store, though not this
+    // one, as long as the caller holds the lock of the process.
+    pte_t *pte_ptr;
+    uint32_t new_slot;
+    if (
+        get_swap_slot(page_dir, v_addr, &new_slot) < 0 ||
+        new_slot != slot ||
+        find_frame(page_dir, v_addr, NULL, &pte_ptr, NULL) != SWAPPED_PTE
+    ) {
+        free_frame(p_addr);
+        return -1;
+    }
+    // the TLB never caches a nonpresent PTE
+    *pte_ptr = (pte_t){
+        .p = 1,
+        .page_addr = p_addr >> PAGE_SHIFT,
+        .us = 1,
+        .rw = access
+    };
+    return 0;
+}
+
+int get_swap_slot(pde_t *page_dir, uint32_t v_addr, uint32_t *slot_ptr) {
+    if (page_dir == NULL || slot_ptr == NULL) {
+        return -1;
+    }
+    pte_t *pte_ptr;
+    if (find_frame(
+        page_dir,
+        v_addr,
+        NULL,
+        &pte_ptr,
+        NULL
+    ) != SWAPPED_PTE) {
+        return -1;
+    }
+    *slot_ptr = pte_ptr->page_addr;
+    return 0;
+}
+
+int map_swap_slot(pde_t *page_dir, uint32_t v_addr, uint32_t slot) {
+    if (page_dir == NULL) {
+        return -1;
+    }
+    uint32_t page = (v_addr >> PAGE_SHIFT) << PAGE_SHIFT;
+    if (page < USER_PAGE_START) {
+        return -1;
+    }
+    pde_t *pde_ptr;
+    pte_t *pte_ptr;
+    lookup_result_t lookup_result = find_frame(
+        page_dir,
+        v_addr,
+        &pde_ptr,
+        &pte_ptr,
+        NULL
+    );
+    if (lookup_result == NONPRESENT_PDE) {
+        pte_ptr = make_page_table(pde_ptr, v_addr);
+        if (pte_ptr == NULL) {
+            return -1;
+        }
+    } else if (lookup_result != NONPRESENT_PTE) {
+        return -1;
+    }
+    *pte_ptr = (pte_t){
+        .p = 0,
+        .available = PAGE_SWAPPED,
+        .page_addr = slot
+    };
+    return 0;
+}
+
+int unmap_swap_slot(pde_t *page_dir, uint32_t v_addr) {
+    if (page_dir == NULL) {
+        return -1;
+    }
+    pte_t *pte_ptr;
+    if (find_frame(
+        page_dir,
+        v_addr,
+        NULL,
+        &pte_ptr,
+        NULL
+    ) != SWAPPED_PTE) {
+        return -1;
+    }
+    // the TLB never caches a nonpresent PTE
+    *pte_ptr = (pte_t){
+        .p = 0
+    };
+    return 0;
 }
 
-int map_new_frame(pde_t *page_dir, uint32_t v_addr) {
-    if (page_dir == NULL) {
+int find_mergeable_frame(
+    pde_t *page_dir,
+    uint32_t v_addr,
+    uint32_t *p_addr_ptr
+) {
+    if (page_dir == NULL || p_addr_ptr == NULL) {
         return -1;
     }
     uint32_t page = (v_addr >> PAGE_SHIFT) << PAGE_SHIFT;
     if (page < USER_PAGE_START) {
         return -1;
     }
-    pde_t *pde_ptr;
     pte_t *pte_ptr;
-    lookup_result_t lookup_result = find_frame(
+    uint32_t p_addr;
+    if (find_frame(
         page_dir,
         v_addr,
-        &pde_ptr,
+        NULL,
         &pte_ptr,
-        NULL
-    );
-    // Should be either NONPRESENT_PDE or NONPRESENT_PTE.
-    // In the former case, a page table will be created.
-    if (lookup_result == NONPRESENT_PDE) {
-        pte_t *page_table = (pte_t *)smemalign(PAGE_SIZE, PAGE_SIZE);
-        if (page_table == NULL) {
-            return -1;
-        }
-        for (uint32_t i = 0; i < PTE_COUNT; i++) {
-            // other PTEs inherit the PDE's available bits
-            page_table[i] = (pte_t){
-                .available = pde_ptr->available
-            };
-        }
-        *pde_ptr = (pde_t){
-            .pt_addr = ((uint32_t)page_table) >> PAGE_SHIFT,
-            .us = 1,
-            .p = 1,
-            .rw = READ_WRITE
-        };
-        pte_ptr = &(page_table[(v_addr >> PAGE_SHIFT) % PTE_COUNT]);
-    } else {
-        if (lookup_result != NONPRESENT_PTE) {
-            return -1;
-        }
+        &p_addr
+    ) != PHYSICAL_FRAME_MAPPED) {
+        return -1;
     }
-    uint32_t p_addr;
-    if (alloc_frame(&p_addr) < 0) {
+    if (p_addr == get_zero_frame() || pte_ptr->available != PAGE_PRIVATE) {
         return -1;
     }
-    *pte_ptr = (pte_t){
-        .p = 1,
-        .page_addr = p_addr >> PAGE_SHIFT,
-        .us = 1,
-        .rw = READ_WRITE
-    };
+    // never wait for the lock, since this runs in interrupt context
+    if (mutex_try_lock(&vm_lock) < 0) {
+        return -1;
+    }
+    bool private = frame_ref_counts[p_addr / PAGE_SIZE] == 1;
+    mutex_unlock(&vm_lock);
+    if (!private) {
+        return -1;
+    }
+    if (pte_ptr->dirty == 1) {
+        // The page is still being written. See if it settles down by the
+        // next time.
+        pte_ptr->dirty = 0;
+        invalidate_page(page_dir, page);
+        return -1;
+    }
+    *p_addr_ptr = p_addr;
     return 0;
 }
 
-int map_zero_frame(pde_t *page_dir, uint32_t v_addr) {
-    if (page_dir == NULL) {
+int merge_frame(
+    pde_t *page_dir,
+    uint32_t v_addr,
+    uint32_t p_addr,
+    uint32_t target_p_addr
+) {
+    if (page_dir == NULL || p_addr == target_p_addr) {
         return -1;
     }
     uint32_t page = (v_addr >> PAGE_SHIFT) << PAGE_SHIFT;
     if (page < USER_PAGE_START) {
         return -1;
     }
-    pde_t *pde_ptr;
     pte_t *pte_ptr;
-    lookup_result_t lookup_result = find_frame(
-        page_dir,
-        v_addr,
-        &pde_ptr,
-        &pte_ptr,
-        NULL
-    );
-    // Should be either NONPRESENT_PDE or NONPRESENT_PTE.
-    // In the former case, a page table will be created.
-    if (lookup_result == NONPRESENT_PDE) {
-        pte_t *page_table = (pte_t *)smemalign(PAGE_SIZE, PAGE_SIZE);
-        if (page_table == NULL) {
-            return -1;
-        }
-        for (uint32_t i = 0; i < PTE_COUNT; i++) {
-            // other PTEs inherit the PDE's available bits
-            page_table[i] = (pte_t){
-                .available = pde_ptr->available
-            };
-        }
-        *pde_ptr = (pde_t){
-            .pt_addr = ((uint32_t)page_table) >> PAGE_SHIFT,
-            .us = 1,
-            .p = 1,
-            .rw = READ_WRITE
-        };
-        pte_ptr = &(page_table[(v_addr >> PAGE_SHIFT) % PTE_COUNT]);
-    } else {
-        if (lookup_result != NONPRESENT_PTE) {
+    uint32_t mapped_p_addr;
+    if (
+        find_frame(
+            page_dir,
+            v_addr,
+            NULL,
+            &pte_ptr,
+            &mapped_p_addr
+        ) != PHYSICAL_FRAME_MAPPED ||
+        mapped_p_addr != p_addr ||
+        pte_ptr->available != PAGE_PRIVATE ||
+        pte_ptr->dirty == 1
+    ) {
+        return -1;
+    }
+    if (mutex_try_lock(&vm_lock) < 0) {
+        return -1;
+    }
+    bool zero_frame = target_p_addr == get_zero_frame();
+    uint32_t target_idx = target_p_addr / PAGE_SIZE;
+    if (!zero_frame) {
+        if (
+            !is_frame_allocated(target_p_addr) ||
+            frame_ref_counts[target_idx] == FRAME_REF_COUNT_MAX
+        ) {
+            mutex_unlock(&vm_lock);
             return -1;
         }
+        frame_ref_counts[target_idx]++;
     }
+    // The zero frame is mapped as it is on demand faults. Any other
+    // frame is shared copy-on-write, like after fork. Either way the
+    // first write gets the page a frame of its own.
     *pte_ptr = (pte_t){
         .p = 1,
-        .page_addr = get_zero_frame() >> PAGE_SHIFT,
-        .us = 1,
-        .rw = READ_ONLY
+        .page_addr = target_p_addr >> PAGE_SHIFT,
+        .us = pte_ptr->us,
+        .rw = READ_ONLY,
+        .available = zero_frame ? PAGE_PRIVATE : PAGE_COPY_ON_WRITE
     };
+    invalidate_page(page_dir, page);
+    uint32_t frame_idx = p_addr / PAGE_SIZE;
+    frame_ref_counts[frame_idx]--;
+    if (frame_ref_counts[frame_idx] == 0) {
+        set_frame_bit(frame_idx);
+        free_frame_count++;
+    }
+    mutex_unlock(&vm_lock);
+    return 0;
+}
+
+int merge_zero_frame(pde_t *page_dir, uint32_t v_addr, uint32_t p_addr) {
+    return merge_frame(page_dir, v_addr, p_addr, get_zero_frame());
+}
+
+int pin_merged_frame(pde_t *page_dir, uint32_t v_addr, uint32_t p_addr) {
+    if (page_dir == NULL) {
+        return -1;
+    }
+    uint32_t page = (v_addr >> PAGE_SHIFT) << PAGE_SHIFT;
+    if (page < USER_PAGE_START) {
+        return -1;
+    }
+    pte_t *pte_ptr;
+    uint32_t mapped_p_addr;
+    if (
+        find_frame(
+            page_dir,
+            v_addr,
+            NULL,
+            &pte_ptr,
+            &mapped_p_addr
+        ) != PHYSICAL_FRAME_MAPPED ||
+        mapped_p_addr != p_addr ||
+        pte_ptr->available != PAGE_PRIVATE ||
+        pte_ptr->dirty == 1
+    ) {
+        return -1;
+    }
+    if (mutex_try_lock(&vm_lock) < 0) {
+        return -1;
+    }
+    uint32_t frame_idx = p_addr / PAGE_SIZE;
+    if (frame_ref_counts[frame_idx] == FRAME_REF_COUNT_MAX) {
+        mutex_unlock(&vm_lock);
+        return -1;
+    }
+    frame_ref_counts[frame_idx]++;
+    pte_ptr->rw = READ_ONLY;
+    pte_ptr->available = PAGE_COPY_ON_WRITE;
+    invalidate_page(page_dir, page);
+    mutex_unlock(&vm_lock);
+    return 0;
+}
+
+int unpin_merged_frame(uint32_t p_addr, bool unused_only) {
+    if (mutex_try_lock(&vm_lock) < 0) {
+        return -1;
+    }
+    uint32_t frame_idx = p_addr / PAGE_SIZE;
+    if (
+        !is_frame_allocated(p_addr) ||
+        (unused_only && frame_ref_counts[frame_idx] > 1)
+    ) {
+        mutex_unlock(&vm_lock);
+        return -1;
+    }
+    frame_ref_counts[frame_idx]--;
+    if (frame_ref_counts[frame_idx] == 0) {
+        set_frame_bit(frame_idx);
+        free_frame_count++;
+    }
+    mutex_unlock(&vm_lock);
+    return 0;
+}
+
+int peek_frame_ref_count(uint32_t p_addr, uint32_t *ref_count_ptr) {
+    if (ref_count_ptr == NULL || mutex_try_lock(&vm_lock) < 0) {
+        return -1;
+    }
+    *ref_count_ptr = is_frame_allocated(p_addr) ?
+        frame_ref_counts[p_addr / PAGE_SIZE] :
+        0;
+    mutex_unlock(&vm_lock);
     return 0;
 }
 
@@ -403,6 +1498,10 @@ int check_user_page(
             *mapping_info_ptr = PTE_NOT_PRESENT;
             break;
         }
+        case SWAPPED_PTE: {
+            *mapping_info_ptr = SWAPPED_OUT;
+            break;
+        }
         case PHYSICAL_FRAME_MAPPED: {
             if (p_addr == get_zero_frame()) {
                 *mapping_info_ptr = ZERO_FRAME_MAPPED;
@@ -418,7 +1517,7 @@ int check_user_page(
     return 0;
 }
 
-int unmap_frame(pde_t *page_dir, uint32_t v_addr) {
+int unmap_frame(pde_t *page_dir, uint32_t v_addr, tlb_batch_t *batch) {
     if (page_dir == NULL) {
         return -1;
     }
@@ -437,16 +1536,20 @@ int unmap_frame(pde_t *page_dir, uint32_t v_addr) {
     ) != PHYSICAL_FRAME_MAPPED) {
         return -1;
     }
-    // This page must have been PAGE_AVAILABLE before
-    // it was allocated a physical frame.
     *pte_ptr = (pte_t){
-        .available = PAGE_AVAILABLE
+        .p = 0
     };
-    free_frame(p_addr);
+    mark_page_stale(page_dir, page, batch);
+    tlb_batch_add_frame(batch, p_addr);
     return 0;
 }
 
-int set_access(pde_t *page_dir, uint32_t v_addr, uint32_t access) {
+int set_access(
+    pde_t *page_dir,
+    uint32_t v_addr,
+    uint32_t access,
+    tlb_batch_t *batch
+) {
     if (page_dir == NULL) {
         return -1;
     }
@@ -467,7 +1570,26 @@ int set_access(pde_t *page_dir, uint32_t v_addr, uint32_t access) {
     if (access != READ_ONLY && access != READ_WRITE) {
         return -1;
     }
-    pte_ptr->rw = access;
+    uint32_t old_access = pte_ptr->rw;
+    if (access == READ_ONLY) {
+        pte_ptr->rw = READ_ONLY;
+        pte_ptr->available = PAGE_PRIVATE;
+    } else if ((pte_ptr->page_addr << PAGE_SHIFT) == get_zero_frame()) {
+        // the zero frame is replaced by a new frame on the first write
+        pte_ptr->rw = READ_ONLY;
+    } else if (
+        pte_ptr->available == PAGE_COPY_ON_WRITE ||
+        get_frame_ref_count(pte_ptr->page_addr << PAGE_SHIFT) > 1
+    ) {
+        // a shared frame may be written only after it is copied
+        pte_ptr->rw = READ_ONLY;
+        pte_ptr->available = PAGE_COPY_ON_WRITE;
+    } else {
+        pte_ptr->rw = READ_WRITE;
+    }
+    if (pte_ptr->rw != old_access) {
+        mark_page_stale(page_dir, page, batch);
+    }
     return 0;
 }
 
@@ -489,89 +1611,281 @@ int get_access(pde_t *page_dir, uint32_t v_addr, uint32_t *access_ptr) {
     ) != PHYSICAL_FRAME_MAPPED) {
         return -1;
     }
-    *access_ptr = pte_ptr->rw;
+    *access_ptr = pte_ptr->available == PAGE_COPY_ON_WRITE ?
+        READ_WRITE :
+        pte_ptr->rw;
     return 0;
 }
 
-int set_availability(pde_t *page_dir, uint32_t v_addr, uint32_t availability) {
-    if (
-        page_dir == NULL ||
-        !(availability == PAGE_AVAILABLE || availability == PAGE_UNAVAILABLE)
-    ) {
+int share_frame(
+    pde_t *src_page_dir,
+    pde_t *dst_page_dir,
+    uint32_t v_addr,
+    tlb_batch_t *batch
+) {
+    if (src_page_dir == NULL || dst_page_dir == NULL) {
         return -1;
     }
     uint32_t page = (v_addr >> PAGE_SHIFT) << PAGE_SHIFT;
     if (page < USER_PAGE_START) {
         return -1;
     }
-    pde_t *pde_ptr;
-    pte_t *pte_ptr;
+    pte_t *src_pte_ptr;
+    uint32_t p_addr;
+    if (find_frame(
+        src_page_dir,
+        v_addr,
+        NULL,
+        &src_pte_ptr,
+        &p_addr
+    ) != PHYSICAL_FRAME_MAPPED) {
+        return -1;
+    }
+    pde_t *dst_pde_ptr;
+    pte_t *dst_pte_ptr;
     lookup_result_t lookup_result = find_frame(
-        page_dir,
+        dst_page_dir,
         v_addr,
-        &pde_ptr,
-        &pte_ptr,
+        &dst_pde_ptr,
+        &dst_pte_ptr,
         NULL
     );
+    // Should be either NONPRESENT_PDE or NONPRESENT_PTE.
+    // In the former case, a page table will be created.
     if (lookup_result == NONPRESENT_PDE) {
-        if (pde_ptr->available == availability) {
-            return 0;
-        }
-        pte_t *page_table = (pte_t *)smemalign(PAGE_SIZE, PAGE_SIZE);
-        if (page_table == NULL) {
+        dst_pte_ptr = make_page_table(dst_pde_ptr, v_addr);
+        if (dst_pte_ptr == NULL) {
             return -1;
         }
-        for (uint32_t i = 0; i < PTE_COUNT; i++) {
-            // other PTEs inherit the PDE's available bits
-            page_table[i] = (pte_t){
-                .available = pde_ptr->available
-            };
-        }
-        *pde_ptr = (pde_t){
-            .pt_addr = ((uint32_t)page_table) >> PAGE_SHIFT,
-            .us = 1,
-            .p = 1,
-            .rw = READ_WRITE
-        };
-        pte_ptr = &(page_table[(v_addr >> PAGE_SHIFT) % PTE_COUNT]);
     } else {
         if (lookup_result != NONPRESENT_PTE) {
             return -1;
         }
     }
-    pte_ptr->available = availability;
+    if (ref_frame(p_addr) < 0) {
+        return -1;
+    }
+    if (src_pte_ptr->rw == READ_WRITE) {
+        src_pte_ptr->rw = READ_ONLY;
+        src_pte_ptr->available = PAGE_COPY_ON_WRITE;
+        mark_page_stale(src_page_dir, page, batch);
+    }
+    *dst_pte_ptr = (pte_t){
+        .p = 1,
+        .page_addr = p_addr >> PAGE_SHIFT,
+        .us = 1,
+        .rw = READ_ONLY,
+        .available = src_pte_ptr->available
+    };
+    return 0;
+}
+
+int copy_frame(pde_t *page_dir, uint32_t v_addr) {
+    uint32_t page = (v_addr >> PAGE_SHIFT) << PAGE_SHIFT;
+    uint32_t access;
+    uint32_t p_addr;
+    if (
+        get_access(
+            (pde_t *)((get_cr3() >> PAGE_SHIFT) << PAGE_SHIFT),
+            page,
+            &access
+        ) < 0 ||
+        alloc_frame(&p_addr) < 0
+    ) {
+        return -1;
+    }
+    copy_to_frame(p_addr, (void *)page);
+    if (map_frame(page_dir, page, p_addr) < 0) {
+        free_frame(p_addr);
+        return -1;
+    }
+    set_access(page_dir, page, access, NULL);
     return 0;
 }
 
-int get_availability(pde_t *page_dir, uint32_t v_addr, uint32_t *availability_ptr) {
-    if (page_dir == NULL || availability_ptr == NULL) {
+int copy_on_write(pde_t *page_dir, uint32_t v_addr) {
+    if (page_dir == NULL) {
         return -1;
     }
     uint32_t page = (v_addr >> PAGE_SHIFT) << PAGE_SHIFT;
     if (page < USER_PAGE_START) {
         return -1;
     }
-    pde_t *pde_ptr;
     pte_t *pte_ptr;
-    lookup_result_t lookup_result = find_frame(
-        page_dir,
-        v_addr,
-        &pde_ptr,
-        &pte_ptr,
-        NULL
-    );
-    switch (lookup_result) {
-        case NONPRESENT_PDE: {
-            // When the PDE is nonpresent, its available bits 
-            // stand for all its PTE's.
-            *availability_ptr = pde_ptr->available;
-            break;
+    uint32_t p_addr;
+    if (
+        find_frame(
+            page_dir,
+            v_addr,
+            NULL,
+            &pte_ptr,
+            &p_addr
+        ) != PHYSICAL_FRAME_MAPPED ||
+        pte_ptr->available != PAGE_COPY_ON_WRITE
+    ) {
+        return -1;
+    }
+    if (get_frame_ref_count(p_addr) > 1) {
+        // copy only the page being written
+        uint32_t new_p_addr;
+        if (alloc_frame(&new_p_addr) < 0) {
+            return -1;
         }
-        case NONPRESENT_PTE: {
-            *availability_ptr = pte_ptr->available;
-            break;
+        copy_to_frame(new_p_addr, (void *)page);
+        pte_ptr->page_addr = new_p_addr >> PAGE_SHIFT;
+        free_frame(p_addr);
+    }
+    // the last user of the frame takes it over
+    pte_ptr->rw = READ_WRITE;
+    pte_ptr->available = PAGE_PRIVATE;
+    invalidate_page(page_dir, page);
+    return 0;
+}
+
+void page_iter_init(
+    page_iter_t *iter_ptr,
+    pde_t *page_dir,
+    uint32_t addr,
+    uint32_t size
+) {
+    uint64_t start = (addr >> PAGE_SHIFT) << PAGE_SHIFT;
+    if (start < USER_PAGE_START) {
+        start = USER_PAGE_START;
+    }
+    uint64_t end = (uint64_t)addr + (uint64_t)size;
+    if (end > USER_MEM_END) {
+        end = USER_MEM_END;
+    }
+    *iter_ptr = (page_iter_t){
+        .page_dir = page_dir,
+        .next = start,
+        .end = end
+    };
+}
+
+bool page_iter_next(page_iter_t *iter_ptr) {
+    if (iter_ptr->page_dir == NULL || iter_ptr->next >= iter_ptr->end) {
+        return false;
+    }
+    uint32_t page = iter_ptr->next;
+    pde_t *pde_ptr = &(iter_ptr->page_dir[(page >> PAGE_SHIFT) / PTE_COUNT]);
+    iter_ptr->page = page;
+    iter_ptr->span = PAGE_SIZE;
+    if (pde_ptr->p == 0) {
+        // cover the rest of the PDE in one step
+        uint64_t pde_end =
+            ((uint64_t)page / LARGE_PAGE_SIZE + 1) * LARGE_PAGE_SIZE;
+        if (pde_end > iter_ptr->end) {
+            pde_end = (
+                (iter_ptr->end + PAGE_SIZE - 1) >> PAGE_SHIFT
+            ) << PAGE_SHIFT;
         }
-        default: {
+        iter_ptr->span = pde_end - page;
+        iter_ptr->mapping_info = PDE_NOT_PRESENT;
+    } else {
+        pte_t *pte_ptr = &(
+            ((pte_t *)(pde_ptr->pt_addr << PAGE_SHIFT))
+                [(page >> PAGE_SHIFT) % PTE_COUNT]
+        );
+        if (pte_ptr->p == 0) {
+            iter_ptr->mapping_info = pte_ptr->available == PAGE_SWAPPED ?
+                SWAPPED_OUT :
+                PTE_NOT_PRESENT;
+        } else {
+            iter_ptr->mapping_info =
+                (pte_ptr->page_addr << PAGE_SHIFT) == get_zero_frame() ?
+                ZERO_FRAME_MAPPED :
+                NEW_FRAME_MAPPED;
+            iter_ptr->access = pte_ptr->available == PAGE_COPY_ON_WRITE ?
+                READ_WRITE :
+                pte_ptr->rw;
+        }
+    }
+    iter_ptr->next = (uint64_t)page + iter_ptr->span;
+    return true;
+}
+
+int map_range(pde_t *page_dir, uint32_t addr, uint32_t size, bool zero_frame) {
+    if (page_dir == NULL || (size > 0 && addr < USER_PAGE_START)) {
+        return -1;
+    }
+    page_iter_t iter;
+    page_iter_init(&iter, page_dir, addr, size);
+    while (page_iter_next(&iter)) {
+        if (
+            iter.mapping_info != PDE_NOT_PRESENT &&
+            iter.mapping_info != PTE_NOT_PRESENT
+        ) {
+            continue;
+        }
+        for (uint32_t i = 0; i < iter.span; i += PAGE_SIZE) {
+            if (zero_frame) {
+                if (map_zero_frame(page_dir, iter.page + i) < 0) {
+                    return -1;
+                }
+            } else {
+                if (map_new_frame(page_dir, iter.page + i) < 0) {
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+int unmap_range(
+    pde_t *page_dir,
+    uint32_t addr,
+    uint32_t size,
+    tlb_batch_t *batch
+) {
+    if (page_dir == NULL || (size > 0 && addr < USER_PAGE_START)) {
+        return -1;
+    }
+    page_iter_t iter;
+    page_iter_init(&iter, page_dir, addr, size);
+    while (page_iter_next(&iter)) {
+        if (
+            iter.mapping_info == ZERO_FRAME_MAPPED ||
+            iter.mapping_info == NEW_FRAME_MAPPED
+        ) {
+            if (unmap_frame(page_dir, iter.page, batch) < 0) {
+                return -1;
+            }
+        } else if (iter.mapping_info == SWAPPED_OUT) {
+            uint32_t slot;
+            if (
+                get_swap_slot(page_dir, iter.page, &slot) < 0 ||
+                unmap_swap_slot(page_dir, iter.page) < 0
+            ) {
+                return -1;
+            }
+            free_swap_slot(slot);
+        }
+    }
+    return 0;
+}
+
+int protect_range(
+    pde_t *page_dir,
+    uint32_t addr,
+    uint32_t size,
+    uint32_t access,
+    tlb_batch_t *batch
+) {
+    if (page_dir == NULL || (size > 0 && addr < USER_PAGE_START)) {
+        return -1;
+    }
+    page_iter_t iter;
+    page_iter_init(&iter, page_dir, addr, size);
+    while (page_iter_next(&iter)) {
+        if (
+            (
+                iter.mapping_info == ZERO_FRAME_MAPPED ||
+                iter.mapping_info == NEW_FRAME_MAPPED
+            ) &&
+            set_access(page_dir, iter.page, access, batch) < 0
+        ) {
             return -1;
         }
     }
@@ -596,6 +1910,14 @@ lookup_result_t find_frame(
     {
         return NONPRESENT_PDE;
     }
+    if (page_dir[pde_idx].ps == 1) {
+        if (p_addr_holder != NULL) {
+            *p_addr_holder = (
+                page_dir[pde_idx].pt_addr + (v_addr >> PAGE_SHIFT) % PTE_COUNT
+            ) << PAGE_SHIFT;
+        }
+        return LARGE_FRAME_MAPPED;
+    }
     pte_t *pt = (pte_t *)(page_dir[pde_idx].pt_addr << PAGE_SHIFT);
     uint32_t pte_idx = (v_addr >> PAGE_SHIFT) % PTE_COUNT;
     if (pte_ptr_holder != NULL) {
@@ -603,7 +1925,9 @@ lookup_result_t find_frame(
     }
     if (pt[pte_idx].p == 0)
     {
-        return NONPRESENT_PTE;
+        return pt[pte_idx].available == PAGE_SWAPPED ?
+            SWAPPED_PTE :
+            NONPRESENT_PTE;
     }
     if (p_addr_holder != NULL) {
         *p_addr_holder = pt[pte_idx].page_addr << PAGE_SHIFT;
@@ -0,0 +1,309 @@
+/**
+ * @file vma.c
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief implementation of the tree of virtual memory areas
+ */
+
+#include <vma.h> // vma_t
+#include <stdint.h> // uint32_t
+#include <stdbool.h> // bool
+#include <stddef.h> // NULL
+#include <malloc.h> // malloc
+#include <page.h> // PAGE_SIZE
+#include <vm.h> // READ_WRITE
+
+// get the height of a subtree, 0 if empty
+int get_vma_height(vma_t *node_ptr);
+
+// recompute the height of a node from its children
+void update_vma_height(vma_t *node_ptr);
+
+/**
+ * @brief Restore the AVL property of a subtree whose children are
+ *        balanced and differ in height by at most 2.
+ * 
+ * @param node_ptr The root of the subtree.
+ * @return The new root of the subtree.
+ */
+vma_t *balance_vma(vma_t *node_ptr);
+
+// rotate a subtree so that its left child becomes the root
+vma_t *rotate_vma_right(vma_t *node_ptr);
+
+// rotate a subtree so that its right child becomes the root
+vma_t *rotate_vma_left(vma_t *node_ptr);
+
+// add a node to a subtree that it does not overlap, and return the new root
+vma_t *insert_vma_node(vma_t *root, vma_t *new_node_ptr);
+
+/**
+ * @brief Take the leftmost node out of a subtree.
+ * 
+ * @param root The root of the subtree, not NULL.
+ * @param min_ptr To hold the node taken out.
+ * @return The new root of the subtree.
+ */
+vma_t *remove_min_vma(vma_t *root, vma_t **min_ptr);
+
+/**
+ * @brief Take the node that starts at a page out of a subtree and free it.
+ * 
+ * @param root The root of the subtree.
+ * @param start The first page of the node.
+ * @param found_ptr Set to true if such a node is found.
+ * @return The new root of the subtree.
+ */
+vma_t *remove_vma_node(vma_t *root, uint32_t start, bool *found_ptr);
+
+int get_vma_height(vma_t *node_ptr) {
+    return node_ptr == NULL ? 0 : node_ptr->height;
+}
+
+void update_vma_height(vma_t *node_ptr) {
+    int left_height = get_vma_height(node_ptr->left);
+    int right_height = get_vma_height(node_ptr->right);
+    node_ptr->height =
+        (left_height > right_height ? left_height : right_height) + 1;
+}
+
+vma_t *rotate_vma_right(vma_t *node_ptr) {
+    vma_t *new_root = node_ptr->left;
+    node_ptr->left = new_root->right;
+    new_root->right = node_ptr;
+    update_vma_height(node_ptr);
+    update_vma_height(new_root);
+    return new_root;
+}
+
+vma_t *rotate_vma_left(vma_t *node_ptr) {
+    vma_t *new_root = node_ptr->right;
+    node_ptr->right = new_root->left;
+    new_root->left = node_ptr;
+    update_vma_height(node_ptr);
+    update_vma_height(new_root);
+    return new_root;
+}
+
+vma_t *balance_vma(vma_t *node_ptr) {
+    update_vma_height(node_ptr);
+    int balance =
+        get_vma_height(node_ptr->left) - get_vma_height(node_ptr->right);
+    if (balance > 1) {
+        if (
+            get_vma_height(node_ptr->left->left) <
+            get_vma_height(node_ptr->left->right)
+        ) {
+            node_ptr->left = rotate_vma_left(node_ptr->left);
+        }
+        return rotate_vma_right(node_ptr);
+    }
+    if (balance < -1) {
+        if (
+            get_vma_height(node_ptr->right->right) <
+            get_vma_height(node_ptr->right->left)
+        ) {
+            node_ptr->right = rotate_vma_right(node_ptr->right);
+        }
+        return rotate_vma_left(node_ptr);
+    }
+    return node_ptr;
+}
+
+vma_t *insert_vma_node(vma_t *root, vma_t *new_node_ptr) {
+    if (root == NULL) {
+        return new_node_ptr;
+    }
+    if (new_node_ptr->start < root->start) {
+        root->left = insert_vma_node(root->left, new_node_ptr);
+    } else {
+        root->right = insert_vma_node(root->right, new_node_ptr);
+    }
+    return balance_vma(root);
+}
+
+vma_t *remove_min_vma(vma_t *root, vma_t **min_ptr) {
+    if (root->left == NULL) {
+        *min_ptr = root;
+        return root->right;
+    }
+    root->left = remove_min_vma(root->left, min_ptr);
+    return balance_vma(root);
+}
+
+vma_t *remove_vma_node(vma_t *root, uint32_t start, bool *found_ptr) {
+    if (root == NULL) {
+        return NULL;
+    }
+    if (start < root->start) {
+        root->left = remove_vma_node(root->left, start, found_ptr);
+    } else if (start > root->start) {
+        root->right = remove_vma_node(root->right, start, found_ptr);
+    } else {
+        *found_ptr = true;
+        vma_t *left = root->left;
+        vma_t *right = root->right;
+        unreserve_frames(root->reserved_count);
+        free(root);
+        if (right == NULL) {
+            return left;
+        }
+        // the successor takes the place of the removed node
+        vma_t *successor;
+        right = remove_min_vma(right, &successor);
+        successor->left = left;
+        successor->right = right;
+        return balance_vma(successor);
+    }
+    return balance_vma(root);
+}
+
+vma_t *find_vma(vma_t *root, uint32_t addr) {
+    vma_t *node_ptr = root;
+    while (node_ptr != NULL) {
+        if (addr < node_ptr->start) {
+            node_ptr = node_ptr->left;
+        } else if (addr >= node_ptr->end) {
+            node_ptr = node_ptr->right;
+        } else {
+            return node_ptr;
+        }
+    }
+    return NULL;
+}
+
+vma_t *find_vma_after(vma_t *root, uint64_t addr) {
+    vma_t *found_ptr = NULL;
+    vma_t *node_ptr = root;
+    while (node_ptr != NULL) {
+        if (node_ptr->end > addr) {
+            found_ptr = node_ptr;
+            node_ptr = node_ptr->left;
+        } else {
+            node_ptr = node_ptr->right;
+        }
+    }
+    return found_ptr;
+}
+
+bool is_vma_range(vma_t *root, uint32_t addr, uint32_t size, uint32_t access) {
+    uint64_t current = addr;
+    uint64_t end = (uint64_t)addr + (uint64_t)size;
+    while (current < end) {
+        vma_t *vma_ptr = find_vma(root, current);
+        if (
+            vma_ptr == NULL ||
+            (access == READ_WRITE && vma_ptr->access != READ_WRITE)
+        ) {
+            return false;
+        }
+        current = vma_ptr->end;
+    }
+    return true;
+}
+
+int insert_vma(
+    vma_t **root_ptr,
+    uint32_t addr,
+    uint32_t size,
+    uint32_t access,
+    vma_type_t type,
+    vma_backing_t backing
+) {
+    if (root_ptr == NULL || size == 0) {
+        return -1;
+    }
+    uint32_t start = (addr >> PAGE_SHIFT) << PAGE_SHIFT;
+    uint64_t end = (
+        ((uint64_t)addr + (uint64_t)size + PAGE_SIZE - 1) >> PAGE_SHIFT
+    ) << PAGE_SHIFT;
+    // the kernel window is no place for an area
+    if (end > USER_MEM_END) {
+        return -1;
+    }
+    // the first area that ends after start must also start after end
+    vma_t *next_ptr = find_vma_after(*root_ptr, start);
+    if (next_ptr != NULL && next_ptr->start < end) {
+        return -1;
+    }
+    vma_t *new_node_ptr = malloc(sizeof(vma_t));
+    if (new_node_ptr == NULL) {
+        return -1;
+    }
+    *new_node_ptr = (vma_t){
+        .start = start,
+        .end = end,
+        .access = access,
+        .type = type,
+        .backing = backing,
+        .reserved_count = 0,
+        .next_fault_page = 0,
+        .fault_around_pages = 0,
+        .write_intent = false,
+        .left = NULL,
+        .right = NULL,
+        .height = 1
+    };
+    *root_ptr = insert_vma_node(*root_ptr, new_node_ptr);
+    return 0;
+}
+
+int reserve_vma_frames(vma_t *vma_ptr) {
+    uint32_t page_count = (vma_ptr->end - vma_ptr->start) / PAGE_SIZE;
+    if (reserve_frames(page_count) < 0) {
+        return -1;
+    }
+    vma_ptr->reserved_count = page_count;
+    return 0;
+}
+
+int remove_vma(vma_t **root_ptr, uint32_t start) {
+    if (root_ptr == NULL) {
+        return -1;
+    }
+    bool found = false;
+    *root_ptr = remove_vma_node(*root_ptr, start, &found);
+    return found ? 0 : -1;
+}
+
+int copy_vma_tree(vma_t *root, vma_t **copy_ptr) {
+    if (copy_ptr == NULL) {
+        return -1;
+    }
+    if (root == NULL) {
+        *copy_ptr = NULL;
+        return 0;
+    }
+    vma_t *left_copy;
+    if (copy_vma_tree(root->left, &left_copy) < 0) {
+        return -1;
+    }
+    vma_t *right_copy;
+    if (copy_vma_tree(root->right, &right_copy) < 0) {
+        destroy_vma_tree(&left_copy);
+        return -1;
+    }
+    vma_t *node_copy = malloc(sizeof(vma_t));
+    if (node_copy == NULL || reserve_frames(root->reserved_count) < 0) {
+        free(node_copy);
+        destroy_vma_tree(&left_copy);
+        destroy_vma_tree(&right_copy);
+        return -1;
+    }
+    *node_copy = *root;
+    node_copy->left = left_copy;
+    node_copy->right = right_copy;
+    *copy_ptr = node_copy;
+    return 0;
+}
+
+void destroy_vma_tree(vma_t **root_ptr) {
+    if (root_ptr == NULL || *root_ptr == NULL) {
+        return;
+    }
+    destroy_vma_tree(&((*root_ptr)->left));
+    destroy_vma_tree(&((*root_ptr)->right));
+    unreserve_frames((*root_ptr)->reserved_count);
+    free(*root_ptr);
+    *root_ptr = NULL;
+}
@@ -0,0 +1,51 @@
+/**
+ * @file wait_queue.c
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief queues of threads waiting on a kernel object
+ * 
+ * A thread waiting on a queue is in WAITING_STATE, with the queue
+ * recorded in its blocking detail, so that alter_state takes it out of
+ * the queue whenever it becomes runnable.
+ */
+
+#include <wait_queue.h> // wait_queue_t
+#include <ctrl_blk.h> // tcb_t
+#include <scheduler.h> // find_next_thread
+#include <context_switcher.h> // switch_context
+#include <variable_queue.h> // Q_GET_FRONT
+#include <stddef.h> // NULL
+
+void init_wait_queue(wait_queue_t *queue_ptr) {
+    Q_INIT_HEAD(queue_ptr);
+}
+
+int wait_on_queue(wait_queue_t *queue_ptr, int reason, tcb_t *next_tcb_ptr) {
+    if (next_tcb_ptr == NULL) {
+        next_tcb_ptr = find_next_thread();
+        if (next_tcb_ptr == NULL) {
+            return -1;
+        }
+    }
+    blocking_detail_t blocking_detail = {
+        .reason = reason,
+        .wait_queue_ptr = queue_ptr
+    };
+    return switch_context(next_tcb_ptr, WAITING_STATE, &blocking_detail);
+}
+
+tcb_t *wake_one(wait_queue_t *queue_ptr) {
+    tcb_t *tcb_ptr = Q_GET_FRONT(queue_ptr);
+    if (tcb_ptr != NULL) {
+        alter_state(tcb_ptr, READY_STATE, NULL);
+    }
+    return tcb_ptr;
+}
+
+int wake_all(wait_queue_t *queue_ptr) {
+    int count = 0;
+    while (wake_one(queue_ptr) != NULL) {
+        count++;
+    }
+    return count;
+}
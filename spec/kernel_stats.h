@@ -0,0 +1,60 @@
+/**
+ * @file kernel_stats.h
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief what get_kernel_stats reports, shared by the kernel and users
+ */
+
+#ifndef _KERNEL_STATS_H
+#define _KERNEL_STATS_H
+
+#include <stdint.h> /* uint32_t */
+
+/* how many object caches get_kernel_stats reports at most */
+#define KERNEL_STATS_CACHE_MAX (8)
+/* room for the name of a cache, including the NUL */
+#define KERNEL_STATS_NAME_LEN (16)
+
+/* how a kernel object cache has been used, see slab_stats_t in the
+ * kernel */
+typedef struct kernel_cache_stats_t {
+    char name[KERNEL_STATS_NAME_LEN];
+    uint32_t object_size;
+    uint32_t in_use_count;
+    uint32_t alloc_count;
+    uint32_t free_count;
+    uint32_t slab_count;
+    uint32_t grow_count;
+} kernel_cache_stats_t;
+
+typedef struct kernel_stats_t {
+    /* how far demand faults of the calling process map ahead, and how
+     * well it has paid off */
+    uint32_t fault_around_pages_max;
+    uint32_t demand_fault_count;
+    uint32_t mapped_ahead_count;
+
+    /* pages merged across processes and guests, see merge_stats_t in
+     * the kernel */
+    uint32_t merge_scanned_count;
+    uint32_t merge_merged_count;
+    uint32_t merge_zero_merged_count;
+    uint32_t merge_stable_frame_count;
+    uint32_t merge_saved_frame_count;
+
+    /* the first cache_count entries of caches are filled in */
+    uint32_t cache_count;
+    kernel_cache_stats_t caches[KERNEL_STATS_CACHE_MAX];
+
+    /* page directory and page table pages served from the pool, and
+     * those asked for while it was empty */
+    uint32_t paging_pool_hit_count;
+    uint32_t paging_pool_miss_count;
+
+    /* zeroed frames taken from the pool kept aside for page faults, and
+     * those cleared on the spot because it was empty */
+    uint32_t zeroed_pool_hit;
+    uint32_t zeroed_pool_miss;
+} kernel_stats_t;
+
+#endif /* _KERNEL_STATS_H */
@@ -66,4 +66,10 @@
 #define SYSCALL_RESERVED_15       0x8F
 #define SYSCALL_RESERVED_END      0x8F
 
+/* Extensions living in the reserved range */
+#define FUTEX_WAIT_INT      SYSCALL_RESERVED_0
+#define FUTEX_WAKE_INT      SYSCALL_RESERVED_1
+#define SET_FAULT_AROUND_INT SYSCALL_RESERVED_2
+#define GET_KERNEL_STATS_INT SYSCALL_RESERVED_3
+
 #endif /* _SYSCALL_INT_H */
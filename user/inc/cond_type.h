@@ -5,15 +5,15 @@
 #ifndef _COND_TYPE_H
 #define _COND_TYPE_H
 
-#include <linked_list.h>
+#include <mutex_type.h>
 
 typedef struct cond {
 
   // Mutex to lock the struct and modify internal states
   mutex_t lock;
 
-  // Head of the list storing waiting threads
-  list_node *tid_head;
+  // Bumped by every signal and broadcast, waiters sleep on it
+  int sequence;
 
 } cond_t;
 
@@ -0,0 +1,24 @@
+#ifndef __FUTEX_SYSCALL_H__
+#define __FUTEX_SYSCALL_H__
+
+/**
+ * @brief the stub for the futex_wait system call
+ * 
+ * @param addr the address of a word aligned to four bytes
+ * @param val the value the word is expected to hold
+ * @return 0 after being woken up by futex_wake, a negative value right
+ *         away if the word does not hold val or addr is invalid
+ */
+int futex_wait(int *addr, int val);
+
+/**
+ * @brief the stub for the futex_wake system call
+ * 
+ * @param addr the address of a word aligned to four bytes
+ * @param count the most threads waiting on the word to wake up
+ * @return the number of threads woken up, a negative value if addr or
+ *         count is invalid
+ */
+int futex_wake(int *addr, int count);
+
+#endif /* __FUTEX_SYSCALL_H__ */
@@ -0,0 +1,23 @@
+#ifndef __KERNEL_STATS_SYSCALL_H__
+#define __KERNEL_STATS_SYSCALL_H__
+
+#include <kernel_stats.h>
+
+/**
+ * @brief the stub for the set_fault_around system call
+ * 
+ * @param pages the most pages a demand fault of the calling task may
+ *              map ahead, from 0 to 64
+ * @return 0 on success, a negative value if pages is out of range
+ */
+int set_fault_around(int pages);
+
+/**
+ * @brief the stub for the get_kernel_stats system call
+ * 
+ * @param stats where to store a snapshot of the statistics
+ * @return 0 on success, a negative value if stats is invalid
+ */
+int get_kernel_stats(kernel_stats_t *stats);
+
+#endif /* __KERNEL_STATS_SYSCALL_H__ */
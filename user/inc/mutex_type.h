@@ -7,10 +7,11 @@
 
 #define UNLOCKED    (1)
 #define LOCKED      (0)
+// locked, and threads may be sleeping on the lock state
+#define CONTENDED   (2)
 
 typedef struct mutex {
     int lock_state;
-    int tid;
 } mutex_t;
 
 #endif /* _MUTEX_TYPE_H */
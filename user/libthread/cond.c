@@ -3,16 +3,23 @@
  * @brief implementations of the basic conditional variable functions
  * using the mutex library.
  * 
+ * Waiters sleep with futex_wait on a sequence number, which every signal
+ * and broadcast bumps before waking threads up. A waiter reads the number
+ * before releasing its mutex, so a signal sent after that makes
+ * futex_wait return right away instead of being lost.
+ * 
  * @author Tony Xi (xiaolix)
  * @author Zekun Ma (zekun)
  * @bug No known bug.
  */
 
-#include <syscall.h>
 #include <cond.h>
+#include <mutex.h>
 #include <stddef.h>
-#include <thread.h>
-#include <stdbool.h>
+#include <futex_syscall.h>
+
+// more threads than there can ever be, for futex_wake to wake them all
+#define WAKE_ALL (0x7FFFFFFF)
 
 /**
  * @brief Initialize the condition variable pointed to by cv. 
@@ -27,7 +34,7 @@
  */
 int cond_init( cond_t *cv ){
     if(cv == NULL || mutex_init(&(cv->lock)) < 0)    return -1;
-    cv->tid_head = NULL;
+    cv->sequence = 0;
     return 0;
 }
 
@@ -44,9 +51,6 @@ int cond_init( cond_t *cv ){
  */
 void cond_destroy( cond_t *cv ){
     if(cv==NULL)   return;
-    while (cv->tid_head != NULL) {
-        cv->tid_head = remove_node(cv->tid_head, cv->tid_head);
-    }
     mutex_destroy(&(cv->lock));
 }
 
@@ -67,25 +71,14 @@ void cond_wait( cond_t *cv, mutex_t *mp ){
         return; 
     }
 
-    // Obtain tid and create node ptr
-    int tid = thr_getid();
-    list_node *my_node;
-
-    // Lock the cond_t and append an entry to list
+    // Take the sequence number while still holding mp
     mutex_lock(&(cv->lock));
-    cv->tid_head = append_node(cv->tid_head, (void*)tid);
-    my_node = cv->tid_head->previous;
+    int sequence = cv->sequence;
     mutex_unlock(&(cv->lock));
-    
-    // Release mp and wait
+
+    // Release mp and wait, unless a signal has come in meanwhile
     mutex_unlock(mp);
-    int reject = 0;
-    if(deschedule(&reject) < 0) {
-        // Pointer contaminated, remove entry from list
-        mutex_lock(&(cv->lock));
-        cv->tid_head = remove_node(cv->tid_head, my_node);
-        mutex_unlock(&(cv->lock));
-    }
+    futex_wait(&(cv->sequence), sequence);
     mutex_lock(mp);
 }
 
@@ -98,29 +91,11 @@ void cond_wait( cond_t *cv, mutex_t *mp ){
  */
 void cond_signal( cond_t *cv ){
     if(cv==NULL)   return;
-    
-    int tid;
-    bool find_thread = false;
-    
-    // Grab thread info if list is not empty
+
     mutex_lock(&(cv->lock));
-    if(cv->tid_head){
-        find_thread = true;
-        tid = (int) cv->tid_head->data;
-        cv->tid_head = remove_node(cv->tid_head, cv->tid_head);
-    }
+    cv->sequence++;
     mutex_unlock(&(cv->lock));
-    
-    // Attempt to wake only if thread is in list
-    if (find_thread) {
-
-        // Keep trying until thread is awoken
-        while (make_runnable(tid))
-        {
-            // Yield to thread if it hasn't been descheduled yet
-            thr_yield(tid);
-        }
-    }
+    futex_wake(&(cv->sequence), 1);
 }
 
 /**
@@ -135,27 +110,10 @@ void cond_signal( cond_t *cv ){
 void cond_broadcast( cond_t *cv ){
     if(cv==NULL)   return;
 
-    list_node *waiting_threads = NULL;
+    // Threads that start waiting after this see the new number and
+    // sleep until the next signal
     mutex_lock(&(cv->lock));
-    waiting_threads = cv->tid_head;
-
-    // Set list of cv to NULL
-    cv->tid_head = NULL;
+    cv->sequence++;
     mutex_unlock(&(cv->lock));
-
-    // loop until no entry is left in the list
-    while (waiting_threads){
-        // grab tid of the first entry in list
-        int tid = (int) waiting_threads->data;
-
-        // keep trying to wake said thread
-        while (make_runnable(tid))
-        {
-            // yield to thread if it has not been descheduled
-            thr_yield(tid);
-        }
-
-        // free the resource from detached list  
-        waiting_threads = remove_node(waiting_threads, waiting_threads);
-    }
-}
\ No newline at end of file
+    futex_wake(&(cv->sequence), WAKE_ALL);
+}
@@ -3,6 +3,11 @@
  * @brief implementations of the basic mutex functions
  * using the atomic xchg assembly instruction
  * 
+ * An uncontended lock or unlock is a single xchg. Threads that find
+ * the mutex locked mark it contended and sleep on the lock state with
+ * futex_wait, and only an unlock that finds it contended enters the
+ * kernel to wake one of them up.
+ * 
  * @author Tony Xi (xiaolix)
  * @author Zekun Ma (zekun)
  * @bug No known bug.
@@ -11,8 +16,7 @@
 #include <mutex.h>
 #include <xchange_stub.h>
 #include <stddef.h>
-#include <thread.h>
-#include <simics.h>
+#include <futex_syscall.h>
 
 /**
  * @brief This function should initialize the mutex pointed to by
@@ -28,7 +32,6 @@
 int mutex_init(mutex_t *mp) {
     if (mp == NULL)
         return -1;
-    mp->tid = -1;
     mp->lock_state = UNLOCKED;
     return 0;
 }
@@ -63,11 +66,15 @@ void mutex_lock(mutex_t *mp) {
     if (mp == NULL)
         return;
 
-    while (xchange(&(mp->lock_state), LOCKED) != UNLOCKED) {
-        thr_yield(mp->tid);
-    }
+    if (xchange(&(mp->lock_state), LOCKED) == UNLOCKED)
+        return;
 
-    mp->tid = thr_getid();
+    // The xchg above may have overwritten CONTENDED, so mark it again
+    // before sleeping. Whoever gets the lock from here on unlocks it as
+    // contended, waking up the remaining sleepers in turn.
+    while (xchange(&(mp->lock_state), CONTENDED) != UNLOCKED) {
+        futex_wait(&(mp->lock_state), CONTENDED);
+    }
 }
 
 
@@ -87,6 +94,6 @@ void mutex_unlock(mutex_t *mp) {
     if (mp == NULL)
         return;
 
-    mp->tid = -1;
-    xchange(&(mp->lock_state), UNLOCKED);
+    if (xchange(&(mp->lock_state), UNLOCKED) == CONTENDED)
+        futex_wake(&(mp->lock_state), 1);
 }
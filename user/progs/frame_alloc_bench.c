@@ -0,0 +1,82 @@
+/**
+ * @file frame_alloc_bench.c
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief A microbenchmark for the physical frame allocator.
+ *
+ * It repeatedly asks for as many pages as the kernel will hand out,
+ * touches each of them, and gives them back, reporting how many ticks
+ * every round takes. A round stresses both the single frame path (the
+ * page faults of touching) and the bulk paths (new_pages and
+ * remove_pages).
+ */
+
+#include <syscall.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "410_tests.h"
+#include <report.h>
+
+DEF_TEST_NAME("frame_alloc_bench:");
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+
+// where the benchmark asks for memory
+#define BENCH_BASE ((char *)0x40000000)
+// the largest region the benchmark asks for
+#define BENCH_MAX_LEN (256 * 1024 * 1024)
+// how many allocate/free rounds to run
+#define BENCH_ROUNDS (8)
+
+/**
+ * @brief This function finds the largest region new_pages grants,
+ *        halving the request until it succeeds.
+ *
+ * @return The length of the region, which is mapped on return,
+ *         or 0 if not even a page could be allocated.
+ */
+int grab_region(void) {
+    int len = BENCH_MAX_LEN;
+    while (len >= PAGE_SIZE) {
+        if (!(new_pages(BENCH_BASE, len) < 0)) {
+            return len;
+        }
+        len /= 2;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    REPORT_START_CMPLT;
+
+    unsigned int total_ticks = 0;
+    int round;
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        unsigned int start = get_ticks();
+        int len = grab_region();
+        if (len == 0) {
+            REPORT_MISC("new_pages failed for a single page");
+            REPORT_END_FAIL;
+            exit(-1);
+        }
+        int offset;
+        for (offset = 0; offset < len; offset += PAGE_SIZE) {
+            BENCH_BASE[offset] = (char)round;
+        }
+        if (remove_pages(BENCH_BASE) < 0) {
+            REPORT_MISC("remove_pages failed");
+            REPORT_END_FAIL;
+            exit(-1);
+        }
+        unsigned int ticks = get_ticks() - start;
+        total_ticks += ticks;
+        report_fmt("round %d: %d pages in %u ticks",
+            round, len / PAGE_SIZE, ticks);
+    }
+    report_fmt("total: %u ticks for %d rounds", total_ticks, BENCH_ROUNDS);
+
+    REPORT_END_SUCCESS;
+    exit(0);
+}
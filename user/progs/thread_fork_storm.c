@@ -0,0 +1,76 @@
+/**
+ * @file thread_fork_storm.c
+ * @author Tony Xi (xiaolix)
+ * @author Zekun Ma (zekunm)
+ * @brief A stress test for the number of threads the kernel can hold.
+ *
+ * It keeps creating threads which deschedule themselves right away,
+ * until either thread creation fails or STORM_MAX_THREADS threads are
+ * alive, and reports how many threads it got. Every live thread pins
+ * a kernel stack and a TCB in the kernel heap, so the count shows how
+ * far the kernel heap can grow.
+ */
+
+#include <syscall.h>
+#include <thread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "410_tests.h"
+#include <report.h>
+
+DEF_TEST_NAME("thread_fork_storm:");
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+
+// the stack size of every thread in the storm
+#define STORM_STACK_SIZE (PAGE_SIZE)
+// stop the storm after this many threads
+#define STORM_MAX_THREADS (16384)
+// report progress every this many threads
+#define STORM_REPORT_INTERVAL (1024)
+
+// never set, so the storm threads stay descheduled
+int storm_reject = 0;
+
+/**
+ * @brief This function is the body of every storm thread. It just
+ *        sleeps forever without burning CPU.
+ *
+ * @param arg Unused.
+ * @return Never.
+ */
+void *storm_thread(void *arg) {
+    while (1) {
+        deschedule(&storm_reject);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    REPORT_START_CMPLT;
+
+    if (thr_init(STORM_STACK_SIZE) < 0) {
+        REPORT_MISC("thr_init failed");
+        REPORT_END_FAIL;
+        exit(-1);
+    }
+
+    unsigned int start = get_ticks();
+    int count = 0;
+    while (count < STORM_MAX_THREADS) {
+        if (thr_create(storm_thread, NULL) < 0) {
+            break;
+        }
+        count++;
+        if (count % STORM_REPORT_INTERVAL == 0) {
+            report_fmt("%d threads in %u ticks", count, get_ticks() - start);
+        }
+    }
+    report_fmt("ceiling: %d threads in %u ticks", count, get_ticks() - start);
+
+    REPORT_END_SUCCESS;
+    // the storm threads never exit, so take the whole task down
+    task_vanish(0);
+}